@@ -4,8 +4,8 @@
 // uncomment this if you want to handshake with a aiortc
 // #define CONFIG_DTLS_USE_ECDSA 1
 
-#define SCTP_MTU (1200)
-#define CONFIG_MTU (1300)
+#define SCTP_MTU (CONFIG_LIBPEER_SCTP_MTU)
+#define CONFIG_MTU (CONFIG_LIBPEER_CONFIG_MTU)
 
 #ifndef CONFIG_USE_LWIP
 #define CONFIG_USE_LWIP 0
@@ -34,15 +34,15 @@
 #endif
 
 #ifndef CONFIG_VIDEO_BUFFER_SIZE
-#define CONFIG_VIDEO_BUFFER_SIZE (CONFIG_MTU * CONFIG_LIBPEER_VIDEO_BUFFER_SIZE_MTUS)
+#define CONFIG_VIDEO_BUFFER_SIZE (CONFIG_MTU * CONFIG_LIBPEER_VIDEO_RB_DATA_MTUS)
 #endif
 
 #ifndef CONFIG_AUDIO_BUFFER_SIZE
-#define CONFIG_AUDIO_BUFFER_SIZE (CONFIG_MTU * CONFIG_LIBPEER_AUDIO_BUFFER_SIZE_MTUS)
+#define CONFIG_AUDIO_BUFFER_SIZE (CONFIG_MTU * CONFIG_LIBPEER_AUDIO_RB_DATA_MTUS)
 #endif
 
 #ifndef CONFIG_DATA_BUFFER_SIZE
-#define CONFIG_DATA_BUFFER_SIZE (SCTP_MTU * CONFIG_LIBPEER_DATA_BUFFER_SIZE_MTUS)
+#define CONFIG_DATA_BUFFER_SIZE (SCTP_MTU * CONFIG_LIBPEER_DATA_RB_DATA_MTUS)
 #endif
 
 #ifndef CONFIG_SDP_BUFFER_SIZE
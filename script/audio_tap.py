@@ -0,0 +1,102 @@
+#!/usr/bin/env python
+# Receiver for the debug audio tap (CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT).
+# Writes every PCM stream to a WAV file, with silence wherever the RTP
+# timestamps jump, and reports lost and reordered packets per stream.
+#
+#   python script/audio_tap.py --in-port 10000 --out-port 10001
+#
+# The streams are plain RTP, tcpdump -w and Wireshark work as well.
+
+import argparse
+import selectors
+import socket
+import struct
+import wave
+
+SAMPLE_RATE = 8000
+PCM_PAYLOAD_TYPE = 96
+STREAM_NAMES = ['mic_pcm', 'mic_opus', 'speaker_pcm', 'speaker_opus']
+
+
+class Stream:
+
+    def __init__(self, name, pcm):
+        self.name = name
+        self.wav = None
+        if pcm:
+            self.wav = wave.open(name + '.wav', 'wb')
+            self.wav.setnchannels(1)
+            self.wav.setsampwidth(2)
+            self.wav.setframerate(SAMPLE_RATE)
+        self.packets = 0
+        self.lost = 0
+        self.reordered = 0
+        self.seq = None
+        self.end = None
+
+    def receive(self, seq, timestamp, payload):
+        self.packets += 1
+        if self.seq is not None:
+            delta = (seq - self.seq) & 0xffff
+            if delta >= 0x8000:
+                self.reordered += 1
+                return
+            self.lost += delta - 1
+        self.seq = seq
+        if self.wav is None:
+            return
+
+        samples = len(payload) // 2
+        if self.end is not None:
+            gap = (timestamp - self.end) & 0xffffffff
+            if 0 < gap < 0x80000000:
+                self.wav.writeframes(b'\0\0' * gap)
+        pcm = struct.pack('<%dh' % samples,
+                          *struct.unpack('>%dh' % samples, payload))
+        self.wav.writeframes(pcm)
+        self.end = (timestamp + samples) & 0xffffffff
+
+    def report(self):
+        print('%s: %d packets, %d lost, %d reordered' %
+              (self.name, self.packets, self.lost, self.reordered))
+        if self.wav is not None:
+            self.wav.close()
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--host', default='0.0.0.0')
+    parser.add_argument('--in-port', type=int, default=10000)
+    parser.add_argument('--out-port', type=int, default=10001)
+    args = parser.parse_args()
+
+    selector = selectors.DefaultSelector()
+    for port in (args.in_port, args.out_port):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.bind((args.host, port))
+        selector.register(sock, selectors.EVENT_READ)
+
+    streams = {}
+    try:
+        while True:
+            for key, _ in selector.select():
+                packet = key.fileobj.recv(2048)
+                if len(packet) < 12 or packet[0] >> 6 != 2:
+                    continue
+                payload_type = packet[1] & 0x7f
+                seq, timestamp, ssrc = struct.unpack('>HII', packet[2:12])
+                if ssrc not in streams:
+                    index = ssrc & 0xff
+                    name = (STREAM_NAMES[index] if index < len(STREAM_NAMES)
+                            else '%08x' % ssrc)
+                    streams[ssrc] = Stream(name,
+                                           payload_type == PCM_PAYLOAD_TYPE)
+                streams[ssrc].receive(seq, timestamp, packet[12:])
+    except KeyboardInterrupt:
+        pass
+    for stream in streams.values():
+        stream.report()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,144 @@
+#!/usr/bin/env python
+# Local stand-in for the realtime API, for soak runs of the Linux load
+# generator. Answers WHIP-style SDP offers and plays the part of the model:
+# every --turn seconds it reports the end of the user's speech on the data
+# channel and answers with a tone after --response-ms.
+#
+#   pip install aiortc aiohttp numpy
+#   python script/standin_peer.py --port 8080
+#
+# then build the Linux target with
+# CONFIG_OPENAI_REALTIMEAPI="http://127.0.0.1:8080/v1/realtime".
+
+import argparse
+import asyncio
+import fractions
+import json
+import math
+
+import numpy
+from aiohttp import web
+from aiortc import MediaStreamTrack, RTCPeerConnection, RTCSessionDescription
+from av import AudioFrame
+
+SAMPLE_RATE = 48000
+FRAME_SAMPLES = SAMPLE_RATE // 50
+
+
+class AnswerTrack(MediaStreamTrack):
+    """Sends a tone while an answer plays and nothing in between."""
+
+    kind = 'audio'
+
+    def __init__(self):
+        super().__init__()
+        self.playing = asyncio.Event()
+        self.remaining = 0
+        self.pts = 0
+        self.start = None
+
+    def play(self, seconds):
+        self.remaining = int(seconds * 50)
+        self.playing.set()
+
+    async def recv(self):
+        await self.playing.wait()
+        loop = asyncio.get_running_loop()
+        if self.start is None:
+            self.start = loop.time() - self.pts / SAMPLE_RATE
+        wait = self.start + self.pts / SAMPLE_RATE - loop.time()
+        if wait > 0:
+            await asyncio.sleep(wait)
+
+        t = (self.pts + numpy.arange(FRAME_SAMPLES)) / SAMPLE_RATE
+        samples = (6000 * numpy.sin(2 * math.pi * 440 * t)).astype(numpy.int16)
+        frame = AudioFrame.from_ndarray(samples.reshape(1, -1), format='s16',
+                                        layout='mono')
+        frame.sample_rate = SAMPLE_RATE
+        frame.pts = self.pts
+        frame.time_base = fractions.Fraction(1, SAMPLE_RATE)
+        self.pts += FRAME_SAMPLES
+
+        self.remaining -= 1
+        if self.remaining <= 0:
+            self.playing.clear()
+            # Resume the clock from the next answer, not from now.
+            self.start = None
+        return frame
+
+
+async def drain(track):
+    while True:
+        await track.recv()
+
+
+async def converse(args, channel, answer):
+    while channel.readyState == 'open':
+        await asyncio.sleep(args.turn)
+        if channel.readyState != 'open':
+            break
+        channel.send(json.dumps({'type': 'input_audio_buffer.speech_stopped'}))
+        await asyncio.sleep(args.response_ms / 1000)
+        answer.play(args.answer_s)
+
+
+async def offer(request):
+    args = request.app['args']
+    pc = RTCPeerConnection()
+    request.app['peers'].add(pc)
+    answer = AnswerTrack()
+    pc.addTrack(answer)
+
+    @pc.on('track')
+    def on_track(track):
+        # The uplink audio is only consumed, never played back.
+        asyncio.ensure_future(drain(track))
+
+    @pc.on('datachannel')
+    def on_datachannel(channel):
+        @channel.on('message')
+        def on_message(message):
+            event = json.loads(message)
+            if event.get('type') == 'response.create':
+                answer.play(args.answer_s)
+        asyncio.ensure_future(converse(args, channel, answer))
+
+    @pc.on('connectionstatechange')
+    async def on_connectionstatechange():
+        if pc.connectionState in ('failed', 'closed'):
+            await pc.close()
+            request.app['peers'].discard(pc)
+
+    sdp = await request.text()
+    await pc.setRemoteDescription(RTCSessionDescription(sdp, 'offer'))
+    await pc.setLocalDescription(await pc.createAnswer())
+    return web.Response(status=201, content_type='application/sdp',
+                        text=pc.localDescription.sdp)
+
+
+async def on_shutdown(app):
+    await asyncio.gather(*(pc.close() for pc in app['peers']))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=8080)
+    parser.add_argument('--turn', type=float, default=10,
+                        help='seconds between simulated user turns')
+    parser.add_argument('--response-ms', type=int, default=500,
+                        help='delay before each answer starts')
+    parser.add_argument('--answer-s', type=float, default=2,
+                        help='length of each answer')
+    args = parser.parse_args()
+
+    app = web.Application()
+    app['args'] = args
+    app['peers'] = set()
+    app.router.add_post('/{tail:.*}', offer)
+    app.on_shutdown.append(on_shutdown)
+    web.run_app(app, host=args.host, port=args.port)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,149 @@
+#!/usr/bin/env python
+# Local stand-in for the realtime API over WebSocket, the counterpart of
+# standin_peer.py for CONFIG_REALTIME_TRANSPORT_WEBSOCKET. Every --turn
+# seconds it reports the end of the user's speech and answers with a tone
+# after --response-ms, sent as response.audio.delta events in the format the
+# device asked for in session.update.
+#
+#   pip install aiohttp numpy
+#   python script/ws_standin.py --host 0.0.0.0 --port 8080
+#
+# then build with CONFIG_OPENAI_REALTIMEAPI="http://<host>:8080/v1/realtime".
+
+import argparse
+import asyncio
+import base64
+import json
+import math
+
+import numpy
+from aiohttp import WSMsgType, web
+
+# Samples per second of each audio format.
+SAMPLE_RATES = {'g711_ulaw': 8000, 'g711_alaw': 8000, 'pcm16': 24000}
+DELTA_MS = 100
+
+
+def ulaw(samples):
+    """G.711 mu-law of 16-bit samples, as the 14-bit reference encoder."""
+    pcm = samples.astype(numpy.int32) >> 2
+    mask = numpy.where(pcm < 0, 0x7f, 0xff)
+    pcm = numpy.minimum(numpy.abs(pcm), 8159) + 0x21
+    segment = numpy.floor(numpy.log2(pcm)).astype(numpy.int32) - 5
+    code = (segment << 4) | ((pcm >> (segment + 1)) & 0xf)
+    # The clipped maximum lands past the last segment.
+    code = numpy.minimum(code, 0x7f)
+    return ((code ^ mask) & 0xff).astype(numpy.uint8).tobytes()
+
+
+def tone(audio_format, start, count):
+    rate = SAMPLE_RATES[audio_format]
+    t = (start + numpy.arange(count)) / rate
+    samples = (6000 * numpy.sin(2 * math.pi * 440 * t)).astype(numpy.int16)
+    if audio_format == 'pcm16':
+        return samples.astype('<i2').tobytes()
+    return ulaw(samples)
+
+
+class Session:
+
+    def __init__(self, args, ws):
+        self.args = args
+        self.ws = ws
+        self.format = 'pcm16'
+        self.appended = 0
+        self.answer = None
+        self.responses = 0
+
+    async def send(self, event):
+        await self.ws.send_str(json.dumps(event))
+
+    def play(self):
+        if self.answer is None or self.answer.done():
+            self.answer = asyncio.ensure_future(self.respond())
+
+    async def respond(self):
+        self.responses += 1
+        response_id = 'resp_%d' % self.responses
+        await self.send({'type': 'response.created',
+                         'response': {'id': response_id}})
+        rate = SAMPLE_RATES[self.format]
+        count = rate * DELTA_MS // 1000
+        total = int(self.args.answer_s * rate)
+        loop = asyncio.get_running_loop()
+        start = loop.time()
+        # Faster than real time, as the API does.
+        for sent in range(0, total, count):
+            audio = tone(self.format, sent, min(count, total - sent))
+            await self.send({'type': 'response.audio.delta',
+                             'response_id': response_id,
+                             'delta': base64.b64encode(audio).decode()})
+            await asyncio.sleep(DELTA_MS / 4000)
+        await self.send({'type': 'response.audio.done',
+                         'response_id': response_id})
+        await self.send({'type': 'response.done',
+                         'response': {'id': response_id,
+                                      'status': 'completed'}})
+        # The device plays in real time, the buffer runs dry after that.
+        await asyncio.sleep(max(0, start + self.args.answer_s - loop.time()))
+        await self.send({'type': 'output_audio_buffer.stopped',
+                         'response_id': response_id})
+
+    async def converse(self):
+        while not self.ws.closed:
+            await asyncio.sleep(self.args.turn)
+            await self.send({'type': 'input_audio_buffer.speech_stopped'})
+            await asyncio.sleep(self.args.response_ms / 1000)
+            self.play()
+
+    def receive(self, event):
+        kind = event.get('type')
+        if kind == 'session.update':
+            session = event.get('session', {})
+            self.format = session.get('output_audio_format', self.format)
+        elif kind == 'input_audio_buffer.append':
+            # The uplink audio is only counted, never played back.
+            self.appended += len(base64.b64decode(event['audio']))
+        elif kind == 'response.create':
+            self.play()
+
+
+async def realtime(request):
+    ws = web.WebSocketResponse(heartbeat=30)
+    await ws.prepare(request)
+    session = Session(request.app['args'], ws)
+    await session.send({'type': 'session.created'})
+    converse = asyncio.ensure_future(session.converse())
+    try:
+        async for message in ws:
+            if message.type == WSMsgType.TEXT:
+                session.receive(json.loads(message.data))
+    finally:
+        converse.cancel()
+        if session.answer is not None:
+            session.answer.cancel()
+        print('session closed, %d bytes of %s audio received' %
+              (session.appended, session.format))
+    return ws
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=8080)
+    parser.add_argument('--turn', type=float, default=10,
+                        help='seconds between simulated user turns')
+    parser.add_argument('--response-ms', type=int, default=500,
+                        help='delay before each answer starts')
+    parser.add_argument('--answer-s', type=float, default=2,
+                        help='length of each answer')
+    args = parser.parse_args()
+
+    app = web.Application()
+    app['args'] = args
+    app.router.add_get('/{tail:.*}', realtime)
+    web.run_app(app, host=args.host, port=args.port)
+
+
+if __name__ == '__main__':
+    main()
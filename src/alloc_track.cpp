@@ -0,0 +1,161 @@
+#include "alloc_track.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <iterator>
+
+#ifndef LINUX_BUILD
+#include <esp_attr.h>
+#else
+#define IRAM_ATTR
+#endif
+
+constexpr const char *TAG = "alloc_track";
+
+namespace {
+
+struct Allocation {
+  const char *task;
+  size_t size;
+};
+
+// Set on the registered tasks only.
+thread_local const char *s_task_name = nullptr;
+// Set while the tracker itself logs, so its own allocations do not count.
+thread_local bool s_paused = false;
+// Between oai_alloc_track_count_begin and _end.
+thread_local bool s_counting = false;
+thread_local uint32_t s_task_count = 0;
+
+std::atomic<bool> s_steady{false};
+std::atomic<uint32_t> s_count{0};
+// The latest allocations, indexed by their count.
+Allocation s_recent[8];
+uint32_t s_reported = 0;
+int64_t s_last_poll_us = 0;
+
+// Called for every allocation, from inside the allocator.
+IRAM_ATTR void record(size_t size) {
+  if (s_counting) {
+    s_task_count++;
+    return;
+  }
+  if (s_task_name == nullptr || s_paused ||
+      !s_steady.load(std::memory_order_relaxed)) {
+    return;
+  }
+#ifdef CONFIG_ALLOC_TRACK_ABORT
+  abort();
+#endif
+  uint32_t n = s_count.fetch_add(1, std::memory_order_relaxed);
+  s_recent[n % std::size(s_recent)] = {s_task_name, size};
+}
+
+void report() {
+  s_paused = true;
+  uint32_t count = s_count.load(std::memory_order_relaxed);
+  uint32_t first = s_reported;
+  if (count - first > std::size(s_recent)) {
+    ESP_LOGW(TAG, "%lu hot path allocations not shown",
+             (unsigned long)(count - first - std::size(s_recent)));
+    first = count - std::size(s_recent);
+  }
+  for (uint32_t n = first; n != count; n++) {
+    const Allocation &allocation = s_recent[n % std::size(s_recent)];
+    ESP_LOGW(TAG, "Hot path allocation on %s: %u bytes", allocation.task,
+             (unsigned)allocation.size);
+  }
+  s_reported = count;
+  s_paused = false;
+}
+
+}  // namespace
+
+void oai_alloc_track_register(const char *name) { s_task_name = name; }
+
+void oai_alloc_track_steady(bool steady) {
+  if (steady) {
+    s_count = 0;
+    s_reported = 0;
+    s_steady = true;
+    return;
+  }
+  if (!s_steady.exchange(false)) {
+    return;
+  }
+  report();
+  s_paused = true;
+  ESP_LOGI(TAG, "%lu hot path allocations this session",
+           (unsigned long)oai_alloc_track_count());
+  s_paused = false;
+}
+
+void oai_alloc_track_poll() {
+  int64_t now = esp_timer_get_time();
+  if (now - s_last_poll_us < CONFIG_ALLOC_TRACK_INTERVAL_MS * 1000LL) {
+    return;
+  }
+  s_last_poll_us = now;
+  if (s_count.load(std::memory_order_relaxed) != s_reported) {
+    report();
+  }
+}
+
+uint32_t oai_alloc_track_count() {
+  return s_count.load(std::memory_order_relaxed);
+}
+
+void oai_alloc_track_count_begin() {
+  s_task_count = 0;
+  s_counting = true;
+}
+
+uint32_t oai_alloc_track_count_end() {
+  s_counting = false;
+  return s_task_count;
+}
+
+#ifndef LINUX_BUILD
+// Both hooks have to be defined with CONFIG_HEAP_USE_HOOKS.
+extern "C" IRAM_ATTR void esp_heap_trace_alloc_hook(void *ptr, size_t size,
+                                                    uint32_t caps) {
+  record(size);
+}
+
+extern "C" IRAM_ATTR void esp_heap_trace_free_hook(void *ptr) {}
+#else
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  record(size);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  record(count * size);
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  record(size);
+  return __real_realloc(ptr, size);
+}
+}
+
+// libstdc++ is linked dynamically and its operator new calls the unwrapped
+// malloc, so replace it to see std::string and std::vector growth too.
+void *operator new(size_t size) {
+  void *ptr = malloc(size);
+  if (ptr == nullptr) {
+    abort();
+  }
+  return ptr;
+}
+#endif  // LINUX_BUILD
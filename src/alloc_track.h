@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+// Heap allocation tracker for the audio hot paths.
+//
+// Once a session reaches its steady state, the per-frame paths are expected
+// to run without touching the heap: heap use there fragments the internal
+// SRAM over long uptimes until a later allocation fails. Tasks on those
+// paths register themselves, and every allocation a registered task makes
+// while the session is steady is counted and logged by oai_alloc_track_poll.
+// With CONFIG_ALLOC_TRACK_ABORT the first one aborts instead, so that the
+// backtrace points at the caller.
+//
+// On the device the allocations are seen through the heap hooks
+// (CONFIG_HEAP_USE_HOOKS), on Linux malloc, calloc and realloc are wrapped at
+// link time (see CMakeLists.txt).
+
+// Marks the calling task as part of a hot path. name shows up in the log.
+void oai_alloc_track_register(const char *name);
+// Set once the session is up, cleared at teardown. Clearing logs the total
+// of the session.
+void oai_alloc_track_steady(bool steady);
+// Logs the allocations made since the last call, at most every
+// CONFIG_ALLOC_TRACK_INTERVAL_MS.
+void oai_alloc_track_poll();
+// Allocations made on the hot paths since the session became steady.
+uint32_t oai_alloc_track_count();
+
+// Counts every allocation the calling task makes between the two calls,
+// steady session or not, for benchmarks. Not affected by
+// CONFIG_ALLOC_TRACK_ABORT.
+void oai_alloc_track_count_begin();
+uint32_t oai_alloc_track_count_end();
@@ -0,0 +1,265 @@
+#include "audio_tap.h"
+
+#include <arpa/inet.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <atomic>
+
+#include "codec.h"
+#include "mem.h"
+
+constexpr const char *TAG = "audio_tap";
+
+namespace {
+
+constexpr uint32_t kRingSize = CONFIG_MEDIA_DEBUG_AUDIO_TAP_RING_SIZE;
+static_assert((kRingSize & (kRingSize - 1)) == 0,
+              "CONFIG_MEDIA_DEBUG_AUDIO_TAP_RING_SIZE must be a power of two");
+
+// Silence longer than this advances the RTP timestamp by the wall clock, so
+// that the receiver sees when the speaker was idle or the microphone stalled.
+constexpr int64_t kResyncUs = 100000;
+constexpr int64_t kLogIntervalUs = 10000000;
+constexpr uint32_t kDrainIntervalMs = 10;
+
+// Dynamic payload types, L16 at the codec rate and Opus at its 48 kHz RTP
+// clock as in RFC 7587.
+constexpr uint8_t kPcmPayloadType = 96;
+constexpr uint8_t kOpusPayloadType = 111;
+constexpr uint32_t kOpusClock = 48000;
+constexpr uint32_t kSsrcBase = 0x6f616900;
+
+constexpr size_t kRtpHeaderSize = 12;
+constexpr size_t kMaxPayload = OPUS_OUT_BUFFER_SIZE;
+
+struct Record {
+  uint16_t size;  // Payload bytes, kWrap if the rest of the ring is unused.
+  uint8_t stream;
+  uint8_t marker;
+  uint16_t seq;
+  uint32_t timestamp;
+};
+constexpr uint16_t kWrap = UINT16_MAX;
+
+constexpr uint32_t record_bytes(size_t size) {
+  return (sizeof(Record) + size + 3) & ~3u;
+}
+// A record skips less than its own size at the end of the ring, so twice the
+// largest record always fits an empty ring.
+static_assert(kRingSize >= 2 * record_bytes(kMaxPayload),
+              "CONFIG_MEDIA_DEBUG_AUDIO_TAP_RING_SIZE is too small");
+
+// Single producer, single consumer. Positions run freely and are taken
+// modulo the ring size, which divides 2^32.
+class Ring {
+ public:
+  bool init() {
+    data_ = (uint8_t *)oai_mem_alloc(kRingSize, OaiMemPlacement::kHot);
+    return data_ != nullptr;
+  }
+
+  bool push(const Record &record, const void *payload) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    uint32_t pos = head % kRingSize;
+    uint32_t n = record_bytes(record.size);
+    // Records never wrap, the rest of the ring is skipped instead.
+    uint32_t skip = kRingSize - pos < n ? kRingSize - pos : 0;
+    if (data_ == nullptr || head + skip + n - tail > kRingSize) {
+      drops_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    if (skip >= sizeof(Record)) {
+      Record wrap = {};
+      wrap.size = kWrap;
+      memcpy(data_ + pos, &wrap, sizeof(wrap));
+    }
+    pos = (head + skip) % kRingSize;
+    memcpy(data_ + pos, &record, sizeof(record));
+    memcpy(data_ + pos + sizeof(record), payload, record.size);
+    head_.store(head + skip + n, std::memory_order_release);
+    return true;
+  }
+
+  // Returns the oldest record, its payload follows it. Valid until pop().
+  const Record *peek() {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    uint32_t head = head_.load(std::memory_order_acquire);
+    while (tail != head) {
+      uint32_t pos = tail % kRingSize;
+      const Record *record = (const Record *)(data_ + pos);
+      if (kRingSize - pos >= sizeof(Record) && record->size != kWrap) {
+        return record;
+      }
+      tail += kRingSize - pos;
+      tail_.store(tail, std::memory_order_release);
+    }
+    return nullptr;
+  }
+
+  void pop(const Record *record) {
+    tail_.store(tail_.load(std::memory_order_relaxed) +
+                    record_bytes(record->size),
+                std::memory_order_release);
+  }
+
+  uint32_t drops() const { return drops_.load(std::memory_order_relaxed); }
+
+ private:
+  uint8_t *data_ = nullptr;
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+  std::atomic<uint32_t> drops_{0};
+};
+
+// RTP state of a stream, only touched by the task that taps it.
+struct StreamState {
+  uint16_t seq;
+  uint32_t timestamp;
+  int64_t last_us;
+  int64_t last_duration_us;
+};
+
+struct Direction {
+  Ring ring;
+  sockaddr_in dest;
+  uint32_t sent;
+  uint32_t send_errors;
+};
+
+Direction s_mic;
+Direction s_speaker;
+StreamState s_streams[4];
+int s_sock = -1;
+
+bool is_mic(OaiAudioTapStream stream) {
+  return stream == OaiAudioTapStream::kMicPcm ||
+         stream == OaiAudioTapStream::kMicOpus;
+}
+
+bool is_opus(OaiAudioTapStream stream) {
+  return stream == OaiAudioTapStream::kMicOpus ||
+         stream == OaiAudioTapStream::kSpeakerOpus;
+}
+
+void send(Direction &direction, const Record *record) {
+  static uint8_t packet[kRtpHeaderSize + kMaxPayload];
+  OaiAudioTapStream stream = (OaiAudioTapStream)record->stream;
+  uint32_t ssrc = kSsrcBase | record->stream;
+  packet[0] = 0x80;
+  packet[1] = (record->marker ? 0x80 : 0) |
+              (is_opus(stream) ? kOpusPayloadType : kPcmPayloadType);
+  packet[2] = record->seq >> 8;
+  packet[3] = record->seq;
+  for (int i = 0; i < 4; i++) {
+    packet[4 + i] = record->timestamp >> (24 - 8 * i);
+    packet[8 + i] = ssrc >> (24 - 8 * i);
+  }
+
+  const uint8_t *payload = (const uint8_t *)(record + 1);
+  size_t size = record->size;
+  if (is_opus(stream)) {
+    memcpy(packet + kRtpHeaderSize, payload, size);
+  } else {
+    // L16 is big-endian on the wire.
+    for (size_t i = 0; i + 1 < size; i += 2) {
+      packet[kRtpHeaderSize + i] = payload[i + 1];
+      packet[kRtpHeaderSize + i + 1] = payload[i];
+    }
+  }
+
+  if (sendto(s_sock, packet, kRtpHeaderSize + size, MSG_DONTWAIT,
+             (const sockaddr *)&direction.dest, sizeof(direction.dest)) < 0) {
+    direction.send_errors++;
+  } else {
+    direction.sent++;
+  }
+}
+
+void drain(Direction &direction) {
+  while (const Record *record = direction.ring.peek()) {
+    send(direction, record);
+    direction.ring.pop(record);
+  }
+}
+
+void tap_task(void *arg) {
+  int64_t next_log_us = esp_timer_get_time() + kLogIntervalUs;
+  while (true) {
+    drain(s_mic);
+    drain(s_speaker);
+
+    int64_t now = esp_timer_get_time();
+    if (now >= next_log_us) {
+      next_log_us = now + kLogIntervalUs;
+      ESP_LOGI(TAG,
+               "mic %lu sent, %lu dropped, %lu send errors | speaker %lu "
+               "sent, %lu dropped, %lu send errors",
+               (unsigned long)s_mic.sent, (unsigned long)s_mic.ring.drops(),
+               (unsigned long)s_mic.send_errors, (unsigned long)s_speaker.sent,
+               (unsigned long)s_speaker.ring.drops(),
+               (unsigned long)s_speaker.send_errors);
+    }
+    vTaskDelay(pdMS_TO_TICKS(kDrainIntervalMs));
+  }
+}
+
+void init_dest(sockaddr_in *dest, uint16_t port) {
+  dest->sin_family = AF_INET;
+  dest->sin_port = htons(port);
+  dest->sin_addr.s_addr = inet_addr(CONFIG_MEDIA_DEBUG_AUDIO_HOST);
+}
+
+}  // namespace
+
+void oai_audio_tap_init() {
+  s_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s_sock < 0) {
+    ESP_LOGE(TAG, "Failed to create socket");
+    return;
+  }
+  init_dest(&s_mic.dest, CONFIG_MEDIA_DEBUG_AUDIO_IN_PORT);
+  init_dest(&s_speaker.dest, CONFIG_MEDIA_DEBUG_AUDIO_OUT_PORT);
+  if (!s_mic.ring.init() || !s_speaker.ring.init()) {
+    ESP_LOGE(TAG, "Failed to allocate the tap rings");
+    return;
+  }
+  if (xTaskCreate(tap_task, "audio_tap", 3072, nullptr, tskIDLE_PRIORITY + 1,
+                  nullptr) != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create the tap task");
+  }
+}
+
+void oai_audio_tap(OaiAudioTapStream stream, const void *data, size_t size,
+                   size_t samples) {
+  if (size > kMaxPayload) {
+    return;
+  }
+  StreamState &state = s_streams[(size_t)stream];
+  uint32_t clock = is_opus(stream) ? kOpusClock : SAMPLE_RATE;
+  int64_t now = esp_timer_get_time();
+
+  Record record = {};
+  record.size = size;
+  record.stream = (uint8_t)stream;
+  int64_t gap_us = now - state.last_us - state.last_duration_us;
+  if (state.last_us == 0 || gap_us > kResyncUs) {
+    if (state.last_us != 0) {
+      state.timestamp += gap_us * clock / 1000000;
+    }
+    record.marker = 1;
+  }
+  record.seq = state.seq++;
+  record.timestamp = state.timestamp;
+  state.timestamp += samples * clock / SAMPLE_RATE;
+  state.last_us = now;
+  state.last_duration_us = samples * 1000000LL / SAMPLE_RATE;
+
+  // A dropped frame still uses its sequence number and timestamp.
+  (is_mic(stream) ? s_mic : s_speaker).ring.push(record, data);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Debug audio tap.
+//
+// The audio paths copy what they capture, play, encode and decode into
+// lock-free rings, one per direction, without ever blocking. A low priority
+// task drains the rings and sends every frame as an RTP packet to
+// CONFIG_MEDIA_DEBUG_AUDIO_HOST: the microphone streams to
+// CONFIG_MEDIA_DEBUG_AUDIO_IN_PORT, the speaker streams to
+// CONFIG_MEDIA_DEBUG_AUDIO_OUT_PORT. Frames that do not fit are dropped and
+// counted, their sequence numbers are skipped so the receiver sees the gap.
+
+enum class OaiAudioTapStream : uint8_t {
+  kMicPcm,
+  kMicOpus,
+  kSpeakerPcm,
+  kSpeakerOpus,
+};
+
+void oai_audio_tap_init();
+
+// Copies one frame of samples, 16-bit PCM or an Opus packet. The microphone
+// streams must be tapped from one task and the speaker streams from another.
+void oai_audio_tap(OaiAudioTapStream stream, const void *data, size_t size,
+                   size_t samples);
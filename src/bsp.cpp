@@ -31,4 +31,26 @@ bool bsp_check_reset_provisioning() {
   ESP_LOGI(TAG, "Reset provisioning button %s", pressed ? "pressed" : "not pressed");
   return pressed;
 }
-#endif
\ No newline at end of file
+#endif
+
+#ifdef CONFIG_SESSION_TRIGGER_BUTTON
+#include <driver/gpio.h>
+
+void bsp_session_button_init() {
+  const gpio_config_t config = {
+    .pin_bit_mask = 1ULL << CONFIG_SESSION_TRIGGER_BUTTON_GPIO_NUM,
+    .mode = GPIO_MODE_INPUT,
+    .pull_up_en = GPIO_PULLUP_ENABLE,
+    .pull_down_en = GPIO_PULLDOWN_DISABLE,
+    .intr_type = GPIO_INTR_DISABLE,
+  };
+  if( auto err = gpio_config(&config); err != ESP_OK ) {
+    ESP_LOGE(TAG, "Failed to configure session button GPIO - %d", err);
+  }
+}
+
+bool bsp_session_button_pressed() {
+  // Active low, against the internal pull-up.
+  return gpio_get_level(gpio_num_t(CONFIG_SESSION_TRIGGER_BUTTON_GPIO_NUM)) == 0;
+}
+#endif
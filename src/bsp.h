@@ -1,4 +1,11 @@
 #pragma once
 
 // @brief Reset WiFi and API key provisioning.
-bool bsp_check_reset_provisioning();
\ No newline at end of file
+bool bsp_check_reset_provisioning();
+
+#ifdef CONFIG_SESSION_TRIGGER_BUTTON
+// @brief Configure the button that brings up a session.
+void bsp_session_button_init();
+// @brief Whether the session button is held down.
+bool bsp_session_button_pressed();
+#endif
@@ -0,0 +1,565 @@
+#include "captions.h"
+
+#include <M5Unified.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "events.h"
+#include "mem.h"
+
+constexpr const char *TAG = "captions";
+
+namespace {
+
+constexpr uint32_t kQueueSlots = CONFIG_CAPTIONS_QUEUE_SLOTS;
+static_assert((kQueueSlots & (kQueueSlots - 1)) == 0,
+              "CONFIG_CAPTIONS_QUEUE_SLOTS must be a power of two");
+constexpr uint32_t kGlyphSlots = CONFIG_CAPTIONS_GLYPH_CACHE;
+static_assert((kGlyphSlots & (kGlyphSlots - 1)) == 0,
+              "CONFIG_CAPTIONS_GLYPH_CACHE must be a power of two");
+constexpr int kGlyphBits = __builtin_ctz(kGlyphSlots);
+
+constexpr size_t kSlotText = 60;
+constexpr size_t kMaxRows = 24;
+constexpr size_t kMaxRowGlyphs = 80;
+constexpr uint16_t kClean = UINT16_MAX;
+constexpr int64_t kFrameBudgetUs = CONFIG_CAPTIONS_FRAME_BUDGET_US;
+constexpr int64_t kLogIntervalUs = 10000000;
+// By OaiCaptionSpeaker. The background is black, all zero bytes.
+constexpr uint16_t kColors[] = {TFT_CYAN, TFT_WHITE};
+
+// Text of one event, or a part of it, still JSON-escaped.
+struct Slot {
+  uint8_t speaker;
+  uint8_t len;
+  bool end_turn;
+  char text[kSlotText];
+};
+
+// Single producer, single consumer. Positions run freely and are taken
+// modulo the slot count, which divides 2^32.
+class SlotQueue {
+ public:
+  Slot *claim() {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == kQueueSlots) {
+      drops_.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    return &slots_[head % kQueueSlots];
+  }
+  void publish() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  const Slot *peek() {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &slots_[tail % kQueueSlots];
+  }
+  void pop() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  uint32_t drops() const { return drops_.load(std::memory_order_relaxed); }
+
+ private:
+  Slot slots_[kQueueSlots];
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+  std::atomic<uint32_t> drops_{0};
+};
+
+// A glyph as it appears on the display, width by line height pixels.
+struct Glyph {
+  // Code point << 1 | speaker, 0 if the slot is empty.
+  uint32_t key;
+  uint8_t width;
+  lgfx::swap565_t *pixels;
+};
+
+struct Row {
+  uint8_t speaker;
+  uint16_t count;
+  uint16_t width;
+  // What the display shows of the row, cleared up to here on redraw.
+  uint16_t drawn_width;
+  // Left edge of the part to redraw, kClean if the display is up to date.
+  uint16_t dirty_from;
+  uint16_t glyphs[kMaxRowGlyphs];
+  uint8_t advances[kMaxRowGlyphs];
+};
+
+struct RenderStats {
+  uint32_t frames;
+  uint32_t rects;
+  uint32_t over_budget;
+  uint64_t bytes;
+  int64_t cpu_us;
+  int64_t max_cpu_us;
+  int64_t bus_us;
+  int64_t max_bus_us;
+  uint32_t glyph_hits;
+  uint32_t glyph_misses;
+};
+
+SlotQueue s_queue;
+TaskHandle_t s_task = nullptr;
+
+// Only touched by the render task after init.
+LGFX_Sprite s_scratch;
+int s_width = 0;
+int s_line_height = 0;
+size_t s_rows = 0;
+Glyph s_glyphs[kGlyphSlots];
+Row *s_row = nullptr;
+size_t s_first_row = 0;
+size_t s_used_rows = 0;
+bool s_turn_ended = true;
+lgfx::swap565_t *s_line[2] = {};
+RenderStats s_stats;
+
+// Length of the escape sequence or UTF-8 character at s[i], so that a slot
+// never ends in the middle of one.
+size_t token_length(std::string_view s, size_t i) {
+  uint8_t c = s[i];
+  size_t n = 1;
+  if (c == '\\') {
+    n = 2;
+    if (i + 1 < s.size() && s[i + 1] == 'u') {
+      n = 6;
+      // A high surrogate only decodes together with the low one after it.
+      if (i + 7 < s.size() && (s[i + 2] | 0x20) == 'd' &&
+          (s[i + 3] == '8' || s[i + 3] == '9' || (s[i + 3] | 0x20) == 'a' ||
+           (s[i + 3] | 0x20) == 'b')) {
+        n = 12;
+      }
+    }
+  } else if (c >= 0xf0) {
+    n = 4;
+  } else if (c >= 0xe0) {
+    n = 3;
+  } else if (c >= 0xc0) {
+    n = 2;
+  }
+  return std::min(n, s.size() - i);
+}
+
+Row &row_at(size_t pos) { return s_row[(s_first_row + pos) % s_rows]; }
+
+void mark_dirty(Row &row, uint16_t from) {
+  row.dirty_from = std::min(row.dirty_from, from);
+}
+
+const Glyph &glyph(uint16_t code_point, uint8_t speaker) {
+  uint32_t key = (uint32_t)code_point << 1 | speaker;
+  Glyph &g = s_glyphs[(key * 2654435761u) >> (32 - kGlyphBits)];
+  if (g.key == key) {
+    s_stats.glyph_hits++;
+    return g;
+  }
+  s_stats.glyph_misses++;
+
+  char utf8[4] = {};
+  if (code_point < 0x80) {
+    utf8[0] = code_point;
+  } else if (code_point < 0x800) {
+    utf8[0] = 0xc0 | code_point >> 6;
+    utf8[1] = 0x80 | (code_point & 0x3f);
+  } else {
+    utf8[0] = 0xe0 | code_point >> 12;
+    utf8[1] = 0x80 | ((code_point >> 6) & 0x3f);
+    utf8[2] = 0x80 | (code_point & 0x3f);
+  }
+  s_scratch.fillSprite(TFT_BLACK);
+  s_scratch.setTextColor(kColors[speaker], TFT_BLACK);
+  size_t width = s_scratch.drawString(utf8, 0, 0);
+  if (width == 0) {
+    // Not in the font.
+    width = s_scratch.drawString("?", 0, 0);
+  }
+  // Wider glyphs are clipped to the scratch sprite, a square.
+  width = std::min<size_t>(width, s_line_height);
+
+  const lgfx::swap565_t *src = (const lgfx::swap565_t *)s_scratch.getBuffer();
+  for (int y = 0; y < s_line_height; y++) {
+    memcpy(g.pixels + y * width, src + y * s_line_height,
+           width * sizeof(*src));
+  }
+  g.key = key;
+  g.width = width;
+  return g;
+}
+
+void new_row(uint8_t speaker) {
+  bool scrolled = s_used_rows == s_rows;
+  if (scrolled) {
+    // Every row moves up a line and is drawn again in full.
+    s_first_row = (s_first_row + 1) % s_rows;
+    for (size_t pos = 0; pos < s_rows; pos++) {
+      Row &row = row_at(pos);
+      row.dirty_from = 0;
+      row.drawn_width = s_width;
+    }
+  } else {
+    s_used_rows++;
+  }
+  Row &row = row_at(s_used_rows - 1);
+  row.speaker = speaker;
+  row.count = 0;
+  row.width = 0;
+  if (!scrolled) {
+    row.drawn_width = 0;
+    row.dirty_from = kClean;
+  }
+}
+
+void push_glyph(Row &row, uint16_t code_point, uint8_t advance) {
+  mark_dirty(row, row.width);
+  row.glyphs[row.count] = code_point;
+  row.advances[row.count] = advance;
+  row.count++;
+  row.width += advance;
+}
+
+// Moves the last word of the current row to a new row, or starts an empty
+// one if the row is a single word.
+void wrap(uint8_t speaker) {
+  Row &row = row_at(s_used_rows - 1);
+  size_t space = row.count;
+  while (space > 0 && row.glyphs[space - 1] != ' ') {
+    space--;
+  }
+  uint16_t carried[kMaxRowGlyphs];
+  uint8_t advances[kMaxRowGlyphs];
+  size_t carried_count = 0;
+  if (space > 0) {
+    carried_count = row.count - space;
+    memcpy(carried, row.glyphs + space, carried_count * sizeof(carried[0]));
+    memcpy(advances, row.advances + space, carried_count);
+    for (size_t i = space; i < row.count; i++) {
+      row.width -= row.advances[i];
+    }
+    row.count = space;
+    mark_dirty(row, row.width);
+  }
+  new_row(speaker);
+  Row &next = row_at(s_used_rows - 1);
+  for (size_t i = 0; i < carried_count; i++) {
+    push_glyph(next, carried[i], advances[i]);
+  }
+}
+
+void append(uint8_t speaker, uint16_t code_point) {
+  if (code_point == '\n') {
+    s_turn_ended = true;
+    return;
+  }
+  if (code_point == '\t') {
+    code_point = ' ';
+  }
+  if (code_point < ' ') {
+    return;
+  }
+  if (s_used_rows == 0 || s_turn_ended ||
+      row_at(s_used_rows - 1).speaker != speaker) {
+    new_row(speaker);
+    s_turn_ended = false;
+  }
+  const Glyph &g = glyph(code_point, speaker);
+  Row *row = &row_at(s_used_rows - 1);
+  if (row->width + g.width > s_width || row->count == kMaxRowGlyphs) {
+    wrap(speaker);
+    row = &row_at(s_used_rows - 1);
+  }
+  if (code_point == ' ' && row->count == 0) {
+    return;
+  }
+  push_glyph(*row, code_point, g.width);
+}
+
+// Decodes UTF-8, code points outside the BMP show as '?'.
+void append_utf8(uint8_t speaker, const char *text, size_t len) {
+  const uint8_t *p = (const uint8_t *)text;
+  const uint8_t *end = p + len;
+  while (p < end) {
+    uint32_t c = *p++;
+    int extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+    c &= extra == 0 ? 0x7f : 0x3f >> extra;
+    for (int i = 0; i < extra && p < end; i++) {
+      c = c << 6 | (*p++ & 0x3f);
+    }
+    append(speaker, c > 0xffff ? '?' : c);
+  }
+}
+
+void drain() {
+  while (const Slot *slot = s_queue.peek()) {
+    if (slot->end_turn) {
+      s_turn_ended = true;
+    } else {
+      JsonValue value;
+      value.type = JsonType::kString;
+      value.raw = std::string_view(slot->text, slot->len);
+      // Decoding never makes the text longer, oai_json_unescape() wants room
+      // for a UTF-8 sequence and the terminator on top.
+      char text[kSlotText + 5];
+      int len = oai_json_unescape(value, text, sizeof(text));
+      if (len > 0) {
+        append_utf8(slot->speaker, text, len);
+      }
+    }
+    s_queue.pop();
+  }
+}
+
+// Composes the dirty part of a row into buf and returns its width, 0 if
+// there is nothing to draw.
+int compose(Row &row, lgfx::swap565_t *buf, int *x0) {
+  int from = row.dirty_from;
+  int to = std::min<int>(std::max(row.width, row.drawn_width), s_width);
+  row.dirty_from = kClean;
+  row.drawn_width = row.width;
+  if (to <= from) {
+    return 0;
+  }
+  int width = to - from;
+  memset(buf, 0, width * s_line_height * sizeof(*buf));
+  int x = 0;
+  for (size_t i = 0; i < row.count && x < to; x += row.advances[i++]) {
+    if (x + row.advances[i] <= from) {
+      continue;
+    }
+    const Glyph &g = glyph(row.glyphs[i], row.speaker);
+    int left = std::max(from - x, 0);
+    int right = std::min<int>(g.width, to - x);
+    for (int y = 0; y < s_line_height; y++) {
+      memcpy(buf + y * width + x + left - from, g.pixels + y * g.width + left,
+             (right - left) * sizeof(*buf));
+    }
+  }
+  *x0 = from;
+  return width;
+}
+
+// Returns true if rows were left for the next frame.
+bool render_frame() {
+  int64_t start = esp_timer_get_time();
+  drain();
+
+  M5GFX &display = M5.Display;
+  bool pending = false;
+  bool in_flight = false;
+  int64_t pushed_us = 0;
+  int64_t wait_us = 0;
+  int64_t bus_us = 0;
+  uint32_t rects = 0;
+  uint32_t bytes = 0;
+  int buffer = 0;
+  display.startWrite();
+  for (size_t pos = 0; pos < s_used_rows; pos++) {
+    Row &row = row_at(pos);
+    if (row.dirty_from == kClean) {
+      continue;
+    }
+    if (rects > 0 && esp_timer_get_time() - start > kFrameBudgetUs) {
+      pending = true;
+      break;
+    }
+    int x0 = 0;
+    int width = compose(row, s_line[buffer], &x0);
+    if (width == 0) {
+      continue;
+    }
+    // The previous row was transferring while this one was composed.
+    if (in_flight) {
+      int64_t wait_start = esp_timer_get_time();
+      display.waitDMA();
+      int64_t now = esp_timer_get_time();
+      wait_us += now - wait_start;
+      bus_us += now - pushed_us;
+    }
+    pushed_us = esp_timer_get_time();
+    display.pushImageDMA(x0, (int)pos * s_line_height, width, s_line_height,
+                         s_line[buffer]);
+    in_flight = true;
+    buffer ^= 1;
+    rects++;
+    bytes += width * s_line_height * sizeof(lgfx::swap565_t);
+  }
+  if (in_flight) {
+    int64_t wait_start = esp_timer_get_time();
+    display.waitDMA();
+    int64_t now = esp_timer_get_time();
+    wait_us += now - wait_start;
+    bus_us += now - pushed_us;
+  }
+  display.endWrite();
+
+  if (rects == 0) {
+    return pending;
+  }
+  // Time blocked on the transfers is not CPU time. Bus time runs from each
+  // push until its transfer is seen to finish, an upper bound when composing
+  // the next row outlasts the transfer.
+  int64_t cpu_us = esp_timer_get_time() - start - wait_us;
+  ESP_LOGD(TAG, "Frame: %lu rects, %lu bytes, cpu %lld us, bus %lld us",
+           (unsigned long)rects, (unsigned long)bytes, (long long)cpu_us,
+           (long long)bus_us);
+  s_stats.frames++;
+  s_stats.rects += rects;
+  s_stats.bytes += bytes;
+  s_stats.cpu_us += cpu_us;
+  s_stats.max_cpu_us = std::max(s_stats.max_cpu_us, cpu_us);
+  s_stats.bus_us += bus_us;
+  s_stats.max_bus_us = std::max(s_stats.max_bus_us, bus_us);
+  if (pending) {
+    s_stats.over_budget++;
+  }
+  return pending;
+}
+
+void log_stats() {
+  if (s_stats.frames == 0) {
+    return;
+  }
+  ESP_LOGI(TAG,
+           "%lu frames, %lu rects, %llu KB | cpu avg %lld max %lld us | bus "
+           "avg %lld max %lld us | %lu over budget | glyphs %lu hits %lu "
+           "misses | %lu dropped",
+           (unsigned long)s_stats.frames, (unsigned long)s_stats.rects,
+           (unsigned long long)(s_stats.bytes / 1024),
+           (long long)(s_stats.cpu_us / s_stats.frames),
+           (long long)s_stats.max_cpu_us,
+           (long long)(s_stats.bus_us / s_stats.frames),
+           (long long)s_stats.max_bus_us, (unsigned long)s_stats.over_budget,
+           (unsigned long)s_stats.glyph_hits,
+           (unsigned long)s_stats.glyph_misses,
+           (unsigned long)s_queue.drops());
+  s_stats = {};
+}
+
+void render_task(void *arg) {
+  int64_t next_log_us = esp_timer_get_time() + kLogIntervalUs;
+  bool pending = false;
+  while (true) {
+    if (!pending) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(kLogIntervalUs / 1000));
+    }
+    // Lets a burst of deltas land in one frame.
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_CAPTIONS_FRAME_MS));
+    pending = render_frame();
+
+    int64_t now = esp_timer_get_time();
+    if (now >= next_log_us) {
+      next_log_us = now + kLogIntervalUs;
+      log_stats();
+    }
+  }
+}
+
+}  // namespace
+
+void oai_captions_init() {
+  M5GFX &display = M5.Display;
+  if (display.width() == 0 || display.height() == 0) {
+    ESP_LOGI(TAG, "No display, captions disabled");
+    return;
+  }
+  s_width = display.width();
+  s_scratch.setColorDepth(16);
+  s_scratch.setFont(s_width >= 240 ? &fonts::DejaVu18 : &fonts::DejaVu12);
+  s_line_height = s_scratch.fontHeight();
+  s_rows = std::min<size_t>(display.height() / s_line_height, kMaxRows);
+
+  // The glyphs and rows are only read by the renderer, the line buffers are
+  // read by the SPI DMA and have to be in internal SRAM.
+  size_t glyph_size = s_line_height * s_line_height * sizeof(lgfx::swap565_t);
+  auto *glyph_pixels = (lgfx::swap565_t *)oai_mem_alloc(
+      kGlyphSlots * glyph_size, OaiMemPlacement::kCold);
+  s_row = (Row *)oai_mem_alloc(s_rows * sizeof(Row), OaiMemPlacement::kCold);
+  size_t line_size = s_width * s_line_height * sizeof(lgfx::swap565_t);
+  for (auto &line : s_line) {
+    line = (lgfx::swap565_t *)heap_caps_malloc(
+        line_size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  }
+  if (glyph_pixels == nullptr || s_row == nullptr || s_line[0] == nullptr ||
+      s_line[1] == nullptr ||
+      s_scratch.createSprite(s_line_height, s_line_height) == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate the caption buffers");
+    return;
+  }
+  for (size_t i = 0; i < kGlyphSlots; i++) {
+    s_glyphs[i].pixels = glyph_pixels + i * s_line_height * s_line_height;
+  }
+  memset(s_row, 0, s_rows * sizeof(Row));
+
+  display.fillScreen(TFT_BLACK);
+  if (xTaskCreatePinnedToCore(render_task, "captions", 4096, nullptr,
+                              tskIDLE_PRIORITY + 1, &s_task,
+                              CONFIG_CAPTIONS_CORE) != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create the caption task");
+    s_task = nullptr;
+    return;
+  }
+  ESP_LOGI(TAG, "%dx%d, %u rows of %d px", s_width, (int)display.height(),
+           (unsigned)s_rows, s_line_height);
+}
+
+void oai_captions_session_open() {
+  if (s_task == nullptr || sizeof(CONFIG_CAPTIONS_TRANSCRIPTION_MODEL) == 1) {
+    return;
+  }
+  oai_send_input_transcription(CONFIG_CAPTIONS_TRANSCRIPTION_MODEL);
+}
+
+void oai_captions_text(OaiCaptionSpeaker speaker, const JsonValue &text) {
+  if (s_task == nullptr) {
+    return;
+  }
+  std::string_view s = text.str();
+  size_t pos = 0;
+  while (pos < s.size()) {
+    Slot *slot = s_queue.claim();
+    if (slot == nullptr) {
+      break;
+    }
+    size_t len = 0;
+    while (pos + len < s.size()) {
+      size_t n = token_length(s, pos + len);
+      if (len + n > kSlotText) {
+        break;
+      }
+      len += n;
+    }
+    slot->speaker = (uint8_t)speaker;
+    slot->len = len;
+    slot->end_turn = false;
+    memcpy(slot->text, s.data() + pos, len);
+    s_queue.publish();
+    pos += len;
+  }
+  xTaskNotifyGive(s_task);
+}
+
+void oai_captions_end_turn() {
+  if (s_task == nullptr) {
+    return;
+  }
+  Slot *slot = s_queue.claim();
+  if (slot != nullptr) {
+    slot->end_turn = true;
+    s_queue.publish();
+  }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "json_stream.h"
+
+// Live captions on the M5 display.
+//
+// The event handlers only copy the transcript text, still JSON-escaped, into
+// a lock-free queue. A low priority task on CONFIG_CAPTIONS_CORE, away from
+// the audio tasks, decodes it, wraps it into rows and redraws only the parts
+// of rows that changed. Glyphs are rendered once into a cache and copied from
+// there, rows are composed into two line buffers and pushed with DMA while
+// the next one is composed. A frame stops drawing after
+// CONFIG_CAPTIONS_FRAME_BUDGET_US and leaves the rest to the next one.
+
+enum class OaiCaptionSpeaker : uint8_t {
+  kUser,
+  kAssistant,
+};
+
+// Does nothing on boards without a display.
+void oai_captions_init();
+
+// Asks for transcripts of the user's speech when
+// CONFIG_CAPTIONS_TRANSCRIPTION_MODEL is set, called when the event channel
+// of a session opens.
+void oai_captions_session_open();
+
+// Appends the text of a string value of an event. Must be called from one
+// task only, the one that dispatches events. Text that does not fit the
+// queue is dropped and counted.
+void oai_captions_text(OaiCaptionSpeaker speaker, const JsonValue &text);
+// Ends the current turn, the next text starts a new row.
+void oai_captions_end_turn();
@@ -0,0 +1,361 @@
+#include "codec.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+
+#include "g711.h"
+
+#ifdef CONFIG_CODEC_BENCHMARK
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <math.h>
+#include <stdlib.h>
+#endif  // CONFIG_CODEC_BENCHMARK
+#ifdef CONFIG_OPUS_KERNELS_ESP32S3
+#include <atomic>
+
+#include "opus_kernels.h"
+#endif
+
+constexpr const char *TAG = "codec";
+
+#ifdef CONFIG_OPUS_KERNELS_ESP32S3
+namespace {
+
+std::atomic<bool> s_kernels_checked{false};
+
+// Every Opus frame runs the correlation kernels. If the first one made no
+// call through the hooks, the override in opus_kernels.h never reached
+// libopus and the encoder runs the C kernels.
+void check_kernel_hooks() {
+  if (s_kernels_checked.load(std::memory_order_relaxed) ||
+      s_kernels_checked.exchange(true)) {
+    return;
+  }
+  if (oai_opus_kernels_calls() == 0) {
+    ESP_LOGE(TAG, "libopus does not call the Opus vector kernels");
+  }
+}
+
+}  // namespace
+#endif  // CONFIG_OPUS_KERNELS_ESP32S3
+
+const char *oai_audio_codec_name(OaiAudioCodecType type) {
+  switch (type) {
+    case OaiAudioCodecType::kOpus:
+      return "Opus";
+    case OaiAudioCodecType::kPcmu:
+      return "PCMU";
+    case OaiAudioCodecType::kPcma:
+      return "PCMA";
+  }
+  return "?";
+}
+
+MediaCodec oai_audio_codec_media(OaiAudioCodecType type) {
+  switch (type) {
+    case OaiAudioCodecType::kOpus:
+      return CODEC_OPUS;
+    case OaiAudioCodecType::kPcmu:
+      return CODEC_PCMU;
+    case OaiAudioCodecType::kPcma:
+      return CODEC_PCMA;
+  }
+  return CODEC_NONE;
+}
+
+// The codec state is allocated here rather than by opus_*_create, which
+// would take it from the default heap.
+OaiAudioCodec::~OaiAudioCodec() {
+  oai_mem_free(encoder_);
+  oai_mem_free(decoder_);
+}
+
+bool OaiAudioCodec::init_encoder(OaiMemPlacement placement) {
+  if (type_ != OaiAudioCodecType::kOpus) {
+    return true;
+  }
+  encoder_ =
+      (OpusEncoder *)oai_mem_alloc(opus_encoder_get_size(1), placement);
+  if (encoder_ == nullptr) {
+    ESP_LOGE(TAG, "Failed to create OPUS encoder");
+    return false;
+  }
+
+  if (opus_encoder_init(encoder_, SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP) !=
+      OPUS_OK) {
+    ESP_LOGE(TAG, "Failed to initialize OPUS encoder");
+    oai_mem_free(encoder_);
+    encoder_ = nullptr;
+    return false;
+  }
+
+  configure_encoder(OPUS_ENCODER_BITRATE, OPUS_ENCODER_COMPLEXITY);
+  opus_encoder_ctl(encoder_, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+  return true;
+}
+
+void OaiAudioCodec::configure_encoder(int32_t bitrate, int32_t complexity) {
+  if (encoder_ == nullptr) {
+    return;
+  }
+  opus_encoder_ctl(encoder_, OPUS_SET_BITRATE(bitrate));
+  opus_encoder_ctl(encoder_, OPUS_SET_COMPLEXITY(complexity));
+}
+
+bool OaiAudioCodec::init_decoder(OaiMemPlacement placement) {
+  if (type_ != OaiAudioCodecType::kOpus) {
+    return true;
+  }
+  decoder_ =
+      (OpusDecoder *)oai_mem_alloc(opus_decoder_get_size(1), placement);
+  if (decoder_ == nullptr ||
+      opus_decoder_init(decoder_, SAMPLE_RATE, 1) != OPUS_OK) {
+    ESP_LOGE(TAG, "Failed to create OPUS decoder");
+    oai_mem_free(decoder_);
+    decoder_ = nullptr;
+    return false;
+  }
+  return true;
+}
+
+int OaiAudioCodec::encode(const opus_int16 *pcm, size_t samples,
+                          uint8_t *packet, size_t packet_size) {
+  switch (type_) {
+    case OaiAudioCodecType::kOpus: {
+      int size = opus_encode(encoder_, pcm, samples, packet, packet_size);
+#ifdef CONFIG_OPUS_KERNELS_ESP32S3
+      check_kernel_hooks();
+#endif
+      return size;
+    }
+    case OaiAudioCodecType::kPcmu:
+      samples = std::min(samples, packet_size);
+      oai_g711_ulaw_encode(pcm, samples, packet);
+      return samples;
+    case OaiAudioCodecType::kPcma:
+      samples = std::min(samples, packet_size);
+      oai_g711_alaw_encode(pcm, samples, packet);
+      return samples;
+  }
+  return OPUS_BAD_ARG;
+}
+
+int OaiAudioCodec::decode(const uint8_t *packet, size_t size, opus_int16 *pcm,
+                          size_t max_samples) {
+  switch (type_) {
+    case OaiAudioCodecType::kOpus:
+      return opus_decode(decoder_, packet, size, pcm, max_samples, 0);
+    case OaiAudioCodecType::kPcmu:
+      size = std::min(size, max_samples);
+      oai_g711_ulaw_decode(packet, size, pcm);
+      return size;
+    case OaiAudioCodecType::kPcma:
+      size = std::min(size, max_samples);
+      oai_g711_alaw_decode(packet, size, pcm);
+      return size;
+  }
+  return OPUS_BAD_ARG;
+}
+
+int32_t OaiAudioCodec::lookahead() const {
+  opus_int32 samples = 0;
+  if (encoder_ != nullptr) {
+    opus_encoder_ctl(encoder_, OPUS_GET_LOOKAHEAD(&samples));
+  }
+  return samples;
+}
+
+#ifdef CONFIG_CODEC_BENCHMARK
+namespace {
+
+// Same as the audio publisher, which the Opus encoder needs.
+constexpr size_t kBenchStackSize = 20000;
+constexpr int64_t kFrameUs = BUFFER_SAMPLES * 1000000LL / SAMPLE_RATE;
+
+struct CodecBench {
+  OaiAudioCodecType type;
+  TaskHandle_t caller;
+  bool ok;
+  int64_t encode_us;
+  int64_t decode_us;
+  int64_t bytes;
+  int32_t lookahead;
+  // Opus encoder complexity, or -1 for the configured one.
+  int32_t complexity;
+  // FNV-1a of every packet, for comparing kernel variants.
+  uint32_t packet_hash = 2166136261u;
+};
+
+void run_benchmark(CodecBench *bench) {
+  static opus_int16 pcm[BUFFER_SAMPLES];
+  static opus_int16 decoded[BUFFER_SAMPLES];
+  static uint8_t packet[OPUS_OUT_BUFFER_SIZE];
+  OaiAudioCodec codec(bench->type);
+  bench->ok = codec.init_encoder() && codec.init_decoder();
+  bench->lookahead = codec.lookahead();
+  if (bench->ok && bench->complexity >= 0) {
+    codec.configure_encoder(OPUS_ENCODER_BITRATE, bench->complexity);
+  }
+
+  // A voiced-speech-like signal, so the Opus encoder does real work. The
+  // same one for every codec and complexity.
+  srand(1);
+  for (int i = 0; i < BUFFER_SAMPLES; i++) {
+    float t = (float)i / SAMPLE_RATE;
+    pcm[i] = (opus_int16)(6000 * sinf(2 * M_PI * 220 * t) +
+                          3000 * sinf(2 * M_PI * 660 * t) +
+                          (rand() % 1000 - 500));
+  }
+  for (int n = 0; bench->ok && n < CONFIG_CODEC_BENCHMARK_FRAMES; n++) {
+    int64_t start = esp_timer_get_time();
+    int size = codec.encode(pcm, BUFFER_SAMPLES, packet, sizeof(packet));
+    int64_t encoded = esp_timer_get_time();
+    bench->ok = size > 0 &&
+                codec.decode(packet, size, decoded, BUFFER_SAMPLES) > 0;
+    bench->encode_us += encoded - start;
+    bench->decode_us += esp_timer_get_time() - encoded;
+    bench->bytes += size;
+    for (int i = 0; i < size; i++) {
+      bench->packet_hash = (bench->packet_hash ^ packet[i]) * 16777619u;
+    }
+  }
+}
+
+#ifndef LINUX_BUILD
+void bench_task(void *arg) {
+  CodecBench *bench = (CodecBench *)arg;
+  run_benchmark(bench);
+  xTaskNotifyGive(bench->caller);
+  vTaskSuspend(nullptr);
+}
+#endif  // LINUX_BUILD
+
+// False if the benchmark task could not be started.
+bool measure(CodecBench *bench) {
+#ifndef LINUX_BUILD
+  // Same priority and core as the audio publisher.
+  bench->caller = xTaskGetCurrentTaskHandle();
+  TaskHandle_t task = nullptr;
+  if (xTaskCreatePinnedToCore(bench_task, "codec_bench", kBenchStackSize,
+                              bench, 7, &task, 0) != pdPASS) {
+    ESP_LOGE(TAG, "Out of memory for the benchmark task");
+    return false;
+  }
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  vTaskDelete(task);
+#else
+  run_benchmark(bench);
+#endif  // LINUX_BUILD
+  return true;
+}
+
+#ifdef CONFIG_CODEC_BENCHMARK_COMPLEXITY
+// CPU share of one core at the real-time frame rate, in 0.01 %.
+int64_t encode_share(int64_t encode_us) {
+  return encode_us * 10000 / (kFrameUs * CONFIG_CODEC_BENCHMARK_FRAMES);
+}
+
+// Encode cost of every Opus complexity, with the C kernels and, when
+// libopus has them, the vector kernels.
+void benchmark_complexity() {
+  constexpr int frames = CONFIG_CODEC_BENCHMARK_FRAMES;
+#ifdef CONFIG_OPUS_KERNELS_ESP32S3
+  // Skipped if the startup check turned them off.
+  bool vector = oai_opus_kernels_vector();
+#endif
+  for (int complexity = 0; complexity <= 10; complexity++) {
+    CodecBench c = {OaiAudioCodecType::kOpus, nullptr, false, 0, 0, 0, 0,
+                    complexity};
+#ifdef CONFIG_OPUS_KERNELS_ESP32S3
+    oai_opus_kernels_use_vector(false);
+#endif
+    if (!measure(&c)) {
+      return;
+    }
+    if (!c.ok) {
+      ESP_LOGE(TAG, "Opus complexity %d benchmark failed", complexity);
+      continue;
+    }
+    int64_t busy = encode_share(c.encode_us);
+#ifdef CONFIG_OPUS_KERNELS_ESP32S3
+    CodecBench v = {OaiAudioCodecType::kOpus, nullptr, false, 0, 0, 0, 0,
+                    complexity};
+    oai_opus_kernels_use_vector(vector);
+    uint32_t calls = oai_opus_kernels_calls();
+    if (vector && !measure(&v)) {
+      return;
+    }
+    // Bit-exact kernels encode the same packets. Without calls the hooks
+    // are not in libopus and both columns would measure the C kernels.
+    if (v.ok && oai_opus_kernels_calls() == calls) {
+      ESP_LOGE(TAG, "Opus complexity %d: the vector kernels were not called",
+               complexity);
+    } else if (v.ok && (v.bytes != c.bytes || v.packet_hash != c.packet_hash)) {
+      ESP_LOGE(TAG,
+               "Opus complexity %d: the vector kernels encode other packets "
+               "than the C ones",
+               complexity);
+    } else if (v.ok) {
+      int64_t vector_busy = encode_share(v.encode_us);
+      ESP_LOGI(TAG,
+               "Opus complexity %2d | C %lld us/frame, %lld.%02lld%% CPU | "
+               "vector %lld us/frame, %lld.%02lld%% CPU | %lld bytes/frame",
+               complexity, (long long)(c.encode_us / frames),
+               (long long)(busy / 100), (long long)(busy % 100),
+               (long long)(v.encode_us / frames),
+               (long long)(vector_busy / 100), (long long)(vector_busy % 100),
+               (long long)(c.bytes / frames));
+      continue;
+    }
+#endif  // CONFIG_OPUS_KERNELS_ESP32S3
+    ESP_LOGI(TAG,
+             "Opus complexity %2d | C %lld us/frame, %lld.%02lld%% CPU | "
+             "%lld bytes/frame",
+             complexity, (long long)(c.encode_us / frames),
+             (long long)(busy / 100), (long long)(busy % 100),
+             (long long)(c.bytes / frames));
+  }
+}
+#endif  // CONFIG_CODEC_BENCHMARK_COMPLEXITY
+
+}  // namespace
+
+void oai_codec_benchmark() {
+  constexpr OaiAudioCodecType kTypes[] = {OaiAudioCodecType::kOpus,
+                                          OaiAudioCodecType::kPcmu,
+                                          OaiAudioCodecType::kPcma};
+  constexpr int frames = CONFIG_CODEC_BENCHMARK_FRAMES;
+  for (OaiAudioCodecType type : kTypes) {
+    CodecBench bench = {type, nullptr, false, 0, 0, 0, 0, -1};
+    if (!measure(&bench)) {
+      return;
+    }
+    if (!bench.ok) {
+      ESP_LOGE(TAG, "%s benchmark failed", oai_audio_codec_name(type));
+      continue;
+    }
+
+    // CPU share of one core at the real-time frame rate, in 0.01 %.
+    int64_t busy = (bench.encode_us + bench.decode_us) * 10000 /
+                   (kFrameUs * frames);
+    // Capture to packet, before any network or jitter buffer delay.
+    int64_t delay_us =
+        kFrameUs + bench.lookahead * 1000000LL / SAMPLE_RATE;
+    ESP_LOGI(TAG,
+             "%s | encode %lld us/frame | decode %lld us/frame | %lld "
+             "bytes/frame | %lld.%02lld%% CPU | algorithmic delay %lld.%lld "
+             "ms",
+             oai_audio_codec_name(type), (long long)(bench.encode_us / frames),
+             (long long)(bench.decode_us / frames),
+             (long long)(bench.bytes / frames), (long long)(busy / 100),
+             (long long)(busy % 100), (long long)(delay_us / 1000),
+             (long long)(delay_us % 1000 / 100));
+  }
+#ifdef CONFIG_CODEC_BENCHMARK_COMPLEXITY
+  benchmark_complexity();
+#endif
+}
+#endif  // CONFIG_CODEC_BENCHMARK
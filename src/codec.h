@@ -0,0 +1,84 @@
+#pragma once
+
+#include <opus.h>
+#include <peer.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mem.h"
+
+#define OPUS_OUT_BUFFER_SIZE 1276  // 1276 bytes is recommended by opus_encode
+#define SAMPLE_RATE 8000
+#define BUFFER_SAMPLES 320
+// The longest capture frame the settings allow, 60 ms.
+#define MAX_BUFFER_SAMPLES (SAMPLE_RATE * 60 / 1000)
+
+#define OPUS_ENCODER_BITRATE 30000
+#define OPUS_ENCODER_COMPLEXITY CONFIG_OPUS_ENCODER_COMPLEXITY
+
+enum class OaiAudioCodecType : uint8_t {
+  kOpus,
+  kPcmu,
+  kPcma,
+};
+
+// The codec negotiated for the audio track, CONFIG_AUDIO_CODEC.
+#if defined(CONFIG_AUDIO_CODEC_PCMU)
+#define AUDIO_CODEC OaiAudioCodecType::kPcmu
+#define AUDIO_CODEC_G711 1
+#elif defined(CONFIG_AUDIO_CODEC_PCMA)
+#define AUDIO_CODEC OaiAudioCodecType::kPcma
+#define AUDIO_CODEC_G711 1
+#else
+#define AUDIO_CODEC OaiAudioCodecType::kOpus
+#endif
+
+// Opus always uses a 48 kHz RTP clock, G.711 its sample rate.
+#ifdef AUDIO_CODEC_G711
+#define AUDIO_RTP_CLOCK_RATE SAMPLE_RATE
+#else
+#define AUDIO_RTP_CLOCK_RATE 48000
+#endif
+
+const char *oai_audio_codec_name(OaiAudioCodecType type);
+MediaCodec oai_audio_codec_media(OaiAudioCodecType type);
+
+// Encoder and decoder of one session. Every session owns its own codec
+// state, so several sessions can encode and decode at the same time. G.711
+// is stateless and only the Opus state is allocated.
+class OaiAudioCodec {
+ public:
+  explicit OaiAudioCodec(OaiAudioCodecType type = AUDIO_CODEC)
+      : type_(type) {}
+  ~OaiAudioCodec();
+  OaiAudioCodec(const OaiAudioCodec &) = delete;
+  OaiAudioCodec &operator=(const OaiAudioCodec &) = delete;
+
+  // The codec state is touched every frame, keep it hot unless measuring.
+  bool init_encoder(OaiMemPlacement placement = OaiMemPlacement::kHot);
+  bool init_decoder(OaiMemPlacement placement = OaiMemPlacement::kHot);
+  // Takes effect with the next encoded frame.
+  void configure_encoder(int32_t bitrate, int32_t complexity);
+
+  // Encodes one frame of samples, a valid Opus frame length. Returns the
+  // packet size or a negative Opus error. A G.711 packet is one byte per
+  // sample.
+  int encode(const opus_int16 *pcm, size_t samples, uint8_t *packet,
+             size_t packet_size);
+  // Returns the number of decoded samples or a negative Opus error.
+  int decode(const uint8_t *packet, size_t size, opus_int16 *pcm,
+             size_t max_samples);
+
+  OaiAudioCodecType type() const { return type_; }
+  // Samples the encoder delays its input by, on top of the frame.
+  int32_t lookahead() const;
+
+ private:
+  OaiAudioCodecType type_;
+  OpusEncoder *encoder_ = nullptr;
+  OpusDecoder *decoder_ = nullptr;
+};
+
+#ifdef CONFIG_CODEC_BENCHMARK
+void oai_codec_benchmark();
+#endif  // CONFIG_CODEC_BENCHMARK
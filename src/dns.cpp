@@ -0,0 +1,159 @@
+#include "dns.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <atomic>
+
+#ifndef LINUX_BUILD
+#include <esp_event.h>
+#include <esp_netif.h>
+#endif
+
+constexpr const char *TAG = "dns";
+
+namespace {
+
+// Guarded by s_lock.
+SemaphoreHandle_t s_lock = nullptr;
+StaticSemaphore_t s_lock_buffer;
+char s_host[128];
+char s_addr[INET_ADDRSTRLEN];
+
+TaskHandle_t s_task = nullptr;
+#ifndef LINUX_BUILD
+std::atomic<bool> s_network_up{false};
+#else
+std::atomic<bool> s_network_up{true};
+#endif
+
+bool resolve(const char *host, char *addr, size_t len) {
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *result = nullptr;
+  if (int err = getaddrinfo(host, nullptr, &hints, &result);
+      err != 0 || result == nullptr) {
+    ESP_LOGW(TAG, "Failed to resolve %s: %d", host, err);
+    return false;
+  }
+  const sockaddr_in *sin = (const sockaddr_in *)result->ai_addr;
+  bool ok = inet_ntop(AF_INET, &sin->sin_addr, addr, len) != nullptr;
+  freeaddrinfo(result);
+  return ok;
+}
+
+// Resolves the current host. Returns false if it should be retried soon.
+bool refresh() {
+  char host[sizeof(s_host)];
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  strcpy(host, s_host);
+  xSemaphoreGive(s_lock);
+  if (host[0] == '\0') {
+    return true;
+  }
+
+  char addr[sizeof(s_addr)];
+  int64_t start = esp_timer_get_time();
+  if (!resolve(host, addr, sizeof(addr))) {
+    return false;
+  }
+  ESP_LOGI(TAG, "Resolved %s to %s in %lld ms", host, addr,
+           (long long)(esp_timer_get_time() - start) / 1000);
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  // The host may have changed while resolving.
+  if (strcmp(host, s_host) == 0) {
+    strcpy(s_addr, addr);
+  }
+  xSemaphoreGive(s_lock);
+  return true;
+}
+
+// Sleeps until woken by a prefetch, an invalidation or a new IP address,
+// or until the next refresh is due. lwIP keeps the record for its TTL, so a
+// refresh only goes to the network once the record has expired.
+void refresh_task(void *arg) {
+  TickType_t wait = portMAX_DELAY;
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, wait);
+    if (!s_network_up) {
+      wait = portMAX_DELAY;
+      continue;
+    }
+    wait = refresh() ? pdMS_TO_TICKS(CONFIG_DNS_CACHE_REFRESH_S * 1000)
+                     : pdMS_TO_TICKS(CONFIG_DNS_CACHE_RETRY_MS);
+  }
+}
+
+void wake() {
+  if (s_task != nullptr) {
+    xTaskNotifyGive(s_task);
+  }
+}
+
+}  // namespace
+
+void oai_dns_init() {
+  s_lock = xSemaphoreCreateMutexStatic(&s_lock_buffer);
+  if (xTaskCreate(refresh_task, "dns_refresh", CONFIG_DNS_CACHE_STACK_SIZE,
+                  nullptr, tskIDLE_PRIORITY + 1, &s_task) != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create the refresh task");
+  }
+
+#ifndef LINUX_BUILD
+  // The network may have changed with every new address.
+  ESP_ERROR_CHECK(esp_event_handler_register(
+      IP_EVENT, IP_EVENT_STA_GOT_IP,
+      [](void *arg, esp_event_base_t base, int32_t id, void *data) {
+        s_network_up = true;
+        wake();
+      },
+      nullptr));
+#endif
+}
+
+void oai_dns_prefetch(const char *host) {
+  assert(host != nullptr);
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  bool changed = strcmp(host, s_host) != 0;
+  if (changed) {
+    strncpy(s_host, host, sizeof(s_host) - 1);
+    s_addr[0] = '\0';
+  }
+  xSemaphoreGive(s_lock);
+  if (changed) {
+    wake();
+  }
+}
+
+bool oai_dns_lookup(const char *host, char *addr, size_t len) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  bool hit = strcmp(host, s_host) == 0 && s_addr[0] != '\0' &&
+             strlen(s_addr) < len;
+  if (hit) {
+    strcpy(addr, s_addr);
+  }
+  xSemaphoreGive(s_lock);
+  if (!hit) {
+    oai_dns_prefetch(host);
+  }
+  return hit;
+}
+
+void oai_dns_refresh(const char *host) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  bool cached = strcmp(host, s_host) == 0;
+  xSemaphoreGive(s_lock);
+  if (cached) {
+    wake();
+  }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+// Resolver cache for the realtime API host.
+//
+// The host is resolved in the background as soon as the station has an IP
+// address and refreshed every CONFIG_DNS_CACHE_REFRESH_S, so session setup
+// and reconnects skip the DNS round trip. The last good address is kept
+// when a refresh fails.
+
+void oai_dns_init();
+// Sets the host to keep resolved. Replaces the previous one.
+void oai_dns_prefetch(const char *host);
+// Copies the cached IPv4 address of host into addr. On a miss the host is
+// prefetched for next time and false is returned.
+bool oai_dns_lookup(const char *host, char *addr, size_t len);
+// Resolves host again now, e.g. after connecting to the cached address
+// failed. The cached address is kept until that succeeds.
+void oai_dns_refresh(const char *host);
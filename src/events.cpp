@@ -0,0 +1,538 @@
+#include "events.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+
+#ifdef CONFIG_EVENTS_BENCHMARK
+#include <cJSON.h>
+#include <stdlib.h>
+#endif  // CONFIG_EVENTS_BENCHMARK
+
+#if defined(CONFIG_EVENTS_BENCHMARK) && defined(CONFIG_ALLOC_TRACK)
+#include "alloc_track.h"
+#endif
+#ifdef CONFIG_CAPTIONS
+#include "captions.h"
+#endif
+#ifdef CONFIG_GREETING_CACHE
+#include "greeting.h"
+#endif
+#include "main.h"
+#include "power.h"
+#include "tools.h"
+#ifdef CONFIG_TRANSPORT_STATS
+#include "transport_stats.h"
+#endif
+#ifdef CONFIG_REALTIME_TRANSPORT_WEBSOCKET
+#include "websocket.h"
+#endif
+
+constexpr const char *TAG = "events";
+
+// Expands a std::string_view for a "%.*s" format.
+#define SV_ARG(sv) (int)(sv).size(), (sv).data()
+
+namespace {
+
+using EventHandler = void (*)(const JsonValue &event);
+
+struct EventHandlerEntry {
+  std::string_view type;
+  EventHandler handler;
+};
+
+void on_error(const JsonValue &event) {
+  JsonValue error = event["error"];
+  ESP_LOGE(TAG, "Server error (%.*s): %.*s", SV_ARG(error["code"].str()),
+           SV_ARG(error["message"].str()));
+}
+
+void on_input_transcription_completed(const JsonValue &event) {
+  ESP_LOGI(TAG, "User: %.*s", SV_ARG(event["transcript"].str()));
+#ifdef CONFIG_CAPTIONS
+  oai_captions_text(OaiCaptionSpeaker::kUser, event["transcript"]);
+  oai_captions_end_turn();
+#endif
+}
+
+void on_speech_started(const JsonValue &event) {
+  ESP_LOGD(TAG, "Speech started");
+  oai_power_activity(OaiPowerActivity::kSpeechStarted);
+#ifdef CONFIG_REALTIME_TRANSPORT_WEBSOCKET
+  // The server stops the response, stop the audio already queued too.
+  oai_websocket_audio_flush();
+#endif
+}
+
+void on_speech_stopped(const JsonValue &event) {
+  ESP_LOGD(TAG, "Speech stopped");
+  oai_power_activity(OaiPowerActivity::kSpeechStopped);
+#ifdef CONFIG_TRANSPORT_STATS
+  oai_transport_stats_speech_stopped();
+#endif
+}
+
+void on_rate_limits_updated(const JsonValue &event) {
+  JsonIterator it(event["rate_limits"]);
+  JsonValue limit;
+  while (it.next(nullptr, &limit)) {
+    int64_t remaining = 0;
+    int64_t total = 0;
+    limit["remaining"].as_int(&remaining);
+    limit["limit"].as_int(&total);
+    ESP_LOGI(TAG, "Rate limit %.*s: %lld/%lld remaining",
+             SV_ARG(limit["name"].str()), (long long)remaining,
+             (long long)total);
+  }
+}
+
+// Only the WebSocket transport carries audio in events, WebRTC has a track.
+void on_audio_delta(const JsonValue &event) {
+#ifdef CONFIG_REALTIME_TRANSPORT_WEBSOCKET
+  oai_websocket_audio_delta(event["delta"]);
+#endif
+}
+
+void on_transcript_delta(const JsonValue &event) {
+  ESP_LOGD(TAG, "Assistant: %.*s", SV_ARG(event["delta"].str()));
+#ifdef CONFIG_CAPTIONS
+  oai_captions_text(OaiCaptionSpeaker::kAssistant, event["delta"]);
+#endif
+}
+
+void on_transcript_done(const JsonValue &event) {
+#ifdef CONFIG_GREETING_CACHE
+  oai_greeting_capture_transcript(event["transcript"]);
+#endif
+}
+
+void on_response_done(const JsonValue &event) {
+  JsonValue response = event["response"];
+  int64_t total_tokens = 0;
+  response["usage"]["total_tokens"].as_int(&total_tokens);
+  ESP_LOGI(TAG, "Response %.*s: %.*s, %lld tokens",
+           SV_ARG(response["id"].str()), SV_ARG(response["status"].str()),
+           (long long)total_tokens);
+  oai_power_activity(OaiPowerActivity::kResponseDone);
+#ifdef CONFIG_CAPTIONS
+  oai_captions_end_turn();
+#endif
+}
+
+// Sent once the last audio of a response went out, which for WebRTC is later
+// than response.done since the audio is paced in real time.
+void on_output_audio_stopped(const JsonValue &event) {
+#ifdef CONFIG_GREETING_CACHE
+  oai_greeting_capture_end();
+#endif
+}
+
+void on_function_call_arguments_done(const JsonValue &event) {
+  ESP_LOGI(TAG, "Function call %.*s(%.*s) id=%.*s", SV_ARG(event["name"].str()),
+           SV_ARG(event["arguments"].str()), SV_ARG(event["call_id"].str()));
+  oai_tools_submit(event);
+}
+
+// Sorted by type, looked up with a binary search.
+constexpr EventHandlerEntry kEventHandlers[] = {
+    {"conversation.item.input_audio_transcription.completed",
+     on_input_transcription_completed},
+    {"error", on_error},
+    {"input_audio_buffer.speech_started", on_speech_started},
+    {"input_audio_buffer.speech_stopped", on_speech_stopped},
+    {"output_audio_buffer.stopped", on_output_audio_stopped},
+    {"rate_limits.updated", on_rate_limits_updated},
+    {"response.audio.delta", on_audio_delta},
+    {"response.audio_transcript.delta", on_transcript_delta},
+    {"response.audio_transcript.done", on_transcript_done},
+    {"response.done", on_response_done},
+    {"response.function_call_arguments.done", on_function_call_arguments_done},
+};
+
+constexpr bool entry_less(const EventHandlerEntry &a,
+                          const EventHandlerEntry &b) {
+  return a.type < b.type;
+}
+static_assert(std::is_sorted(std::begin(kEventHandlers),
+                             std::end(kEventHandlers), entry_less),
+              "kEventHandlers must be sorted by type");
+
+EventHandler find_handler(std::string_view type) {
+  const EventHandlerEntry key = {type, nullptr};
+  auto it = std::lower_bound(std::begin(kEventHandlers),
+                             std::end(kEventHandlers), key, entry_less);
+  if (it == std::end(kEventHandlers) || it->type != type) {
+    return nullptr;
+  }
+  return it->handler;
+}
+
+}  // namespace
+
+void oai_event_dispatch(const char *msg, size_t len) {
+  JsonValue event = oai_json_parse(std::string_view(msg, len));
+  if (!event.is_object()) {
+    ESP_LOGW(TAG, "Malformed event (%u bytes)", (unsigned)len);
+    return;
+  }
+  std::string_view type = event["type"].str();
+  if (EventHandler handler = find_handler(type); handler != nullptr) {
+    handler(event);
+  } else {
+    ESP_LOGV(TAG, "Unhandled event %.*s", SV_ARG(type));
+  }
+}
+
+namespace {
+
+// Bounded FIFO of serialized client events. Producers may run on any task,
+// the peer loop drains it.
+struct OutboundSlot {
+  OaiOutboundKind kind;
+  uint16_t len;
+  char data[CONFIG_EVENTS_OUTBOUND_SLOT_SIZE];
+};
+
+OutboundSlot s_outbound[CONFIG_EVENTS_OUTBOUND_QUEUE_LEN];
+size_t s_outbound_head = 0;
+size_t s_outbound_count = 0;
+OaiOutboundStats s_outbound_stats;
+OaiEventSender s_outbound_sender = nullptr;
+SemaphoreHandle_t s_outbound_lock = nullptr;
+StaticSemaphore_t s_outbound_lock_buffer;
+
+void outbound_lock() { xSemaphoreTake(s_outbound_lock, portMAX_DELAY); }
+
+void outbound_unlock() { xSemaphoreGive(s_outbound_lock); }
+
+OutboundSlot &outbound_slot(size_t index) {
+  return s_outbound[(s_outbound_head + index) % std::size(s_outbound)];
+}
+
+// session.update is a partial update, a newer one does not replace the
+// fields set by an older one.
+bool is_coalescing(OaiOutboundKind kind) {
+  return kind == OaiOutboundKind::kResponseCreate;
+}
+
+}  // namespace
+
+void oai_events_init() {
+  s_outbound_lock = xSemaphoreCreateMutexStatic(&s_outbound_lock_buffer);
+}
+
+bool oai_event_enqueue(OaiOutboundKind kind, std::string_view json) {
+  if (json.size() > sizeof(OutboundSlot::data)) {
+    ESP_LOGE(TAG, "Outbound event too large (%u bytes)", (unsigned)json.size());
+    outbound_lock();
+    s_outbound_stats.dropped++;
+    outbound_unlock();
+    return false;
+  }
+
+  outbound_lock();
+  OutboundSlot *slot = nullptr;
+  if (s_outbound_count > 0 && is_coalescing(kind) &&
+      outbound_slot(s_outbound_count - 1).kind == kind) {
+    slot = &outbound_slot(s_outbound_count - 1);
+    s_outbound_stats.coalesced++;
+  } else if (s_outbound_count < std::size(s_outbound)) {
+    slot = &outbound_slot(s_outbound_count++);
+  }
+  if (slot != nullptr) {
+    slot->kind = kind;
+    slot->len = json.size();
+    memcpy(slot->data, json.data(), json.size());
+    s_outbound_stats.queued++;
+    s_outbound_stats.high_water =
+        std::max<uint32_t>(s_outbound_stats.high_water, s_outbound_count);
+  } else {
+    s_outbound_stats.dropped++;
+  }
+  outbound_unlock();
+
+  if (slot == nullptr) {
+    ESP_LOGW(TAG, "Outbound queue full, dropped event (%lu dropped)",
+             (unsigned long)s_outbound_stats.dropped);
+    return false;
+  }
+  if (kind == OaiOutboundKind::kResponseCreate) {
+    oai_power_activity(OaiPowerActivity::kResponseRequested);
+  }
+  oai_peer_loop_wakeup();
+  return true;
+}
+
+void oai_events_attach(OaiEventSender sender) {
+  outbound_lock();
+  s_outbound_sender = sender;
+  if (sender == nullptr) {
+    s_outbound_head = 0;
+    s_outbound_count = 0;
+  }
+  outbound_unlock();
+}
+
+void oai_events_flush() {
+  if (s_outbound_count == 0) {
+    return;
+  }
+
+  outbound_lock();
+  size_t budget = CONFIG_EVENTS_OUTBOUND_MAX_BYTES_PER_FLUSH;
+  while (s_outbound_sender != nullptr && s_outbound_count > 0) {
+    OutboundSlot &slot = outbound_slot(0);
+    // Always allow one event per flush so a large one cannot stall the queue.
+    if (slot.len > budget &&
+        budget != CONFIG_EVENTS_OUTBOUND_MAX_BYTES_PER_FLUSH) {
+      break;
+    }
+    if (s_outbound_sender(slot.data, slot.len) < 0) {
+      // The send buffer is full, retry on the next loop iteration.
+      s_outbound_stats.deferred++;
+      break;
+    }
+    budget -= std::min<size_t>(budget, slot.len);
+    s_outbound_head = (s_outbound_head + 1) % std::size(s_outbound);
+    s_outbound_count--;
+    s_outbound_stats.sent++;
+  }
+  outbound_unlock();
+}
+
+bool oai_events_pending() { return s_outbound_count > 0; }
+
+OaiOutboundStats oai_events_outbound_stats() {
+  outbound_lock();
+  OaiOutboundStats stats = s_outbound_stats;
+  stats.depth = s_outbound_count;
+  outbound_unlock();
+  return stats;
+}
+
+bool oai_send_session_update(std::string_view instructions) {
+  char buf[CONFIG_EVENTS_OUTBOUND_SLOT_SIZE];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object()
+      .member("type", "session.update")
+      .key("session")
+      .begin_object()
+      .member("instructions", instructions)
+      .end_object()
+      .end_object();
+  return w.ok() && oai_event_enqueue(OaiOutboundKind::kSessionUpdate, w.view());
+}
+
+bool oai_send_input_transcription(std::string_view model) {
+  char buf[CONFIG_EVENTS_OUTBOUND_SLOT_SIZE];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object()
+      .member("type", "session.update")
+      .key("session")
+      .begin_object()
+      .key("input_audio_transcription")
+      .begin_object()
+      .member("model", model)
+      .end_object()
+      .end_object()
+      .end_object();
+  return w.ok() && oai_event_enqueue(OaiOutboundKind::kSessionUpdate, w.view());
+}
+
+bool oai_send_response_create(std::string_view instructions) {
+  char buf[CONFIG_EVENTS_OUTBOUND_SLOT_SIZE];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object()
+      .member("type", "response.create")
+      .key("response")
+      .begin_object()
+      .key("modalities")
+      .begin_array()
+      .string("audio")
+      .string("text")
+      .end_array();
+  if (!instructions.empty()) {
+    w.member("instructions", instructions);
+  }
+  w.end_object().end_object();
+  return w.ok() &&
+         oai_event_enqueue(OaiOutboundKind::kResponseCreate, w.view());
+}
+
+namespace {
+
+bool send_message_item(std::string_view role, std::string_view content_type,
+                       std::string_view text) {
+  char buf[CONFIG_EVENTS_OUTBOUND_SLOT_SIZE];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object()
+      .member("type", "conversation.item.create")
+      .key("item")
+      .begin_object()
+      .member("type", "message")
+      .member("role", role)
+      .key("content")
+      .begin_array()
+      .begin_object()
+      .member("type", content_type)
+      .member("text", text)
+      .end_object()
+      .end_array()
+      .end_object()
+      .end_object();
+  return w.ok() &&
+         oai_event_enqueue(OaiOutboundKind::kConversationItem, w.view());
+}
+
+}  // namespace
+
+bool oai_send_conversation_item_text(std::string_view text) {
+  return send_message_item("user", "input_text", text);
+}
+
+bool oai_send_assistant_message(std::string_view text) {
+  return send_message_item("assistant", "text", text);
+}
+
+bool oai_send_function_call_output(std::string_view call_id,
+                                   std::string_view output) {
+  char buf[CONFIG_EVENTS_OUTBOUND_SLOT_SIZE];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object()
+      .member("type", "conversation.item.create")
+      .key("item")
+      .begin_object()
+      .member("type", "function_call_output")
+      .member("call_id", call_id)
+      .member("output", output)
+      .end_object()
+      .end_object();
+  return w.ok() &&
+         oai_event_enqueue(OaiOutboundKind::kConversationItem, w.view());
+}
+
+#ifdef CONFIG_EVENTS_BENCHMARK
+namespace {
+
+constexpr const char *kSampleEvents[] = {
+    R"({"type":"response.audio_transcript.delta","event_id":"event_4950","response_id":"resp_001","item_id":"msg_008","output_index":0,"content_index":0,"delta":"Hello, how can I \"help\" you today?"})",
+    R"({"type":"input_audio_buffer.speech_started","event_id":"event_1516","audio_start_ms":1000,"item_id":"msg_003"})",
+    R"({"type":"rate_limits.updated","event_id":"event_5758","rate_limits":[{"name":"requests","limit":1000,"remaining":999,"reset_seconds":60},{"name":"tokens","limit":50000,"remaining":49950,"reset_seconds":60}]})",
+    R"({"type":"response.function_call_arguments.done","event_id":"event_5354","response_id":"resp_002","item_id":"fc_001","output_index":0,"call_id":"call_001","name":"get_weather","arguments":"{\"location\": \"San Francisco\"}"})",
+    R"({"type":"response.done","event_id":"event_3132","response":{"id":"resp_001","object":"realtime.response","status":"completed","status_details":null,"output":[{"id":"msg_006","object":"realtime.item","type":"message","status":"completed","role":"assistant","content":[{"type":"audio","transcript":"Sure, how can I assist you today?"}]}],"usage":{"total_tokens":275,"input_tokens":127,"output_tokens":148,"input_token_details":{"cached_tokens":0,"text_tokens":119,"audio_tokens":8},"output_token_details":{"text_tokens":36,"audio_tokens":112}}}})",
+};
+
+// Heap accounting for cJSON. Each block carries its size in a header.
+size_t s_bench_current;
+size_t s_bench_peak;
+size_t s_bench_allocations;
+
+void *bench_malloc(size_t size) {
+  size_t *block = (size_t *)malloc(size + sizeof(size_t));
+  if (block == nullptr) {
+    return nullptr;
+  }
+  *block = size;
+  s_bench_current += size;
+  s_bench_peak = std::max(s_bench_peak, s_bench_current);
+  s_bench_allocations++;
+  return block + 1;
+}
+
+void bench_free(void *ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  size_t *block = (size_t *)ptr - 1;
+  s_bench_current -= *block;
+  free(block);
+}
+
+volatile size_t s_bench_sink;
+
+}  // namespace
+
+void oai_events_benchmark() {
+  constexpr int iterations = CONFIG_EVENTS_BENCHMARK_ITERATIONS;
+  constexpr size_t event_count = std::size(kSampleEvents);
+  size_t lengths[event_count];
+  size_t total_bytes = 0;
+  for (size_t i = 0; i < event_count; i++) {
+    lengths[i] = strlen(kSampleEvents[i]);
+    total_bytes += lengths[i];
+  }
+
+  // Same work for both: find the type and read one string member.
+  size_t sink = 0;
+#ifdef CONFIG_ALLOC_TRACK
+  oai_alloc_track_count_begin();
+#endif
+  int64_t start = esp_timer_get_time();
+  for (int n = 0; n < iterations; n++) {
+    for (size_t i = 0; i < event_count; i++) {
+      JsonValue event =
+          oai_json_parse(std::string_view(kSampleEvents[i], lengths[i]));
+      sink += event["type"].str().size() + event["event_id"].raw.size();
+    }
+  }
+  int64_t stream_us = esp_timer_get_time() - start;
+#ifdef CONFIG_ALLOC_TRACK
+  uint32_t stream_allocations = oai_alloc_track_count_end();
+#endif
+
+  cJSON_Hooks hooks = {bench_malloc, bench_free};
+  cJSON_InitHooks(&hooks);
+  s_bench_current = s_bench_peak = s_bench_allocations = 0;
+  start = esp_timer_get_time();
+  for (int n = 0; n < iterations; n++) {
+    for (size_t i = 0; i < event_count; i++) {
+      cJSON *event = cJSON_ParseWithLength(kSampleEvents[i], lengths[i]);
+      const char *type =
+          cJSON_GetStringValue(cJSON_GetObjectItem(event, "type"));
+      const char *id =
+          cJSON_GetStringValue(cJSON_GetObjectItem(event, "event_id"));
+      sink += (type ? strlen(type) : 0) + (id ? strlen(id) : 0);
+      cJSON_Delete(event);
+    }
+  }
+  int64_t cjson_us = esp_timer_get_time() - start;
+  cJSON_InitHooks(nullptr);
+  s_bench_sink = sink;
+
+  const int64_t events = (int64_t)iterations * event_count;
+  const int64_t kbytes = (int64_t)iterations * total_bytes / 1024;
+  stream_us = std::max<int64_t>(stream_us, 1);
+  cjson_us = std::max<int64_t>(cjson_us, 1);
+#ifdef CONFIG_ALLOC_TRACK
+  ESP_LOGI(TAG,
+           "json_stream: %lld events in %lld us | %lld ns/event | %lld KB/s "
+           "| %lld allocations/event (%lu in total)",
+           (long long)events, (long long)stream_us,
+           (long long)(stream_us * 1000 / events),
+           (long long)(kbytes * 1000000 / stream_us),
+           (long long)(stream_allocations / events),
+           (unsigned long)stream_allocations);
+#else
+  // Counting needs the allocator hooks of CONFIG_ALLOC_TRACK.
+  ESP_LOGI(TAG,
+           "json_stream: %lld events in %lld us | %lld ns/event | %lld KB/s "
+           "| allocations not counted without CONFIG_ALLOC_TRACK",
+           (long long)events, (long long)stream_us,
+           (long long)(stream_us * 1000 / events),
+           (long long)(kbytes * 1000000 / stream_us));
+#endif  // CONFIG_ALLOC_TRACK
+  ESP_LOGI(TAG,
+           "cJSON      : %lld events in %lld us | %lld ns/event | %lld KB/s "
+           "| %lld allocations/event | peak %u bytes",
+           (long long)events, (long long)cjson_us,
+           (long long)(cjson_us * 1000 / events),
+           (long long)(kbytes * 1000000 / cjson_us),
+           (long long)(s_bench_allocations / events), (unsigned)s_bench_peak);
+}
+#endif  // CONFIG_EVENTS_BENCHMARK
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "json_stream.h"
+
+// Dispatches a message received on the oai-events data channel to the
+// handler registered for its "type". Handlers get views into msg, which must
+// stay valid for the duration of the call.
+void oai_event_dispatch(const char *msg, size_t len);
+
+// Kind of an outbound event. A pending response.create is replaced by a newer
+// one if it is the last event in the queue.
+enum class OaiOutboundKind : uint8_t {
+  kSessionUpdate,
+  kResponseCreate,
+  kConversationItem,
+};
+
+struct OaiOutboundStats {
+  uint32_t queued;
+  uint32_t sent;
+  uint32_t coalesced;
+  uint32_t dropped;
+  uint32_t deferred;
+  uint32_t depth;
+  uint32_t high_water;
+};
+
+// Creates the outbound event queue, called once before the peer loop starts.
+void oai_events_init();
+
+// Queues a serialized client event for the data channel. Safe to call from
+// any task. Returns false if the event was dropped.
+bool oai_event_enqueue(OaiOutboundKind kind, std::string_view json);
+
+// Typed builders for the realtime client events. The event is written into
+// a stack buffer and queued.
+bool oai_send_session_update(std::string_view instructions);
+bool oai_send_response_create(std::string_view instructions);
+bool oai_send_conversation_item_text(std::string_view text);
+// Adds something the assistant said outside of a response, such as a
+// greeting played from the cache, to the conversation.
+bool oai_send_assistant_message(std::string_view text);
+bool oai_send_function_call_output(std::string_view call_id,
+                                   std::string_view output);
+// Turns on transcription of the input audio with the given model.
+bool oai_send_input_transcription(std::string_view model);
+
+// Sends one serialized event over the transport, the data channel or the
+// WebSocket. Returns a negative value if the transport cannot take it yet.
+using OaiEventSender = int (*)(const char *data, size_t len);
+
+// Sets the transport the queue is flushed to. nullptr detaches it and
+// discards pending events.
+void oai_events_attach(OaiEventSender sender);
+// Sends pending events, called from the peer loop. Stops early when the
+// transport refuses an event or the per-call byte budget is used up.
+void oai_events_flush();
+// True while events are queued, e.g. after the transport refused one.
+bool oai_events_pending();
+OaiOutboundStats oai_events_outbound_stats();
+
+#ifdef CONFIG_EVENTS_BENCHMARK
+// Compares the event reader against cJSON on a set of sample events and logs
+// the throughput and heap usage of both.
+void oai_events_benchmark();
+#endif  // CONFIG_EVENTS_BENCHMARK
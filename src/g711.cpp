@@ -0,0 +1,98 @@
+#include "g711.h"
+
+#include <algorithm>
+#include <array>
+
+namespace {
+
+constexpr int kUlawBias = 0x84;
+constexpr int kUlawClip = 32635;
+
+constexpr int16_t ulaw_to_linear(uint8_t code) {
+  code = ~code;
+  int t = (((code & 0x0f) << 3) + kUlawBias) << ((code & 0x70) >> 4);
+  return (code & 0x80) ? kUlawBias - t : t - kUlawBias;
+}
+
+constexpr int16_t alaw_to_linear(uint8_t code) {
+  code ^= 0x55;
+  int t = (code & 0x0f) << 4;
+  int segment = (code & 0x70) >> 4;
+  if (segment == 0) {
+    t += 8;
+  } else {
+    t = (t + 0x108) << (segment - 1);
+  }
+  return (code & 0x80) ? t : -t;
+}
+
+template <int16_t (*F)(uint8_t)>
+constexpr std::array<int16_t, 256> make_table() {
+  std::array<int16_t, 256> table = {};
+  for (int i = 0; i < 256; i++) {
+    table[i] = F(i);
+  }
+  return table;
+}
+
+constexpr std::array<int16_t, 256> kUlawTable = make_table<ulaw_to_linear>();
+constexpr std::array<int16_t, 256> kAlawTable = make_table<alaw_to_linear>();
+
+// Index of the highest set bit, value must not be zero.
+inline int highest_bit(uint32_t value) { return 31 - __builtin_clz(value); }
+
+inline uint8_t linear_to_ulaw(int pcm) {
+  // 14-bit magnitude as in the reference implementation.
+  pcm >>= 2;
+  uint8_t mask = 0xff;
+  if (pcm < 0) {
+    mask = 0x7f;
+    pcm = -pcm;
+  }
+  pcm = std::min(pcm, kUlawClip >> 2) + (kUlawBias >> 2);
+  // The bias keeps bit 5 set, the segment is the bit above it.
+  int segment = pcm < 0x40 ? 0 : highest_bit(pcm) - 5;
+  int mantissa = (pcm >> (segment + 1)) & 0x0f;
+  return ((segment << 4) | mantissa) ^ mask;
+}
+
+inline uint8_t linear_to_alaw(int pcm) {
+  pcm >>= 3;
+  uint8_t mask = 0xd5;
+  if (pcm < 0) {
+    mask = 0x55;
+    pcm = -pcm - 1;
+  }
+  int segment = pcm < 0x20 ? 0 : highest_bit(pcm) - 4;
+  if (segment >= 8) {
+    return 0x7f ^ mask;
+  }
+  int mantissa = (pcm >> (segment < 2 ? 1 : segment)) & 0x0f;
+  return ((segment << 4) | mantissa) ^ mask;
+}
+
+}  // namespace
+
+void oai_g711_ulaw_encode(const int16_t *pcm, size_t count, uint8_t *codes) {
+  for (size_t i = 0; i < count; i++) {
+    codes[i] = linear_to_ulaw(pcm[i]);
+  }
+}
+
+void oai_g711_ulaw_decode(const uint8_t *codes, size_t count, int16_t *pcm) {
+  for (size_t i = 0; i < count; i++) {
+    pcm[i] = kUlawTable[codes[i]];
+  }
+}
+
+void oai_g711_alaw_encode(const int16_t *pcm, size_t count, uint8_t *codes) {
+  for (size_t i = 0; i < count; i++) {
+    codes[i] = linear_to_alaw(pcm[i]);
+  }
+}
+
+void oai_g711_alaw_decode(const uint8_t *codes, size_t count, int16_t *pcm) {
+  for (size_t i = 0; i < count; i++) {
+    pcm[i] = kAlawTable[codes[i]];
+  }
+}
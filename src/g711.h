@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// G.711 companding (ITU-T G.711) between 16-bit PCM and 8-bit codes at
+// 8 kHz. Decoding is a table lookup, encoding finds the segment with a count
+// of leading zeros.
+
+void oai_g711_ulaw_encode(const int16_t *pcm, size_t count, uint8_t *codes);
+void oai_g711_ulaw_decode(const uint8_t *codes, size_t count, int16_t *pcm);
+void oai_g711_alaw_encode(const int16_t *pcm, size_t count, uint8_t *codes);
+void oai_g711_alaw_decode(const uint8_t *codes, size_t count, int16_t *pcm);
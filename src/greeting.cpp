@@ -0,0 +1,311 @@
+#include "greeting.h"
+
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "codec.h"
+#include "main.h"
+#include "mem.h"
+
+constexpr const char *TAG = "greeting";
+
+namespace {
+
+constexpr uint32_t kMagic = 0x5452474f;  // "OGRT"
+constexpr uint16_t kVersion = 2;
+// Decoded ahead of the playback position, so that a late peer loop
+// iteration does not underrun the speaker.
+constexpr int64_t kLeadUs = 60000;
+
+struct Header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t packets;
+  // Bytes of packets after the header, each a little-endian uint16_t length
+  // followed by the Opus packet.
+  uint32_t bytes;
+  uint32_t prompt_hash;
+  uint32_t crc;
+  char transcript[GREETING_TRANSCRIPT_SIZE];
+};
+
+const esp_partition_t *s_partition = nullptr;
+esp_partition_mmap_handle_t s_map_handle;
+// Held while the mapping is read or replaced: the writer task unmaps the
+// partition to erase it while a reconnected session may be checking or
+// playing the previous recording.
+SemaphoreHandle_t s_map_lock = nullptr;
+StaticSemaphore_t s_map_lock_buffer;
+const uint8_t *s_map = nullptr;
+// Bumped on every unmap, so that a playback of the old mapping stops.
+uint32_t s_map_generation = 0;
+
+// Playback, only touched by the peer loop.
+const uint8_t *s_play_pos = nullptr;
+const uint8_t *s_play_end = nullptr;
+uint32_t s_play_generation = 0;
+int64_t s_play_due_us = 0;
+
+// Recording, only touched by the peer loop until handed to the writer.
+uint8_t *s_capture = nullptr;
+size_t s_capture_len = 0;
+uint16_t s_capture_packets = 0;
+uint32_t s_capture_hash = 0;
+char s_capture_transcript[GREETING_TRANSCRIPT_SIZE];
+bool s_capturing = false;
+std::atomic<bool> s_writing{false};
+
+uint32_t hash(const char *prompt) {
+  // FNV-1a.
+  uint32_t h = 2166136261u;
+  for (; *prompt != '\0'; prompt++) {
+    h = (h ^ (uint8_t)*prompt) * 16777619u;
+  }
+  return h;
+}
+
+void map_partition() {
+  const void *data = nullptr;
+  if (esp_err_t err =
+          esp_partition_mmap(s_partition, 0, s_partition->size,
+                             ESP_PARTITION_MMAP_DATA, &data, &s_map_handle);
+      err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to map the partition: %s", esp_err_to_name(err));
+    return;
+  }
+  s_map = (const uint8_t *)data;
+}
+
+// Called with s_map_lock held.
+const Header *valid_header(const char *prompt) {
+  if (s_map == nullptr) {
+    return nullptr;
+  }
+  const Header *header = (const Header *)s_map;
+  if (header->magic != kMagic || header->version != kVersion ||
+      header->bytes > s_partition->size - sizeof(Header) ||
+      header->prompt_hash != hash(prompt)) {
+    return nullptr;
+  }
+  return header;
+}
+
+void free_capture() {
+  oai_mem_free(s_capture);
+  s_capture = nullptr;
+  s_capturing = false;
+}
+
+// Erasing takes tens of milliseconds per sector, too long for the peer loop.
+void write_task(void *arg) {
+  Header header = {kMagic,
+                   kVersion,
+                   s_capture_packets,
+                   (uint32_t)s_capture_len,
+                   s_capture_hash,
+                   esp_rom_crc32_le(0, s_capture, s_capture_len)};
+  memcpy(header.transcript, s_capture_transcript, sizeof(header.transcript));
+  size_t erase_size = (sizeof(header) + s_capture_len +
+                       s_partition->erase_size - 1) /
+                      s_partition->erase_size * s_partition->erase_size;
+
+  xSemaphoreTake(s_map_lock, portMAX_DELAY);
+  if (s_map != nullptr) {
+    s_map = nullptr;
+    s_map_generation++;
+    esp_partition_munmap(s_map_handle);
+  }
+  xSemaphoreGive(s_map_lock);
+  // The header goes last, so an interrupted write leaves no valid header.
+  esp_err_t err = esp_partition_erase_range(s_partition, 0, erase_size);
+  if (err == ESP_OK) {
+    err = esp_partition_write(s_partition, sizeof(header), s_capture,
+                              s_capture_len);
+  }
+  if (err == ESP_OK) {
+    err = esp_partition_write(s_partition, 0, &header, sizeof(header));
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to store the greeting: %s", esp_err_to_name(err));
+  } else {
+    ESP_LOGI(TAG, "Stored the greeting, %u packets, %u bytes",
+             (unsigned)s_capture_packets, (unsigned)s_capture_len);
+  }
+  xSemaphoreTake(s_map_lock, portMAX_DELAY);
+  map_partition();
+  xSemaphoreGive(s_map_lock);
+
+  free_capture();
+  s_writing = false;
+  vTaskDelete(nullptr);
+}
+
+}  // namespace
+
+void oai_greeting_init() {
+  s_map_lock = xSemaphoreCreateMutexStatic(&s_map_lock_buffer);
+  s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                         ESP_PARTITION_SUBTYPE_ANY, "greeting");
+  if (s_partition == nullptr) {
+    ESP_LOGW(TAG, "No greeting partition, the greeting is not cached");
+    return;
+  }
+  map_partition();
+}
+
+bool oai_greeting_cached(const char *prompt) {
+  xSemaphoreTake(s_map_lock, portMAX_DELAY);
+  const Header *header = valid_header(prompt);
+  // Checked once per session, the greeting is only a few kilobytes.
+  bool valid = header != nullptr &&
+               esp_rom_crc32_le(0, (const uint8_t *)(header + 1),
+                                header->bytes) == header->crc;
+  if (header != nullptr && !valid) {
+    ESP_LOGW(TAG, "Stored greeting is corrupted");
+  }
+  xSemaphoreGive(s_map_lock);
+  return valid;
+}
+
+bool oai_greeting_transcript(const char *prompt, char *dst) {
+  xSemaphoreTake(s_map_lock, portMAX_DELAY);
+  const Header *header = valid_header(prompt);
+  if (header != nullptr) {
+    size_t len = strnlen(header->transcript, sizeof(header->transcript) - 1);
+    memcpy(dst, header->transcript, len);
+    dst[len] = '\0';
+  }
+  xSemaphoreGive(s_map_lock);
+  return header != nullptr;
+}
+
+void oai_greeting_play() {
+  xSemaphoreTake(s_map_lock, portMAX_DELAY);
+  if (s_map != nullptr && !s_writing) {
+    const Header *header = (const Header *)s_map;
+    s_play_pos = (const uint8_t *)(header + 1);
+    s_play_end = s_play_pos + header->bytes;
+    s_play_generation = s_map_generation;
+    s_play_due_us = esp_timer_get_time();
+  }
+  xSemaphoreGive(s_map_lock);
+}
+
+int oai_greeting_poll() {
+  if (s_play_pos == nullptr) {
+    return 0;
+  }
+  xSemaphoreTake(s_map_lock, portMAX_DELAY);
+  if (s_map == nullptr || s_map_generation != s_play_generation) {
+    s_play_pos = nullptr;
+  }
+  int64_t now = esp_timer_get_time();
+  int played = 0;
+  while (s_play_pos != nullptr && s_play_due_us < now + kLeadUs) {
+    uint16_t len;
+    if (s_play_end - s_play_pos < (ptrdiff_t)sizeof(len)) {
+      s_play_pos = nullptr;
+      break;
+    }
+    memcpy(&len, s_play_pos, sizeof(len));
+    const uint8_t *packet = s_play_pos + sizeof(len);
+    if (len == 0 || s_play_end - packet < len) {
+      s_play_pos = nullptr;
+      break;
+    }
+    s_play_pos = packet + len;
+
+    int samples = opus_packet_get_nb_samples(packet, len, SAMPLE_RATE);
+    oai_audio_decode((uint8_t *)packet, len);
+    s_play_due_us += (samples > 0 ? samples : 0) * 1000000LL / SAMPLE_RATE;
+    played++;
+  }
+  xSemaphoreGive(s_map_lock);
+  return played;
+}
+
+int64_t oai_greeting_due_us() {
+  return s_play_pos != nullptr ? s_play_due_us - kLeadUs : 0;
+}
+
+void oai_greeting_stop() {
+  s_play_pos = nullptr;
+  if (s_capturing) {
+    ESP_LOGW(TAG, "Session ended before the greeting was recorded");
+    free_capture();
+  }
+}
+
+void oai_greeting_capture_begin(const char *prompt) {
+  if (s_partition == nullptr || s_capturing || s_writing) {
+    return;
+  }
+  s_capture = (uint8_t *)oai_mem_alloc(CONFIG_GREETING_MAX_BYTES,
+                                       OaiMemPlacement::kCold);
+  if (s_capture == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate the greeting recording buffer");
+    return;
+  }
+  s_capture_len = 0;
+  s_capture_packets = 0;
+  s_capture_hash = hash(prompt);
+  s_capture_transcript[0] = '\0';
+  s_capturing = true;
+}
+
+void oai_greeting_capture_packet(const uint8_t *data, size_t size) {
+  if (!s_capturing) {
+    return;
+  }
+  uint16_t len = size;
+  size_t limit = std::min<size_t>(CONFIG_GREETING_MAX_BYTES,
+                                  s_partition->size - sizeof(Header));
+  if (size > UINT16_MAX || s_capture_len + sizeof(len) + size > limit) {
+    ESP_LOGW(TAG, "Greeting too long to record");
+    free_capture();
+    return;
+  }
+  memcpy(s_capture + s_capture_len, &len, sizeof(len));
+  memcpy(s_capture + s_capture_len + sizeof(len), data, size);
+  s_capture_len += sizeof(len) + size;
+  s_capture_packets++;
+}
+
+void oai_greeting_capture_transcript(const JsonValue &transcript) {
+  // Only the first response is the greeting.
+  if (!s_capturing || s_capture_transcript[0] != '\0') {
+    return;
+  }
+  if (oai_json_unescape(transcript, s_capture_transcript,
+                        sizeof(s_capture_transcript)) <= 0) {
+    ESP_LOGW(TAG, "Greeting transcript missing or too long to record");
+    free_capture();
+  }
+}
+
+void oai_greeting_capture_end() {
+  if (!s_capturing) {
+    return;
+  }
+  s_capturing = false;
+  if (s_capture_packets == 0 || s_capture_transcript[0] == '\0') {
+    free_capture();
+    return;
+  }
+  s_writing = true;
+  if (xTaskCreate(write_task, "greeting_write", 3072, nullptr,
+                  tskIDLE_PRIORITY + 1, nullptr) != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create the greeting writer");
+    free_capture();
+    s_writing = false;
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "json_stream.h"
+
+// Longest greeting transcript that is stored, including the NUL.
+#define GREETING_TRANSCRIPT_SIZE 128
+
+// Greeting cache.
+//
+// The first session records the downlink Opus packets of the greeting
+// response into the "greeting" flash partition. Later sessions play them
+// straight from flash as soon as the peer connection is up, instead of
+// asking the model for the greeting and waiting for a round trip plus
+// inference. The transcript is stored with the audio, so that the session
+// can add the greeting to the conversation as an assistant message and the
+// model does not greet again. The recording is tied to the greeting prompt
+// and is recorded again whenever the prompt changes or the partition is
+// erased.
+
+// Maps the partition, called once at startup.
+void oai_greeting_init();
+// True if a recording for prompt is stored.
+bool oai_greeting_cached(const char *prompt);
+// Copies the transcript of the recording for prompt into dst, which holds
+// GREETING_TRANSCRIPT_SIZE bytes. False if there is no recording.
+bool oai_greeting_transcript(const char *prompt, char *dst);
+
+// Starts playing the recording, called when the session is connected.
+void oai_greeting_play();
+// Decodes the packets that are due, called from the peer loop. Returns the
+// number of packets played.
+int oai_greeting_poll();
+// esp_timer time at which oai_greeting_poll() has the next packet to play,
+// 0 when nothing is playing.
+int64_t oai_greeting_due_us();
+// Stops the playback and drops an unfinished recording, called at teardown.
+void oai_greeting_stop();
+
+// Records the inbound audio packets from now until
+// oai_greeting_capture_end, then stores them for prompt.
+void oai_greeting_capture_begin(const char *prompt);
+void oai_greeting_capture_packet(const uint8_t *data, size_t size);
+// Called on response.audio_transcript.done. A recording without a
+// transcript is not stored.
+void oai_greeting_capture_transcript(const JsonValue &transcript);
+// Called on output_audio_buffer.stopped, once the last audio of the
+// greeting has been sent.
+void oai_greeting_capture_end();
@@ -1,17 +1,31 @@
 #include <esp_http_client.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
 #include <string.h>
-#include <string>
-#include <vector>
 
 #include "main.h"
+#include "settings.h"
+
+#ifdef CONFIG_DNS_CACHE
+#include <arpa/inet.h>
+
+#include "dns.h"
+#endif
 
 #ifndef MIN
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
+// Response buffer of one request. Kept per request so that several sessions
+// can signal at the same time.
+struct OaiHttpResponse {
+  char *buffer;
+  int len;
+};
+
 esp_err_t oai_http_event_handler(esp_http_client_event_t *evt) {
-  static int output_len;
+  OaiHttpResponse *response = (OaiHttpResponse *)evt->user_data;
   switch (evt->event_id) {
     case HTTP_EVENT_REDIRECT:
       ESP_LOGD(LOG_TAG, "HTTP_EVENT_REDIRECT");
@@ -36,85 +50,198 @@ esp_err_t oai_http_event_handler(esp_http_client_event_t *evt) {
       ESP_LOGD(LOG_TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
       if (esp_http_client_is_chunked_response(evt->client)) {
         ESP_LOGE(LOG_TAG, "Chunked HTTP response not supported");
-#ifndef LINUX_BUILD
-        esp_restart();
-#endif
+        return ESP_FAIL;
       }
 
-      if (output_len == 0 && evt->user_data) {
-        memset(evt->user_data, 0, MAX_HTTP_OUTPUT_BUFFER);
+      if (response == nullptr) {
+        break;
+      }
+      if (response->len == 0) {
+        memset(response->buffer, 0, MAX_HTTP_OUTPUT_BUFFER);
       }
 
-      // If user_data buffer is configured, copy the response into the buffer
-      int copy_len = 0;
-      if (evt->user_data) {
-        // The last byte in evt->user_data is kept for the NULL character in
-        // case of out-of-bound access.
-        copy_len = MIN(evt->data_len, (MAX_HTTP_OUTPUT_BUFFER - output_len));
-        if (copy_len) {
-          memcpy(((char *)evt->user_data) + output_len, evt->data, copy_len);
-        }
+      // The last byte of the buffer is kept for the NULL character in case of
+      // out-of-bound access.
+      int copy_len =
+          MIN(evt->data_len, (MAX_HTTP_OUTPUT_BUFFER - response->len));
+      if (copy_len) {
+        memcpy(response->buffer + response->len, evt->data, copy_len);
       }
-      output_len += copy_len;
+      response->len += copy_len;
 
       break;
     }
     case HTTP_EVENT_ON_FINISH:
       ESP_LOGD(LOG_TAG, "HTTP_EVENT_ON_FINISH");
-      output_len = 0;
+      if (response != nullptr) {
+        response->len = 0;
+      }
       break;
     case HTTP_EVENT_DISCONNECTED:
       ESP_LOGI(LOG_TAG, "HTTP_EVENT_DISCONNECTED");
-      output_len = 0;
+      if (response != nullptr) {
+        response->len = 0;
+      }
       break;
   }
   return ESP_OK;
 }
 
-void oai_http_request(char *offer, char *answer) {
-  esp_http_client_config_t config;
-  memset(&config, 0, sizeof(esp_http_client_config_t));
+// The strings of one request live on the caller's stack, so that reconnects
+// do not touch the heap.
+constexpr size_t kMaxUriSize = sizeof(OaiSettings::api_uri);
+
+static void oai_api_uri(char *uri) {
+  OaiSettings settings;
+  oai_settings_get(&settings);
+  strcpy(uri, settings.api_uri);
+}
 
-  extern esp_err_t oai_get_api_uri(std::string& api_uri);
-  std::string api_uri;
-  if( auto err = oai_get_api_uri(api_uri); err != ESP_OK ) {
-    api_uri = CONFIG_OPENAI_REALTIMEAPI;
+#ifdef CONFIG_DNS_CACHE
+// Finds the host of scheme://host[:port]/path. host_end is where the port or
+// path starts.
+static bool oai_find_host(const char *uri, size_t *host_begin,
+                          size_t *host_end) {
+  const char *scheme_end = strstr(uri, "://");
+  if (scheme_end == nullptr) {
+    return false;
   }
-  config.url = api_uri.c_str();
-  ESP_LOGI(LOG_TAG, "Using API URI: %s", config.url);
-  
-  config.event_handler = oai_http_event_handler;
-  config.user_data = answer;
+  size_t begin = scheme_end - uri + 3;
+  size_t end = begin + strcspn(uri + begin, ":/?");
+  *host_begin = begin;
+  *host_end = end;
+  return end > begin;
+}
 
-#ifdef CONFIG_USE_WIFI_PROVISIONING_SOFTAP
-  extern esp_err_t oai_get_api_key(std::vector<char>& api_key);
-  std::vector<char> api_key;
-  if( auto err = oai_get_api_key(api_key); err != ESP_OK ) {
-    ESP_LOGE(LOG_TAG, "API key not set");
-  } else {
-    ESP_LOGI(LOG_TAG, "Using API key: %s", api_key.data());
-    snprintf(answer, MAX_HTTP_OUTPUT_BUFFER, "Bearer %s", api_key.data());
+// Copies uri[begin, end) into out, which holds kMaxUriSize bytes.
+static void oai_copy_range(const char *uri, size_t begin, size_t end,
+                           char *out) {
+  size_t len = MIN(end - begin, kMaxUriSize - 1);
+  memcpy(out, uri + begin, len);
+  out[len] = '\0';
+}
+
+void oai_http_prefetch() {
+  char uri[kMaxUriSize];
+  oai_api_uri(uri);
+  size_t begin, end;
+  if (oai_find_host(uri, &begin, &end)) {
+    char host[kMaxUriSize];
+    oai_copy_range(uri, begin, end, host);
+    oai_dns_prefetch(host);
   }
-#else // CONFIG_USE_WIFI_PROVISIONING_SOFTAP
-  snprintf(answer, MAX_HTTP_OUTPUT_BUFFER, "Bearer %s", CONFIG_OPENAI_API_KEY);
-#endif
+}
+#endif  // CONFIG_DNS_CACHE
+
+// Posts the offer to url and stores the answer. With host set, url points at
+// an address, the certificate and SNI use host instead and the Host header
+// uses authority, which keeps an explicit port.
+static esp_err_t oai_http_post(const char *url, const char *host,
+                               const char *authority,
+                               const char *authorization, char *offer,
+                               char *answer) {
+  esp_http_client_config_t config;
+  memset(&config, 0, sizeof(esp_http_client_config_t));
+  config.url = url;
+  config.common_name = host;
+
+  OaiHttpResponse response = {answer, 0};
+  config.event_handler = oai_http_event_handler;
+  config.user_data = &response;
 
+  esp_err_t ret = ESP_FAIL;
   if( esp_http_client_handle_t client = esp_http_client_init(&config); client == nullptr ) {
     ESP_LOGE(LOG_TAG, "Failed to initialize HTTP client");
   } else {
     esp_http_client_set_method(client, HTTP_METHOD_POST);
+    if (authority != nullptr) {
+      esp_http_client_set_header(client, "Host", authority);
+    }
     esp_http_client_set_header(client, "Content-Type", "application/sdp");
-    esp_http_client_set_header(client, "Authorization", answer);
+    esp_http_client_set_header(client, "Authorization", authorization);
     esp_http_client_set_post_field(client, offer, strlen(offer));
 
-    esp_err_t err = esp_http_client_perform(client);
-    if (err != ESP_OK || esp_http_client_get_status_code(client) != 201) {
-      ESP_LOGE(LOG_TAG, "Error perform http request %s", esp_err_to_name(err));
-  #if !defined(LINUX_BUILD) && defined(CONFIG_DISABLE_CONFIGURATOR_AFTER_PROVISIONED)
-      esp_restart();
-  #endif
+    ret = esp_http_client_perform(client);
+    if (ret != ESP_OK) {
+      ESP_LOGE(LOG_TAG, "Error perform http request %s", esp_err_to_name(ret));
+    } else if (esp_http_client_get_status_code(client) != 201 ||
+               esp_http_client_is_chunked_response(client)) {
+      ESP_LOGE(LOG_TAG, "Unexpected http response %d",
+               esp_http_client_get_status_code(client));
+      ret = ESP_ERR_INVALID_RESPONSE;
     }
 
     esp_http_client_cleanup(client);
   }
+  return ret;
+}
+
+void oai_http_authorization(char *authorization, size_t size) {
+  constexpr size_t kBearerLen = sizeof("Bearer ") - 1;
+  strcpy(authorization, "Bearer ");
+#ifdef CONFIG_USE_WIFI_PROVISIONING_SOFTAP
+  extern esp_err_t oai_get_api_key(char *api_key, size_t size);
+  char *api_key = authorization + kBearerLen;
+  if( auto err = oai_get_api_key(api_key, size - kBearerLen);
+      err != ESP_OK ) {
+    ESP_LOGE(LOG_TAG, "API key not set");
+    api_key[0] = '\0';
+  } else {
+    ESP_LOGI(LOG_TAG, "Using API key: %s", api_key);
+  }
+#else // CONFIG_USE_WIFI_PROVISIONING_SOFTAP
+  static_assert(sizeof(CONFIG_OPENAI_API_KEY) <=
+                    MAX_AUTHORIZATION_SIZE - kBearerLen,
+                "CONFIG_OPENAI_API_KEY is too long");
+  snprintf(authorization + kBearerLen, size - kBearerLen, "%s",
+           CONFIG_OPENAI_API_KEY);
+#endif
+}
+
+esp_err_t oai_http_request(char *offer, char *answer) {
+  char api_uri[kMaxUriSize];
+  oai_api_uri(api_uri);
+  ESP_LOGI(LOG_TAG, "Using API URI: %s", api_uri);
+
+  char authorization[MAX_AUTHORIZATION_SIZE];
+  oai_http_authorization(authorization, sizeof(authorization));
+
+  int64_t start = esp_timer_get_time();
+#ifdef CONFIG_DNS_CACHE
+  size_t host_begin, host_end;
+  char addr[INET_ADDRSTRLEN];
+  if (oai_find_host(api_uri, &host_begin, &host_end)) {
+    char host[kMaxUriSize];
+    oai_copy_range(api_uri, host_begin, host_end, host);
+    char url[kMaxUriSize];
+    if (oai_dns_lookup(host, addr, sizeof(addr)) &&
+        snprintf(url, sizeof(url), "%.*s%s%s", (int)host_begin, api_uri, addr,
+                 api_uri + host_end) < (int)sizeof(url)) {
+      char authority[kMaxUriSize];
+      oai_copy_range(api_uri, host_begin,
+                     host_end + strcspn(api_uri + host_end, "/?"), authority);
+      esp_err_t err = oai_http_post(url, host, authority, authorization,
+                                    offer, answer);
+      if (err == ESP_OK) {
+        ESP_LOGI(LOG_TAG, "Signaling took %lld ms (cached address %s)",
+                 (long long)(esp_timer_get_time() - start) / 1000, addr);
+      }
+      if (err == ESP_OK || err == ESP_ERR_INVALID_RESPONSE) {
+        return err;
+      }
+      // The address may be stale, try again by name.
+      ESP_LOGW(LOG_TAG, "Cached address %s failed, resolving %s", addr, host);
+      oai_dns_refresh(host);
+      start = esp_timer_get_time();
+    }
+  }
+#endif  // CONFIG_DNS_CACHE
+
+  esp_err_t err =
+      oai_http_post(api_uri, nullptr, nullptr, authorization, offer, answer);
+  if (err == ESP_OK) {
+    ESP_LOGI(LOG_TAG, "Signaling took %lld ms (resolved)",
+             (long long)(esp_timer_get_time() - start) / 1000);
+  }
+  return err;
 }
@@ -0,0 +1,513 @@
+#include "json_stream.h"
+
+#include <string.h>
+
+#include <charconv>
+#include <cmath>
+
+namespace {
+
+constexpr int kMaxDepth = 32;
+
+const char *skip_ws(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+    p++;
+  }
+  return p;
+}
+
+// p points at the opening quote. Returns the position after the closing
+// quote, or nullptr if the string is unterminated.
+const char *scan_string(const char *p, const char *end) {
+  for (p++; p < end; p++) {
+    if (*p == '\\') {
+      p++;
+    } else if (*p == '"') {
+      return p + 1;
+    }
+  }
+  return nullptr;
+}
+
+const char *scan_literal(const char *p, const char *end,
+                         std::string_view literal) {
+  if ((size_t)(end - p) < literal.size() ||
+      memcmp(p, literal.data(), literal.size()) != 0) {
+    return nullptr;
+  }
+  return p + literal.size();
+}
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+const char *scan_digits(const char *p, const char *end) {
+  const char *start = p;
+  while (p < end && is_digit(*p)) {
+    p++;
+  }
+  return p == start ? nullptr : p;
+}
+
+// RFC 8259: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+const char *scan_number(const char *p, const char *end) {
+  if (p < end && *p == '-') {
+    p++;
+  }
+  if (p < end && *p == '0') {
+    p++;
+  } else if ((p = scan_digits(p, end)) == nullptr) {
+    return nullptr;
+  }
+  if (p < end && *p == '.' && (p = scan_digits(p + 1, end)) == nullptr) {
+    return nullptr;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < end && (*p == '+' || *p == '-')) {
+      p++;
+    }
+    p = scan_digits(p, end);
+  }
+  return p;
+}
+
+const char *scan_value(const char *p, const char *end, JsonValue *out,
+                       int depth);
+
+// p points at '{' or '['. Returns the position after the closing bracket.
+const char *scan_container(const char *p, const char *end, bool object,
+                           int depth) {
+  const char close = object ? '}' : ']';
+  p = skip_ws(p + 1, end);
+  if (p < end && *p == close) {
+    return p + 1;
+  }
+  while (p < end) {
+    if (object) {
+      if (*p != '"' || (p = scan_string(p, end)) == nullptr) {
+        return nullptr;
+      }
+      p = skip_ws(p, end);
+      if (p >= end || *p != ':') {
+        return nullptr;
+      }
+      p = skip_ws(p + 1, end);
+    }
+    JsonValue value;
+    if ((p = scan_value(p, end, &value, depth + 1)) == nullptr) {
+      return nullptr;
+    }
+    p = skip_ws(p, end);
+    if (p >= end) {
+      return nullptr;
+    }
+    if (*p == close) {
+      return p + 1;
+    }
+    if (*p != ',') {
+      return nullptr;
+    }
+    p = skip_ws(p + 1, end);
+  }
+  return nullptr;
+}
+
+const char *scan_value(const char *p, const char *end, JsonValue *out,
+                       int depth) {
+  if (depth > kMaxDepth || p >= end) {
+    return nullptr;
+  }
+  const char *start = p;
+  JsonType type;
+  switch (*p) {
+    case '{':
+      type = JsonType::kObject;
+      p = scan_container(p, end, true, depth);
+      break;
+    case '[':
+      type = JsonType::kArray;
+      p = scan_container(p, end, false, depth);
+      break;
+    case '"':
+      type = JsonType::kString;
+      p = scan_string(p, end);
+      break;
+    case 't':
+      type = JsonType::kBool;
+      p = scan_literal(p, end, "true");
+      break;
+    case 'f':
+      type = JsonType::kBool;
+      p = scan_literal(p, end, "false");
+      break;
+    case 'n':
+      type = JsonType::kNull;
+      p = scan_literal(p, end, "null");
+      break;
+    default:
+      type = JsonType::kNumber;
+      p = scan_number(p, end);
+      break;
+  }
+  if (p == nullptr) {
+    return nullptr;
+  }
+  out->type = type;
+  if (type == JsonType::kString) {
+    out->raw = std::string_view(start + 1, p - start - 2);
+  } else {
+    out->raw = std::string_view(start, p - start);
+  }
+  return p;
+}
+
+void append_utf8(uint32_t cp, char *dst, size_t *len) {
+  if (cp < 0x80) {
+    dst[(*len)++] = (char)cp;
+  } else if (cp < 0x800) {
+    dst[(*len)++] = (char)(0xC0 | (cp >> 6));
+    dst[(*len)++] = (char)(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    dst[(*len)++] = (char)(0xE0 | (cp >> 12));
+    dst[(*len)++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    dst[(*len)++] = (char)(0x80 | (cp & 0x3F));
+  } else {
+    dst[(*len)++] = (char)(0xF0 | (cp >> 18));
+    dst[(*len)++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    dst[(*len)++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    dst[(*len)++] = (char)(0x80 | (cp & 0x3F));
+  }
+}
+
+bool parse_hex4(const char *p, const char *end, uint32_t *cp) {
+  if (end - p < 4) {
+    return false;
+  }
+  auto result = std::from_chars(p, p + 4, *cp, 16);
+  return result.ec == std::errc() && result.ptr == p + 4;
+}
+
+}  // namespace
+
+bool JsonValue::has_escapes() const {
+  return is_string() && memchr(raw.data(), '\\', raw.size()) != nullptr;
+}
+
+bool JsonValue::as_int(int64_t *value) const {
+  if (type != JsonType::kNumber) {
+    return false;
+  }
+  // The whole number, so that 1.5 or 1e3 is not read as 1.
+  int64_t number;
+  auto result = std::from_chars(raw.data(), raw.data() + raw.size(), number);
+  if (result.ec != std::errc() || result.ptr != raw.data() + raw.size()) {
+    return false;
+  }
+  *value = number;
+  return true;
+}
+
+bool JsonValue::as_double(double *value) const {
+  if (type != JsonType::kNumber) {
+    return false;
+  }
+  auto result = std::from_chars(raw.data(), raw.data() + raw.size(), *value);
+  return result.ec == std::errc() && result.ptr == raw.data() + raw.size();
+}
+
+bool JsonValue::as_bool(bool *value) const {
+  if (type != JsonType::kBool) {
+    return false;
+  }
+  *value = raw[0] == 't';
+  return true;
+}
+
+JsonValue JsonValue::operator[](std::string_view key) const {
+  if (!is_object()) {
+    return JsonValue();
+  }
+  JsonIterator it(*this);
+  std::string_view member;
+  JsonValue value;
+  while (it.next(&member, &value)) {
+    if (member == key) {
+      return value;
+    }
+  }
+  return JsonValue();
+}
+
+JsonValue JsonValue::at(size_t index) const {
+  if (!is_array()) {
+    return JsonValue();
+  }
+  JsonIterator it(*this);
+  JsonValue value;
+  for (size_t i = 0; it.next(nullptr, &value); i++) {
+    if (i == index) {
+      return value;
+    }
+  }
+  return JsonValue();
+}
+
+JsonIterator::JsonIterator(const JsonValue &container)
+    : p_(nullptr), end_(nullptr), object_(container.is_object()) {
+  if (container.is_object() || container.is_array()) {
+    // The container has already been validated, skip the opening bracket.
+    p_ = container.raw.data() + 1;
+    end_ = container.raw.data() + container.raw.size() - 1;
+  }
+}
+
+bool JsonIterator::next(std::string_view *key, JsonValue *value) {
+  if (p_ == nullptr) {
+    return false;
+  }
+  p_ = skip_ws(p_, end_);
+  if (p_ < end_ && *p_ == ',') {
+    p_ = skip_ws(p_ + 1, end_);
+  }
+  if (p_ >= end_) {
+    p_ = nullptr;
+    return false;
+  }
+  if (object_) {
+    const char *key_start = p_;
+    p_ = scan_string(p_, end_);
+    if (key != nullptr) {
+      *key = std::string_view(key_start + 1, p_ - key_start - 2);
+    }
+    p_ = skip_ws(p_, end_) + 1;  // ':'
+    p_ = skip_ws(p_, end_);
+  }
+  p_ = scan_value(p_, end_, value, 0);
+  return p_ != nullptr;
+}
+
+JsonValue oai_json_parse(std::string_view text) {
+  const char *end = text.data() + text.size();
+  JsonValue root;
+  const char *p = scan_value(skip_ws(text.data(), end), end, &root, 0);
+  if (p == nullptr || skip_ws(p, end) != end) {
+    return JsonValue();
+  }
+  return root;
+}
+
+int oai_json_unescape(const JsonValue &value, char *dst, size_t dst_size) {
+  if (!value.is_string() || dst_size == 0) {
+    return -1;
+  }
+  const char *p = value.raw.data();
+  const char *end = p + value.raw.size();
+  size_t len = 0;
+  while (p < end) {
+    // Leave room for the longest UTF-8 sequence and the terminator.
+    if (len + 5 > dst_size) {
+      return -1;
+    }
+    if (*p != '\\') {
+      dst[len++] = *p++;
+      continue;
+    }
+    if (++p >= end) {
+      return -1;
+    }
+    char c = *p++;
+    switch (c) {
+      case 'b':
+        dst[len++] = '\b';
+        break;
+      case 'f':
+        dst[len++] = '\f';
+        break;
+      case 'n':
+        dst[len++] = '\n';
+        break;
+      case 'r':
+        dst[len++] = '\r';
+        break;
+      case 't':
+        dst[len++] = '\t';
+        break;
+      case 'u': {
+        uint32_t cp;
+        if (!parse_hex4(p, end, &cp)) {
+          return -1;
+        }
+        p += 4;
+        if (cp >= 0xD800 && cp <= 0xDBFF) {
+          uint32_t low;
+          if (end - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+              !parse_hex4(p + 2, end, &low) || low < 0xDC00 || low > 0xDFFF) {
+            return -1;
+          }
+          p += 6;
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        }
+        append_utf8(cp, dst, &len);
+        break;
+      }
+      default:
+        dst[len++] = c;
+        break;
+    }
+  }
+  dst[len] = '\0';
+  return (int)len;
+}
+
+JsonWriter::JsonWriter(char *buf, size_t size) : buf_(buf), cap_(size) {
+  if (cap_ == 0) {
+    overflow_ = true;
+  } else {
+    buf_[0] = '\0';
+  }
+}
+
+void JsonWriter::append(const char *data, size_t len) {
+  if (overflow_ || len_ + len + 1 > cap_) {
+    overflow_ = true;
+    return;
+  }
+  memcpy(buf_ + len_, data, len);
+  len_ += len;
+  buf_[len_] = '\0';
+}
+
+void JsonWriter::push(char c) { append(&c, 1); }
+
+void JsonWriter::separator() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  uint32_t bit = 1u << depth_;
+  if (has_element_ & bit) {
+    push(',');
+  }
+  has_element_ |= bit;
+}
+
+JsonWriter &JsonWriter::begin_object() {
+  separator();
+  push('{');
+  if (++depth_ >= 32) {
+    overflow_ = true;
+  }
+  has_element_ &= ~(1u << (depth_ & 31));
+  return *this;
+}
+
+JsonWriter &JsonWriter::end_object() {
+  push('}');
+  depth_--;
+  return *this;
+}
+
+JsonWriter &JsonWriter::begin_array() {
+  separator();
+  push('[');
+  if (++depth_ >= 32) {
+    overflow_ = true;
+  }
+  has_element_ &= ~(1u << (depth_ & 31));
+  return *this;
+}
+
+JsonWriter &JsonWriter::end_array() {
+  push(']');
+  depth_--;
+  return *this;
+}
+
+JsonWriter &JsonWriter::key(std::string_view key) {
+  string(key);
+  push(':');
+  after_key_ = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::string(std::string_view value) {
+  static const char kHex[] = "0123456789abcdef";
+  separator();
+  push('"');
+  const char *run = value.data();
+  const char *end = value.data() + value.size();
+  for (const char *p = run; p < end; p++) {
+    unsigned char c = (unsigned char)*p;
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    append(run, p - run);
+    run = p + 1;
+    switch (c) {
+      case '"':
+        append("\\\"", 2);
+        break;
+      case '\\':
+        append("\\\\", 2);
+        break;
+      case '\n':
+        append("\\n", 2);
+        break;
+      case '\r':
+        append("\\r", 2);
+        break;
+      case '\t':
+        append("\\t", 2);
+        break;
+      default: {
+        char escaped[6] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xF]};
+        append(escaped, sizeof(escaped));
+        break;
+      }
+    }
+  }
+  append(run, end - run);
+  push('"');
+  return *this;
+}
+
+JsonWriter &JsonWriter::number(int64_t value) {
+  char digits[24];
+  auto result = std::to_chars(digits, digits + sizeof(digits), value);
+  separator();
+  append(digits, result.ptr - digits);
+  return *this;
+}
+
+JsonWriter &JsonWriter::number(double value) {
+  if (!std::isfinite(value)) {
+    return null();
+  }
+  char digits[32];
+  auto result = std::to_chars(digits, digits + sizeof(digits), value);
+  separator();
+  append(digits, result.ptr - digits);
+  return *this;
+}
+
+JsonWriter &JsonWriter::boolean(bool value) {
+  separator();
+  if (value) {
+    append("true", 4);
+  } else {
+    append("false", 5);
+  }
+  return *this;
+}
+
+JsonWriter &JsonWriter::null() {
+  separator();
+  append("null", 4);
+  return *this;
+}
+
+JsonWriter &JsonWriter::raw(std::string_view json) {
+  separator();
+  append(json.data(), json.size());
+  return *this;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string_view>
+
+// Allocation-free JSON reader for realtime API events.
+//
+// Values are views into the original message buffer. Nothing is copied or
+// decoded until the caller asks for it, so a message can be inspected
+// without touching the heap.
+
+enum class JsonType : uint8_t {
+  kInvalid,
+  kNull,
+  kBool,
+  kNumber,
+  kString,
+  kObject,
+  kArray,
+};
+
+struct JsonValue {
+  JsonType type = JsonType::kInvalid;
+  // The raw text of the value. For strings this is the content between the
+  // quotes, still escaped.
+  std::string_view raw;
+
+  bool valid() const { return type != JsonType::kInvalid; }
+  bool is_string() const { return type == JsonType::kString; }
+  bool is_object() const { return type == JsonType::kObject; }
+  bool is_array() const { return type == JsonType::kArray; }
+
+  // Raw string content, empty if the value is not a string. Only equal to
+  // the decoded string when has_escapes() is false.
+  std::string_view str() const {
+    return is_string() ? raw : std::string_view();
+  }
+  bool has_escapes() const;
+  // False, leaving *value alone, unless the number is an integer that fits.
+  bool as_int(int64_t *value) const;
+  bool as_double(double *value) const;
+  bool as_bool(bool *value) const;
+
+  // Looks up a member of an object. Returns an invalid value if this is not
+  // an object or the key does not exist.
+  JsonValue operator[](std::string_view key) const;
+  // Returns the n-th element of an array.
+  JsonValue at(size_t index) const;
+};
+
+// Iterates over the members of an object or the elements of an array.
+class JsonIterator {
+ public:
+  explicit JsonIterator(const JsonValue &container);
+  // For arrays the key is left empty.
+  bool next(std::string_view *key, JsonValue *value);
+
+ private:
+  const char *p_;
+  const char *end_;
+  bool object_;
+};
+
+// Validates the whole document and returns its root value.
+JsonValue oai_json_parse(std::string_view text);
+
+// Decodes a string value into dst and NUL-terminates it. Returns the decoded
+// length, or -1 if the value is not a string or dst is too small.
+int oai_json_unescape(const JsonValue &value, char *dst, size_t dst_size);
+
+// Writes JSON into a fixed buffer. Commas between members and elements are
+// inserted automatically. On overflow the writer stops and ok() turns false,
+// the buffer always stays NUL-terminated.
+class JsonWriter {
+ public:
+  JsonWriter(char *buf, size_t size);
+
+  JsonWriter &begin_object();
+  JsonWriter &end_object();
+  JsonWriter &begin_array();
+  JsonWriter &end_array();
+  JsonWriter &key(std::string_view key);
+  JsonWriter &string(std::string_view value);
+  JsonWriter &number(int64_t value);
+  // NaN and infinities have no JSON form and are written as null.
+  JsonWriter &number(double value);
+  JsonWriter &boolean(bool value);
+  JsonWriter &null();
+  // Inserts an already serialized JSON value.
+  JsonWriter &raw(std::string_view json);
+
+  // key(k).string(v) etc. in one call.
+  JsonWriter &member(std::string_view key, std::string_view value) {
+    return this->key(key).string(value);
+  }
+  JsonWriter &member(std::string_view key, const char *value) {
+    return this->key(key).string(value);
+  }
+  JsonWriter &member(std::string_view key, int64_t value) {
+    return this->key(key).number(value);
+  }
+  JsonWriter &member(std::string_view key, int value) {
+    return this->key(key).number((int64_t)value);
+  }
+  JsonWriter &member(std::string_view key, bool value) {
+    return this->key(key).boolean(value);
+  }
+
+  bool ok() const { return !overflow_ && depth_ == 0; }
+  size_t size() const { return len_; }
+  std::string_view view() const { return std::string_view(buf_, len_); }
+
+ private:
+  void separator();
+  void push(char c);
+  void append(const char *data, size_t len);
+
+  char *buf_;
+  size_t cap_;
+  size_t len_ = 0;
+  bool overflow_ = false;
+  bool after_key_ = false;
+  uint8_t depth_ = 0;
+  // One bit per nesting level, set once the level has its first element.
+  uint32_t has_element_ = 0;
+};
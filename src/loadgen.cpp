@@ -0,0 +1,740 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "codec.h"
+#include "json_stream.h"
+#include "main.h"
+
+#ifdef CONFIG_LOADGEN_SOAK
+#include <malloc.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include <mutex>
+#include <random>
+#endif  // CONFIG_LOADGEN_SOAK
+
+// Linux load generator. Runs CONFIG_LOADGEN_SESSIONS independent realtime
+// sessions, each with its own PeerConnection, codec state, signaling request
+// and file-backed audio, multiplexed over a fixed pool of threads. Every
+// session is only ever touched by the thread that owns it, except for the
+// signaling request which runs on a short-lived thread of its own.
+//
+// With CONFIG_LOADGEN_SOAK the run doubles as a soak test: packet loss and
+// reconnects are injected, the main thread samples heap usage, jitter,
+// latency and sender lag every CONFIG_LOADGEN_SOAK_SAMPLE_S, and the run
+// fails if any of them trends upwards (see soak_check).
+
+constexpr const char *TAG = "loadgen";
+
+namespace {
+
+constexpr int64_t kFrameUs = BUFFER_SAMPLES * 1000000LL / SAMPLE_RATE;
+constexpr int64_t kPollUs = 2000;
+constexpr int64_t kRampUs = 50000;
+constexpr int64_t kRestartDelayUs = 1000000;
+constexpr const char *kGreeting = "Say 'How can I help?.'";
+
+enum class Signaling : uint8_t {
+  kIdle,
+  kPending,
+  kAnswered,
+  kFailed,
+};
+
+struct LoadgenSession {
+  int id;
+  PeerConnection *pc = nullptr;
+  OaiAudioCodec codec;
+  bool connected = false;
+  bool failed = false;
+  int64_t started_us = 0;
+  int64_t restart_us = 0;
+  int64_t next_frame_us = 0;
+  // Start of the exchange whose first answer audio packet is awaited, 0 if
+  // nothing is awaited.
+  int64_t awaiting_audio_us = 0;
+  size_t source_pos = 0;
+  FILE *sink = nullptr;
+
+  std::thread signaling_thread;
+  std::atomic<Signaling> signaling{Signaling::kIdle};
+  std::string offer;
+  char answer[MAX_HTTP_OUTPUT_BUFFER + 1];
+
+  uint32_t setups = 0;
+  uint32_t failures = 0;
+  uint32_t frames_sent = 0;
+  uint32_t frames_received = 0;
+  uint32_t responses = 0;
+  std::vector<uint32_t> setup_ms;
+  std::vector<uint32_t> response_ms;
+
+  opus_int16 pcm[BUFFER_SAMPLES];
+  opus_int16 decoded[BUFFER_SAMPLES];
+  uint8_t packet[OPUS_OUT_BUFFER_SIZE];
+
+#ifdef CONFIG_LOADGEN_SOAK
+  int64_t connected_us = 0;
+  int64_t last_packet_us = 0;
+  int64_t last_packet_duration_us = 0;
+  // RFC 3550 interarrival jitter of the answer audio. Read by the sampler.
+  std::atomic<uint32_t> jitter_us{0};
+  std::minstd_rand loss_rng;
+  std::minstd_rand latency_rng;
+  uint32_t reconnects = 0;
+#endif
+};
+
+#ifdef CONFIG_LOADGEN_SOAK
+// Soak runs last for hours, so each session keeps a uniform sample of its
+// latencies, reserved up front, instead of all of them. The heap trend then
+// only sees the code under test, not the bookkeeping of the harness.
+constexpr size_t kLatencySamples = 4096;
+#endif
+
+// Adds the count-th latency of a session to samples.
+void add_latency(LoadgenSession *s, std::vector<uint32_t> &samples,
+                 uint32_t count, uint32_t ms) {
+#ifdef CONFIG_LOADGEN_SOAK
+  if (samples.size() >= kLatencySamples) {
+    uint32_t i = s->latency_rng() % count;
+    if (i < kLatencySamples) {
+      samples[i] = ms;
+    }
+    return;
+  }
+#endif
+  samples.push_back(ms);
+}
+
+// Looped by every session from a different offset. Read-only once the
+// sessions are started.
+std::vector<int16_t> s_source;
+
+#ifdef CONFIG_LOADGEN_SOAK
+// Gaps longer than this are pauses between answers, not jitter.
+constexpr int64_t kAnswerGapUs = 200000;
+
+// What the sessions saw since the last sample. Guarded by s_soak_lock.
+struct SoakWindow {
+  std::vector<uint32_t> response_ms;
+  std::vector<uint32_t> setup_ms;
+  int64_t max_lag_us = 0;
+  uint32_t reconnects = 0;
+  uint32_t dropped = 0;
+};
+
+std::mutex s_soak_lock;
+SoakWindow s_soak_window;
+
+// Injected loss, applied to both directions.
+bool soak_drop(LoadgenSession *s) {
+  if (CONFIG_LOADGEN_SOAK_LOSS_PERCENT == 0 ||
+      s->loss_rng() % 100 >= CONFIG_LOADGEN_SOAK_LOSS_PERCENT) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(s_soak_lock);
+  s_soak_window.dropped++;
+  return true;
+}
+
+void soak_on_audio(LoadgenSession *s, int samples) {
+  int64_t now = esp_timer_get_time();
+  int64_t gap = now - s->last_packet_us;
+  if (s->last_packet_us != 0 && gap < kAnswerGapUs) {
+    int64_t d = std::abs(gap - s->last_packet_duration_us);
+    int64_t jitter = s->jitter_us.load(std::memory_order_relaxed);
+    s->jitter_us.store(jitter + (d - jitter) / 16, std::memory_order_relaxed);
+  }
+  s->last_packet_us = now;
+  s->last_packet_duration_us = samples * 1000000LL / SAMPLE_RATE;
+}
+#endif  // CONFIG_LOADGEN_SOAK
+
+void on_audio_track(uint8_t *data, size_t size, void *user_data) {
+  LoadgenSession *s = (LoadgenSession *)user_data;
+#ifdef CONFIG_LOADGEN_SOAK
+  if (soak_drop(s)) {
+    // Conceal the lost packet like a real receiver would.
+    s->codec.decode(nullptr, 0, s->decoded, BUFFER_SAMPLES);
+    return;
+  }
+#endif
+  s->frames_received++;
+  if (s->awaiting_audio_us != 0) {
+    uint32_t response_ms =
+        (esp_timer_get_time() - s->awaiting_audio_us) / 1000;
+    s->responses++;
+    add_latency(s, s->response_ms, s->responses, response_ms);
+    s->awaiting_audio_us = 0;
+#ifdef CONFIG_LOADGEN_SOAK
+    std::lock_guard<std::mutex> lock(s_soak_lock);
+    s_soak_window.response_ms.push_back(response_ms);
+#endif
+  }
+
+  int samples = s->codec.decode(data, size, s->decoded, BUFFER_SAMPLES);
+#ifdef CONFIG_LOADGEN_SOAK
+  if (samples > 0) {
+    soak_on_audio(s, samples);
+  }
+#endif
+  if (samples > 0 && s->sink != nullptr) {
+    fwrite(s->decoded, sizeof(opus_int16), samples, s->sink);
+  }
+}
+
+void on_state_change(PeerConnectionState state, void *user_data) {
+  LoadgenSession *s = (LoadgenSession *)user_data;
+  if (state == PEER_CONNECTION_DISCONNECTED ||
+      state == PEER_CONNECTION_CLOSED || state == PEER_CONNECTION_FAILED) {
+    s->failed = true;
+  } else if (state == PEER_CONNECTION_CONNECTED) {
+    int64_t now = esp_timer_get_time();
+    s->connected = true;
+    s->setups++;
+    uint32_t setup_ms = (now - s->started_us) / 1000;
+    add_latency(s, s->setup_ms, s->setups, setup_ms);
+    s->next_frame_us = now;
+#ifdef CONFIG_LOADGEN_SOAK
+    s->connected_us = now;
+    std::lock_guard<std::mutex> lock(s_soak_lock);
+    s_soak_window.setup_ms.push_back(setup_ms);
+#endif
+  }
+}
+
+void signal_session(LoadgenSession *s) {
+  bool ok = oai_http_request(s->offer.data(), s->answer) == ESP_OK;
+  s->signaling.store(ok ? Signaling::kAnswered : Signaling::kFailed,
+                     std::memory_order_release);
+}
+
+void on_ice_candidate(char *description, void *user_data) {
+  LoadgenSession *s = (LoadgenSession *)user_data;
+  if (s->signaling_thread.joinable()) {
+    return;
+  }
+  s->offer = description;
+  s->signaling = Signaling::kPending;
+  s->signaling_thread = std::thread(signal_session, s);
+}
+
+void on_datachannel_message(char *msg, size_t len, void *user_data,
+                            uint16_t sid) {
+  LoadgenSession *s = (LoadgenSession *)user_data;
+  JsonValue event = oai_json_parse(std::string_view(msg, len));
+  if (event["type"].str() == "input_audio_buffer.speech_stopped") {
+    s->awaiting_audio_us = esp_timer_get_time();
+  }
+}
+
+void on_datachannel_open(void *user_data) {
+  LoadgenSession *s = (LoadgenSession *)user_data;
+  if (peer_connection_create_datachannel(s->pc, DATA_CHANNEL_RELIABLE, 0, 0,
+                                         (char *)"oai-events",
+                                         (char *)"") == -1) {
+    ESP_LOGE(TAG, "session %d: Failed to create DataChannel", s->id);
+    return;
+  }
+
+  char buf[256];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object()
+      .member("type", "response.create")
+      .key("response")
+      .begin_object()
+      .member("instructions", kGreeting)
+      .end_object()
+      .end_object();
+  if (peer_connection_datachannel_send(s->pc, buf, w.size()) >= 0) {
+    s->awaiting_audio_us = esp_timer_get_time();
+  }
+}
+
+void session_connect(LoadgenSession &s, int64_t now) {
+  PeerConfiguration config = {
+      .ice_servers = {},
+      .audio_codec = oai_audio_codec_media(AUDIO_CODEC),
+      .video_codec = CODEC_NONE,
+      .datachannel = DATA_CHANNEL_STRING,
+      .onaudiotrack = on_audio_track,
+      .onvideotrack = NULL,
+      .on_request_keyframe = NULL,
+      .user_data = &s,
+  };
+
+  s.started_us = now;
+  s.pc = peer_connection_create(&config);
+  if (s.pc == nullptr) {
+    ESP_LOGE(TAG, "session %d: Failed to create peer connection", s.id);
+    s.failures++;
+    s.restart_us = now + kRestartDelayUs;
+    return;
+  }
+
+  peer_connection_oniceconnectionstatechange(s.pc, on_state_change);
+  peer_connection_onicecandidate(s.pc, on_ice_candidate);
+  peer_connection_ondatachannel(s.pc, on_datachannel_message,
+                                on_datachannel_open, NULL);
+  peer_connection_create_offer(s.pc);
+}
+
+void session_teardown(LoadgenSession &s) {
+  if (s.signaling_thread.joinable()) {
+    s.signaling_thread.join();
+  }
+  s.signaling = Signaling::kIdle;
+  if (s.pc != nullptr) {
+    peer_connection_close(s.pc);
+    peer_connection_destroy(s.pc);
+    s.pc = nullptr;
+  }
+  s.connected = false;
+  s.failed = false;
+  s.awaiting_audio_us = 0;
+#ifdef CONFIG_LOADGEN_SOAK
+  s.last_packet_us = 0;
+#endif
+}
+
+void session_send_frame(LoadgenSession &s) {
+  for (opus_int16 &sample : s.pcm) {
+    if (s_source.empty()) {
+      sample = 0;
+      continue;
+    }
+    sample = s_source[s.source_pos];
+    s.source_pos = (s.source_pos + 1) % s_source.size();
+  }
+
+  int size = s.codec.encode(s.pcm, BUFFER_SAMPLES, s.packet,
+                             sizeof(s.packet));
+#ifdef CONFIG_LOADGEN_SOAK
+  if (soak_drop(&s)) {
+    return;
+  }
+#endif
+  if (size > 0 && peer_connection_send_audio(s.pc, s.packet, size) >= 0) {
+    s.frames_sent++;
+  }
+}
+
+// Runs one iteration of a session and returns when it wants to run next.
+int64_t session_step(LoadgenSession &s, int64_t now) {
+  if (s.pc == nullptr) {
+    if (now < s.restart_us) {
+      return s.restart_us;
+    }
+    session_connect(s, now);
+    if (s.pc == nullptr) {
+      return s.restart_us;
+    }
+  }
+
+  Signaling signaling = s.signaling.load(std::memory_order_acquire);
+  if (signaling == Signaling::kAnswered || signaling == Signaling::kFailed) {
+    s.signaling_thread.join();
+    s.signaling = Signaling::kIdle;
+    if (signaling == Signaling::kAnswered) {
+      peer_connection_set_remote_description(s.pc, s.answer);
+    } else {
+      s.failed = true;
+    }
+  }
+
+  peer_connection_loop(s.pc);
+  if (!s.connected &&
+      now - s.started_us > CONFIG_SESSION_CONNECT_TIMEOUT_MS * 1000LL) {
+    ESP_LOGW(TAG, "session %d: Setup timed out", s.id);
+    s.failed = true;
+  }
+  if (s.failed) {
+    session_teardown(s);
+    s.failures++;
+    s.restart_us = now + kRestartDelayUs;
+    return s.restart_us;
+  }
+
+#ifdef CONFIG_LOADGEN_SOAK
+  if (CONFIG_LOADGEN_SOAK_RECONNECT_S > 0 && s.connected &&
+      now - s.connected_us > CONFIG_LOADGEN_SOAK_RECONNECT_S * 1000000LL) {
+    session_teardown(s);
+    s.reconnects++;
+    s.restart_us = now;
+    std::lock_guard<std::mutex> lock(s_soak_lock);
+    s_soak_window.reconnects++;
+    return now;
+  }
+#endif
+
+  if (!s.connected) {
+    return now + kPollUs;
+  }
+  if (now >= s.next_frame_us) {
+#ifdef CONFIG_LOADGEN_SOAK
+    {
+      std::lock_guard<std::mutex> lock(s_soak_lock);
+      s_soak_window.max_lag_us =
+          std::max(s_soak_window.max_lag_us, now - s.next_frame_us);
+    }
+#endif
+    session_send_frame(s);
+    // Frames missed while the thread was late are skipped, not bursted.
+    s.next_frame_us = std::max(s.next_frame_us + kFrameUs, now);
+  }
+  return std::min(s.next_frame_us, now + kPollUs);
+}
+
+void worker(std::vector<LoadgenSession *> sessions, int64_t end_us) {
+  while (1) {
+    int64_t now = esp_timer_get_time();
+    if (now >= end_us) {
+      break;
+    }
+
+    int64_t wake_us = end_us;
+    for (LoadgenSession *s : sessions) {
+      wake_us = std::min(wake_us, session_step(*s, esp_timer_get_time()));
+    }
+    int64_t sleep_us = wake_us - esp_timer_get_time();
+    if (sleep_us > 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+    }
+  }
+
+  for (LoadgenSession *s : sessions) {
+    session_teardown(*s);
+  }
+}
+
+bool load_source() {
+  const char *path = CONFIG_LOADGEN_AUDIO_SOURCE;
+  if (path[0] == '\0') {
+    ESP_LOGI(TAG, "No audio source configured, sending silence");
+    return true;
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr) {
+    ESP_LOGE(TAG, "Failed to open audio source %s", path);
+    return false;
+  }
+  int16_t chunk[1024];
+  size_t count;
+  while ((count = fread(chunk, sizeof(int16_t), std::size(chunk), file)) > 0) {
+    s_source.insert(s_source.end(), chunk, chunk + count);
+  }
+  fclose(file);
+  ESP_LOGI(TAG, "Loaded %zu ms of audio from %s",
+           s_source.size() * 1000 / SAMPLE_RATE, path);
+  return true;
+}
+
+// Sorts samples and formats count, p50, p90, p99 and max. count is the
+// number of latencies measured, of which samples may only hold a subset.
+void format_percentiles(std::vector<uint32_t> &samples, uint32_t count,
+                        char *buf, size_t size) {
+  if (samples.empty()) {
+    snprintf(buf, size, "n=0");
+    return;
+  }
+  std::sort(samples.begin(), samples.end());
+  auto at = [&](int percent) {
+    return (unsigned)samples[(samples.size() - 1) * percent / 100];
+  };
+  snprintf(buf, size, "n=%lu p50 %u p90 %u p99 %u max %u",
+           (unsigned long)count, at(50), at(90), at(99),
+           (unsigned)samples.back());
+}
+
+void report(std::vector<std::unique_ptr<LoadgenSession>> &sessions) {
+  char setup[96];
+  char response[96];
+  LoadgenSession total;
+  total.id = -1;
+
+  for (auto &s : sessions) {
+    total.setups += s->setups;
+    total.failures += s->failures;
+    total.frames_sent += s->frames_sent;
+    total.frames_received += s->frames_received;
+    total.responses += s->responses;
+    total.setup_ms.insert(total.setup_ms.end(), s->setup_ms.begin(),
+                          s->setup_ms.end());
+    total.response_ms.insert(total.response_ms.end(), s->response_ms.begin(),
+                             s->response_ms.end());
+
+    format_percentiles(s->setup_ms, s->setups, setup, sizeof(setup));
+    format_percentiles(s->response_ms, s->responses, response,
+                       sizeof(response));
+    ESP_LOGI(TAG,
+             "session %3d: %lu setups, %lu failures, frames %lu out %lu in | "
+             "setup ms %s | response ms %s",
+             s->id, (unsigned long)s->setups, (unsigned long)s->failures,
+             (unsigned long)s->frames_sent, (unsigned long)s->frames_received,
+             setup, response);
+  }
+
+  format_percentiles(total.setup_ms, total.setups, setup, sizeof(setup));
+  format_percentiles(total.response_ms, total.responses, response,
+                     sizeof(response));
+  ESP_LOGI(TAG,
+           "total: %lu setups, %lu failures, frames %lu out %lu in | "
+           "setup ms %s | response ms %s",
+           (unsigned long)total.setups, (unsigned long)total.failures,
+           (unsigned long)total.frames_sent,
+           (unsigned long)total.frames_received, setup, response);
+}
+
+#ifdef CONFIG_LOADGEN_SOAK
+// One metric sampled over the run.
+struct SoakSeries {
+  const char *name;
+  const char *unit;
+  // Rises below this over the whole run are noise, however consistent.
+  double floor;
+  std::vector<double> values;
+};
+
+enum SoakMetric {
+  kHeap,
+  kJitter,
+  kResponseP50,
+  kResponseP99,
+  kSetupP50,
+  kLag,
+  kSoakMetrics,
+};
+
+uint32_t percentile(std::vector<uint32_t> &samples, int percent) {
+  std::sort(samples.begin(), samples.end());
+  return samples[(samples.size() - 1) * percent / 100];
+}
+
+// Takes one sample of every metric. Metrics without data in the window, e.g.
+// no answer was heard, are skipped rather than recorded as 0.
+void soak_sample(std::vector<std::unique_ptr<LoadgenSession>> &sessions,
+                 int64_t elapsed_us, bool record, SoakSeries *series) {
+  SoakWindow window;
+  {
+    std::lock_guard<std::mutex> lock(s_soak_lock);
+    std::swap(window, s_soak_window);
+  }
+
+  double heap_kb = mallinfo2().uordblks / 1024.0;
+  double jitter_ms = 0;
+  for (auto &s : sessions) {
+    jitter_ms += s->jitter_us.load(std::memory_order_relaxed) / 1000.0;
+  }
+  jitter_ms /= sessions.size();
+
+  double values[kSoakMetrics] = {heap_kb, jitter_ms, NAN, NAN, NAN,
+                                 window.max_lag_us / 1000.0};
+  if (!window.response_ms.empty()) {
+    values[kResponseP50] = percentile(window.response_ms, 50);
+    values[kResponseP99] = percentile(window.response_ms, 99);
+  }
+  if (!window.setup_ms.empty()) {
+    values[kSetupP50] = percentile(window.setup_ms, 50);
+  }
+
+  ESP_LOGI(TAG,
+           "soak %lld s: heap %.0f KB | jitter %.1f ms | response p50 %.0f "
+           "p99 %.0f ms | setup p50 %.0f ms | lag %.1f ms | %lu reconnects "
+           "%lu dropped",
+           (long long)(elapsed_us / 1000000), heap_kb, jitter_ms,
+           values[kResponseP50], values[kResponseP99], values[kSetupP50],
+           values[kLag], (unsigned long)window.reconnects,
+           (unsigned long)window.dropped);
+
+  if (!record) {
+    return;
+  }
+  for (int i = 0; i < kSoakMetrics; i++) {
+    if (!isnan(values[i])) {
+      series[i].values.push_back(values[i]);
+    }
+  }
+}
+
+// Mann-Kendall test for a monotonic upward trend. It only looks at the
+// order of the samples, so it holds up against the skewed and bursty
+// distributions of latency and heap usage. Returns the normalized score,
+// ties corrected, and the Theil-Sen slope per sample in *slope.
+double mann_kendall(const std::vector<double> &x, double *slope) {
+  size_t n = x.size();
+  int64_t score = 0;
+  std::vector<double> slopes;
+  slopes.reserve(n * (n - 1) / 2);
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = i + 1; j < n; j++) {
+      score += (x[j] > x[i]) - (x[j] < x[i]);
+      slopes.push_back((x[j] - x[i]) / (j - i));
+    }
+  }
+  std::nth_element(slopes.begin(), slopes.begin() + slopes.size() / 2,
+                   slopes.end());
+  *slope = slopes[slopes.size() / 2];
+
+  std::vector<double> sorted = x;
+  std::sort(sorted.begin(), sorted.end());
+  double variance = n * (n - 1.0) * (2.0 * n + 5);
+  for (size_t i = 0; i < n;) {
+    size_t t = std::upper_bound(sorted.begin() + i, sorted.end(), sorted[i]) -
+               sorted.begin() - i;
+    variance -= t * (t - 1.0) * (2.0 * t + 5);
+    i += t;
+  }
+  variance /= 18;
+  if (variance <= 0) {
+    return 0;
+  }
+  double correction = score > 0 ? -1 : score < 0 ? 1 : 0;
+  return (score + correction) / sqrt(variance);
+}
+
+// Fails the run if any metric rises significantly, at a one-sided 1% level.
+bool soak_check(SoakSeries *series) {
+  constexpr double kZ99 = 2.326;
+  constexpr size_t kMinSamples = 10;
+  bool ok = true;
+  for (int i = 0; i < kSoakMetrics; i++) {
+    const SoakSeries &metric = series[i];
+    if (metric.values.size() < kMinSamples) {
+      ESP_LOGW(TAG, "soak trend %s: only %zu samples, not tested",
+               metric.name, metric.values.size());
+      continue;
+    }
+    double slope;
+    double z = mann_kendall(metric.values, &slope);
+    double rise = slope * (metric.values.size() - 1);
+    bool rising = z > kZ99 && rise > metric.floor;
+    ESP_LOGI(TAG, "soak trend %s: n=%zu z=%.2f rise %.1f %s over the run%s",
+             metric.name, metric.values.size(), z, rise, metric.unit,
+             rising ? " RISING" : "");
+    ok = ok && !rising;
+  }
+  return ok;
+}
+
+// Samples until end_us and returns the verdict of the trend test.
+bool soak_run(std::vector<std::unique_ptr<LoadgenSession>> &sessions,
+              int64_t start_us, int64_t end_us) {
+  SoakSeries series[kSoakMetrics] = {
+      {"heap", "KB", 64, {}},
+      {"jitter", "ms", 1, {}},
+      {"response p50", "ms", 20, {}},
+      {"response p99", "ms", 20, {}},
+      {"setup p50", "ms", 20, {}},
+      {"lag", "ms", 1, {}},
+  };
+  constexpr int64_t kSampleUs = CONFIG_LOADGEN_SOAK_SAMPLE_S * 1000000LL;
+  constexpr int64_t kWarmupUs = CONFIG_LOADGEN_SOAK_WARMUP_S * 1000000LL;
+  for (SoakSeries &metric : series) {
+    metric.values.reserve((end_us - start_us) / kSampleUs);
+  }
+  for (int64_t next_us = start_us + kSampleUs; next_us <= end_us;
+       next_us += kSampleUs) {
+    int64_t sleep_us = next_us - esp_timer_get_time();
+    if (sleep_us > 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+    }
+    soak_sample(sessions, next_us - start_us,
+                next_us - start_us > kWarmupUs, series);
+  }
+
+  uint32_t reconnects = 0;
+  for (auto &s : sessions) {
+    reconnects += s->reconnects;
+  }
+  ESP_LOGI(TAG, "soak: %lu injected reconnects", (unsigned long)reconnects);
+  return soak_check(series);
+}
+#endif  // CONFIG_LOADGEN_SOAK
+
+}  // namespace
+
+bool oai_loadgen() {
+  if (!load_source()) {
+    return false;
+  }
+
+  int session_count = CONFIG_LOADGEN_SESSIONS;
+  unsigned thread_count = CONFIG_LOADGEN_THREADS;
+  if (thread_count == 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  thread_count = std::min<unsigned>(thread_count, session_count);
+  ESP_LOGI(TAG, "Running %d sessions on %u threads for %d s", session_count,
+           thread_count, CONFIG_LOADGEN_DURATION_S);
+
+  int64_t start_us = esp_timer_get_time();
+  std::vector<std::unique_ptr<LoadgenSession>> sessions;
+  for (int i = 0; i < session_count; i++) {
+    auto s = std::make_unique<LoadgenSession>();
+    s->id = i;
+    if (!s->codec.init_encoder() || !s->codec.init_decoder()) {
+      return false;
+    }
+    if (!s_source.empty()) {
+      // One second apart, so the sessions do not all speak in unison.
+      s->source_pos = (size_t)i * SAMPLE_RATE % s_source.size();
+    }
+    if (CONFIG_LOADGEN_AUDIO_SINK_DIR[0] != '\0') {
+      char path[256];
+      snprintf(path, sizeof(path), "%s/session-%d.pcm",
+               CONFIG_LOADGEN_AUDIO_SINK_DIR, i);
+      s->sink = fopen(path, "wb");
+      if (s->sink == nullptr) {
+        ESP_LOGE(TAG, "Failed to open audio sink %s", path);
+      }
+    }
+    // Ramp up instead of sending every offer at once.
+    s->restart_us = start_us + i * kRampUs;
+#ifdef CONFIG_LOADGEN_SOAK
+    s->loss_rng.seed(i + 1);
+    s->latency_rng.seed(i + 1);
+    s->setup_ms.reserve(kLatencySamples);
+    s->response_ms.reserve(kLatencySamples);
+#endif
+    sessions.push_back(std::move(s));
+  }
+
+  int64_t end_us = start_us + CONFIG_LOADGEN_DURATION_S * 1000000LL;
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < thread_count; t++) {
+    std::vector<LoadgenSession *> owned;
+    for (int i = t; i < session_count; i += thread_count) {
+      owned.push_back(sessions[i].get());
+    }
+    threads.emplace_back(worker, std::move(owned), end_us);
+  }
+#ifdef CONFIG_LOADGEN_SOAK
+  bool ok = soak_run(sessions, start_us, end_us);
+#else
+  bool ok = true;
+#endif
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  report(sessions);
+  for (auto &s : sessions) {
+    if (s->sink != nullptr) {
+      fclose(s->sink);
+    }
+  }
+  return ok;
+}
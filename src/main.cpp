@@ -1,4 +1,22 @@
 #include "main.h"
+#ifdef CONFIG_CAPTIONS
+#include "captions.h"
+#endif
+#include "codec.h"
+#include "dns.h"
+#include "events.h"
+#ifdef CONFIG_GREETING_CACHE
+#include "greeting.h"
+#endif
+#include "mem.h"
+#ifdef CONFIG_OPUS_KERNELS_CHECK
+#include "opus_kernels.h"
+#endif
+#ifdef CONFIG_RECORD
+#include "record.h"
+#endif
+#include "settings.h"
+#include "srtp_crypto.h"
 
 #include <esp_event.h>
 #include <esp_log.h>
@@ -25,6 +43,7 @@ extern "C" void app_main(void) {
     ret = nvs_flash_init();
   }
   ESP_ERROR_CHECK(ret);
+  oai_settings_init();
 
 #ifdef CONFIG_ENABLE_HEAP_MONITOR
   esp_timer_create_args_t timer_args = {
@@ -46,20 +65,86 @@ extern "C" void app_main(void) {
   cfg.internal_spk = false;
   cfg.internal_mic = false;
   M5.begin(cfg);
+#ifdef CONFIG_CAPTIONS
+  oai_captions_init();
+#endif
 
   ESP_ERROR_CHECK(esp_event_loop_create_default());
+#ifdef CONFIG_REALTIME_TRANSPORT_WEBRTC
   peer_init();
+#endif
+#ifdef CONFIG_DNS_CACHE
+  oai_dns_init();
+  oai_http_prefetch();
+#endif
   oai_wifi();
   
+#ifdef CONFIG_OPUS_KERNELS_CHECK
+  if (!oai_opus_kernels_check()) {
+    ESP_LOGE(TAG, "Falling back to the C Opus kernels");
+    oai_opus_kernels_use_vector(false);
+  }
+#endif
   oai_init_audio_capture();
   oai_init_audio_decoder();
-  
+#ifdef CONFIG_GREETING_CACHE
+  oai_greeting_init();
+#endif
+#ifdef CONFIG_RECORD
+  oai_record_init();
+#endif
+
+#ifdef CONFIG_EVENTS_BENCHMARK
+  oai_events_benchmark();
+#endif
+#ifdef CONFIG_MEM_BENCHMARK
+  oai_mem_benchmark();
+#endif
+#ifdef CONFIG_SRTP_BENCHMARK
+  oai_srtp_benchmark();
+#endif
+#ifdef CONFIG_CODEC_BENCHMARK
+  oai_codec_benchmark();
+#endif
+
+#ifdef CONFIG_REALTIME_TRANSPORT_WEBSOCKET
+  oai_websocket();
+#else
   oai_webrtc();
+#endif
 }
 #else
 int main(void) {
+  oai_settings_init();
   ESP_ERROR_CHECK(esp_event_loop_create_default());
   peer_init();
+#ifdef CONFIG_DNS_CACHE
+  oai_dns_init();
+  oai_http_prefetch();
+#endif
+#ifdef CONFIG_OPUS_KERNELS_CHECK
+  if (!oai_opus_kernels_check()) {
+    return 1;
+  }
+#endif
+#ifdef CONFIG_EVENTS_BENCHMARK
+  oai_events_benchmark();
+#endif
+#ifdef CONFIG_SRTP_BENCHMARK
+  oai_srtp_benchmark();
+#endif
+#ifdef CONFIG_CODEC_BENCHMARK
+  oai_codec_benchmark();
+#endif
+#ifdef CONFIG_LOADGEN
+  return oai_loadgen() ? 0 : 1;
+#elif defined(CONFIG_REPLAY)
+  return oai_replay() ? 0 : 1;
+#else
+#ifdef CONFIG_RECORD
+  oai_record_init();
+#endif
   oai_webrtc();
+#endif
 }
 #endif
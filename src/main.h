@@ -1,7 +1,9 @@
+#include <esp_err.h>
 #include <peer.h>
 
 #define LOG_TAG "realtimeapi-sdk"
 #define MAX_HTTP_OUTPUT_BUFFER 2048
+#define MAX_AUTHORIZATION_SIZE 320
 
 void oai_wifi(void);
 void oai_init_audio_capture(void);
@@ -9,5 +11,19 @@ void oai_init_audio_decoder(void);
 void oai_init_audio_encoder();
 void oai_send_audio(PeerConnection *peer_connection);
 void oai_audio_decode(uint8_t *data, size_t size);
+// Reads one frame from the microphone, valid until the next call.
+const int16_t *oai_audio_capture(size_t *samples);
+// Queues decoded speaker audio.
+void oai_audio_play_pcm(const int16_t *pcm, size_t samples);
 void oai_webrtc();
-void oai_http_request(char *offer, char *answer);
+void oai_websocket();
+// Returns false if the run failed, e.g. a soak trend test.
+bool oai_loadgen();
+// Replays CONFIG_REPLAY_FILE, returns false if it is unreadable or did not
+// decode cleanly.
+bool oai_replay();
+void oai_peer_loop_wakeup();
+esp_err_t oai_http_request(char *offer, char *answer);
+// Writes the Authorization header value, "Bearer " and the API key.
+void oai_http_authorization(char *authorization, size_t size);
+void oai_http_prefetch();
@@ -1,18 +1,24 @@
 #include <driver/i2s_std.h>
-#include <opus.h>
 
+#include "codec.h"
 #include "main.h"
+#include "mem.h"
+#include "playback.h"
+#include "settings.h"
 
 #include <esp_log.h>
 #include <M5Unified.h>
 
 #include <cstdint>
 #include <vector>
-#include <sys/socket.h>
 
-#define OPUS_OUT_BUFFER_SIZE 1276  // 1276 bytes is recommended by opus_encode
-#define SAMPLE_RATE 8000
-#define BUFFER_SAMPLES 320
+#ifdef CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
+#include "audio_tap.h"
+#endif // CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
+#ifdef CONFIG_TRANSPORT_STATS
+#include <esp_timer.h>
+#include "transport_stats.h"
+#endif // CONFIG_TRANSPORT_STATS
 
 static i2s_chan_handle_t s_i2s_tx_handle = nullptr;
 static i2s_chan_handle_t s_i2s_rx_handle = nullptr;
@@ -29,18 +35,8 @@ static constexpr i2s_chan_handle_t get_i2s_rx_handle() { return s_i2s_rx_handle;
 #define TX_LRCLK_PIN CONFIG_MEDIA_I2S_TX_LRCLK_PIN
 #define TX_DATA_PIN  CONFIG_MEDIA_I2S_TX_DATA_PIN
 
-#define OPUS_ENCODER_BITRATE 30000
-#define OPUS_ENCODER_COMPLEXITY 0
-
 constexpr const char *TAG = "media";
 
-// UDP socket for audio data debugging
-#ifdef CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
-static struct sockaddr_in s_debug_audio_in_dest_addr;
-static struct sockaddr_in s_debug_audio_out_dest_addr;
-static ssize_t s_debug_audio_sock;
-#endif // CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
-
 // Initialization of AW88298 and ES7210 from M5Unified implementation.
 constexpr std::uint8_t aw88298_i2c_addr = 0x36;
 constexpr std::uint8_t es7210_i2c_addr = 0x40;
@@ -123,19 +119,7 @@ void oai_init_audio_capture() {
 #endif
 
 #ifdef CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
-  // Initialize UDP socket for debug.
-  s_debug_audio_sock = socket(AF_INET, SOCK_DGRAM, 0);
-  if (s_debug_audio_sock < 0) {
-    ESP_LOGE(TAG, "Failed to create socket");
-    return;
-  }
-  
-  s_debug_audio_in_dest_addr.sin_addr.s_addr = inet_addr(CONFIG_MEDIA_DEBUG_AUDIO_HOST);
-  s_debug_audio_in_dest_addr.sin_family = AF_INET;
-  s_debug_audio_in_dest_addr.sin_port = htons(CONFIG_MEDIA_DEBUG_AUDIO_IN_PORT);
-  s_debug_audio_out_dest_addr.sin_addr.s_addr = inet_addr(CONFIG_MEDIA_DEBUG_AUDIO_HOST);
-  s_debug_audio_out_dest_addr.sin_family = AF_INET;
-  s_debug_audio_out_dest_addr.sin_port = htons(CONFIG_MEDIA_DEBUG_AUDIO_OUT_PORT);
+  oai_audio_tap_init();
 #endif // CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
 
   ESP_LOGI(TAG, "Initializing I2S for audio input/output");
@@ -231,73 +215,100 @@ void oai_init_audio_capture() {
 #endif // CONFIG_MEDIA_I2S_RX_TX_SHARED
 }
 
-opus_int16 *output_buffer = NULL;
-OpusDecoder *opus_decoder = NULL;
+// The device runs a single session, its codec state lives here.
+static OaiAudioCodec s_codec;
+static opus_int16 *output_buffer = NULL;
+
+// Runs on the playback task, blocks until I2S has room for the samples.
+static void oai_audio_play(int16_t *samples, size_t count) {
+#ifdef CONFIG_IDF_TARGET_ESP32
+  for(size_t i = 0; i < count * sizeof(opus_int16)/4; i++) {
+    const auto value = reinterpret_cast<std::uint32_t*>(samples)[i];
+    const auto high_word = value >> 16;
+    const auto low_word = value & 0xFFFF;
+    reinterpret_cast<std::uint32_t*>(samples)[i] = (low_word << 16) | high_word;
+  }
+#endif // CONFIG_IDF_TARGET_ESP32
+  std::size_t bytes_written = 0;
+  if( esp_err_t err = i2s_channel_write(get_i2s_tx_handle(), samples, count * sizeof(opus_int16),
+            &bytes_written, portMAX_DELAY); err != ESP_OK ) {
+    ESP_LOGE(TAG, "Failed to write audio data to I2S: %s", esp_err_to_name(err));
+  }
+}
 
 void oai_init_audio_decoder() {
-  int decoder_error = 0;
-  opus_decoder = opus_decoder_create(SAMPLE_RATE, 1, &decoder_error);
-  if (decoder_error != OPUS_OK) {
-    ESP_LOGE(TAG, "Failed to create OPUS decoder");
+#ifdef CONFIG_REALTIME_TRANSPORT_WEBRTC
+  if (!s_codec.init_decoder()) {
     return;
   }
 
-  output_buffer = (opus_int16 *)malloc(BUFFER_SAMPLES * sizeof(opus_int16));
+  output_buffer = (opus_int16 *)oai_mem_alloc(
+      BUFFER_SAMPLES * sizeof(opus_int16), OaiMemPlacement::kHot);
+#endif // CONFIG_REALTIME_TRANSPORT_WEBRTC
+  oai_playback_init(oai_audio_play);
 }
 
+void oai_audio_play_pcm(const int16_t *pcm, size_t samples) {
+#ifdef CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
+  oai_audio_tap(OaiAudioTapStream::kSpeakerPcm, pcm, samples * sizeof(int16_t),
+                samples);
+#endif // CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
+  oai_playback_write(pcm, samples);
+#ifdef CONFIG_TRANSPORT_STATS
+  oai_transport_stats_audio_out();
+#endif // CONFIG_TRANSPORT_STATS
+}
+
+#ifdef CONFIG_REALTIME_TRANSPORT_WEBRTC
 void oai_audio_decode(uint8_t *data, size_t size) {
+#ifdef CONFIG_TRANSPORT_STATS
+  int64_t start_us = esp_timer_get_time();
+#endif // CONFIG_TRANSPORT_STATS
   int decoded_size =
-      opus_decode(opus_decoder, data, size, output_buffer, BUFFER_SAMPLES, 0);
+      s_codec.decode(data, size, output_buffer, BUFFER_SAMPLES);
+#ifdef CONFIG_TRANSPORT_STATS
+  oai_transport_stats_downlink(esp_timer_get_time() - start_us);
+#endif // CONFIG_TRANSPORT_STATS
 
   if (decoded_size > 0) {
-#ifdef CONFIG_IDF_TARGET_ESP32
-    for(size_t i = 0; i < decoded_size * sizeof(opus_int16)/4; i++) {
-      const auto value = reinterpret_cast<std::uint32_t*>(output_buffer)[i];
-      const auto high_word = value >> 16;
-      const auto low_word = value & 0xFFFF;
-      reinterpret_cast<std::uint32_t*>(output_buffer)[i] = (low_word << 16) | high_word;
-    }
-#endif // CONFIG_IDF_TARGET_ESP32
-    std::size_t bytes_written = 0;
-    if( esp_err_t err = i2s_channel_write(get_i2s_tx_handle(), output_buffer, decoded_size * sizeof(opus_int16),
-              &bytes_written, portMAX_DELAY); err != ESP_OK ) {
-      ESP_LOGE(TAG, "Failed to write audio data to I2S: %s", esp_err_to_name(err));
-    }
-#ifdef CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
-    sendto(s_debug_audio_sock, output_buffer, decoded_size * sizeof(opus_int16), 0, (struct sockaddr *)&s_debug_audio_out_dest_addr, sizeof(s_debug_audio_out_dest_addr));
-#endif // CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
+#ifdef CONFIG_MEDIA_DEBUG_AUDIO_OPUS
+    oai_audio_tap(OaiAudioTapStream::kSpeakerOpus, data, size, decoded_size);
+#endif // CONFIG_MEDIA_DEBUG_AUDIO_OPUS
+    oai_audio_play_pcm(output_buffer, decoded_size);
   }
 }
+#endif // CONFIG_REALTIME_TRANSPORT_WEBRTC
 
-OpusEncoder *opus_encoder = NULL;
-opus_int16 *encoder_input_buffer = NULL;
-uint8_t *encoder_output_buffer = NULL;
+static opus_int16 *encoder_input_buffer = NULL;
+static uint8_t *encoder_output_buffer = NULL;
+// Only touched by the audio publisher, changes are applied between frames.
+static OaiSettingsView s_encoder_settings;
+static size_t s_frame_samples = BUFFER_SAMPLES;
 
 void oai_init_audio_encoder() {
-  int encoder_error;
-  opus_encoder = opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP,
-                                     &encoder_error);
-  if (encoder_error != OPUS_OK) {
-    ESP_LOGE(TAG, "Failed to create OPUS encoder");
+#ifdef CONFIG_REALTIME_TRANSPORT_WEBRTC
+  if (!s_codec.init_encoder()) {
     return;
   }
+  encoder_output_buffer =
+      (uint8_t *)oai_mem_alloc(OPUS_OUT_BUFFER_SIZE, OaiMemPlacement::kHot);
+#endif // CONFIG_REALTIME_TRANSPORT_WEBRTC
 
-  if (opus_encoder_init(opus_encoder, SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP) !=
-      OPUS_OK) {
-    ESP_LOGE(TAG, "Failed to initialize OPUS encoder");
-    return;
-  }
-
-  opus_encoder_ctl(opus_encoder, OPUS_SET_BITRATE(OPUS_ENCODER_BITRATE));
-  opus_encoder_ctl(opus_encoder, OPUS_SET_COMPLEXITY(OPUS_ENCODER_COMPLEXITY));
-  opus_encoder_ctl(opus_encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
-  encoder_input_buffer = (opus_int16 *)malloc(BUFFER_SAMPLES*sizeof(opus_int16));
-  encoder_output_buffer = (uint8_t *)malloc(OPUS_OUT_BUFFER_SIZE);
+  encoder_input_buffer = (opus_int16 *)oai_mem_alloc(
+      MAX_BUFFER_SAMPLES * sizeof(opus_int16), OaiMemPlacement::kHot);
 }
 
-void oai_send_audio(PeerConnection *peer_connection) {
+const int16_t *oai_audio_capture(size_t *samples) {
+  if (s_encoder_settings.refresh()) {
+    const OaiSettings &settings = s_encoder_settings.get();
+#ifdef CONFIG_REALTIME_TRANSPORT_WEBRTC
+    s_codec.configure_encoder(settings.opus_bitrate, settings.opus_complexity);
+#endif // CONFIG_REALTIME_TRANSPORT_WEBRTC
+    s_frame_samples = SAMPLE_RATE * settings.frame_ms / 1000;
+  }
+
   size_t bytes_read = 0;
-  if( esp_err_t err = i2s_channel_read(get_i2s_rx_handle(), encoder_input_buffer, BUFFER_SAMPLES*sizeof(opus_int16), &bytes_read,
+  if( esp_err_t err = i2s_channel_read(get_i2s_rx_handle(), encoder_input_buffer, s_frame_samples*sizeof(opus_int16), &bytes_read,
            portMAX_DELAY) ; err != ESP_OK ) {
     ESP_LOGE(TAG, "Failed to read audio data from I2S: %s", esp_err_to_name(err));
   }
@@ -311,13 +322,35 @@ void oai_send_audio(PeerConnection *peer_connection) {
 #endif // CONFIG_IDF_TARGET_ESP32
 
 #ifdef CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
-  sendto(s_debug_audio_sock, encoder_input_buffer, bytes_read, 0, (struct sockaddr *)&s_debug_audio_in_dest_addr, sizeof(s_debug_audio_in_dest_addr));
+  oai_audio_tap(OaiAudioTapStream::kMicPcm, encoder_input_buffer, bytes_read,
+                bytes_read / sizeof(opus_int16));
 #endif // CONFIG_MEDIA_ENABLE_DEBUG_AUDIO_UDP_CLIENT
 
-  auto encoded_size =
-      opus_encode(opus_encoder, encoder_input_buffer, BUFFER_SAMPLES,
-                  encoder_output_buffer, OPUS_OUT_BUFFER_SIZE);
+  *samples = s_frame_samples;
+  return encoder_input_buffer;
+}
+
+#ifdef CONFIG_REALTIME_TRANSPORT_WEBRTC
+void oai_send_audio(PeerConnection *peer_connection) {
+  size_t samples = 0;
+  const int16_t *pcm = oai_audio_capture(&samples);
+#ifdef CONFIG_TRANSPORT_STATS
+  int64_t start_us = esp_timer_get_time();
+#endif // CONFIG_TRANSPORT_STATS
+  auto encoded_size = s_codec.encode(pcm, samples, encoder_output_buffer,
+                                     OPUS_OUT_BUFFER_SIZE);
+
+#ifdef CONFIG_MEDIA_DEBUG_AUDIO_OPUS
+  if (encoded_size > 0) {
+    oai_audio_tap(OaiAudioTapStream::kMicOpus, encoder_output_buffer,
+                  encoded_size, samples);
+  }
+#endif // CONFIG_MEDIA_DEBUG_AUDIO_OPUS
 
   peer_connection_send_audio(peer_connection, encoder_output_buffer,
                              encoded_size);
+#ifdef CONFIG_TRANSPORT_STATS
+  oai_transport_stats_uplink(esp_timer_get_time() - start_us);
+#endif // CONFIG_TRANSPORT_STATS
 }
+#endif // CONFIG_REALTIME_TRANSPORT_WEBRTC
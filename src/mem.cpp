@@ -0,0 +1,135 @@
+#include "mem.h"
+
+#include <stdlib.h>
+
+#ifndef LINUX_BUILD
+#include <esp_heap_caps.h>
+#endif
+
+#ifdef CONFIG_MEM_BENCHMARK
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <math.h>
+
+#include "codec.h"
+#endif  // CONFIG_MEM_BENCHMARK
+
+#ifndef LINUX_BUILD
+void *oai_mem_alloc(size_t size, OaiMemPlacement placement) {
+  constexpr uint32_t kInternal = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  constexpr uint32_t kPsram = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+  switch (placement) {
+    case OaiMemPlacement::kHot:
+      return heap_caps_malloc_prefer(size, 2, kInternal, kPsram);
+    case OaiMemPlacement::kCold:
+      return heap_caps_malloc_prefer(size, 2, kPsram, kInternal);
+    case OaiMemPlacement::kPsramOnly:
+      return heap_caps_malloc(size, kPsram);
+  }
+  return nullptr;
+}
+
+void oai_mem_free(void *ptr) { heap_caps_free(ptr); }
+#else
+// The Linux build has a single flat heap.
+void *oai_mem_alloc(size_t size, OaiMemPlacement placement) {
+  return malloc(size);
+}
+
+void oai_mem_free(void *ptr) { free(ptr); }
+#endif  // LINUX_BUILD
+
+#ifdef CONFIG_MEM_BENCHMARK
+namespace {
+
+constexpr const char *TAG = "mem";
+constexpr size_t kStackSize = 20000;
+
+struct BenchRun {
+  OaiMemPlacement state;
+  TaskHandle_t caller;
+  bool ok;
+  int64_t encode_us;
+  int64_t decode_us;
+};
+
+void bench_task(void *arg) {
+  BenchRun *run = (BenchRun *)arg;
+  OaiAudioCodec codec;
+  opus_int16 *pcm = (opus_int16 *)oai_mem_alloc(
+      BUFFER_SAMPLES * sizeof(opus_int16), run->state);
+  uint8_t *packet = (uint8_t *)oai_mem_alloc(OPUS_OUT_BUFFER_SIZE, run->state);
+  run->ok = pcm != nullptr && packet != nullptr &&
+            codec.init_encoder(run->state) && codec.init_decoder(run->state);
+
+  // A voiced-speech-like signal, so the encoder does real work.
+  for (int i = 0; run->ok && i < BUFFER_SAMPLES; i++) {
+    float t = (float)i / SAMPLE_RATE;
+    pcm[i] = (opus_int16)(6000 * sinf(2 * M_PI * 220 * t) +
+                          3000 * sinf(2 * M_PI * 660 * t) +
+                          (rand() % 1000 - 500));
+  }
+  for (int n = 0; run->ok && n < CONFIG_MEM_BENCHMARK_FRAMES; n++) {
+    int64_t start = esp_timer_get_time();
+    int size = codec.encode(pcm, BUFFER_SAMPLES, packet, OPUS_OUT_BUFFER_SIZE);
+    int64_t encoded = esp_timer_get_time();
+    codec.decode(packet, size, pcm, BUFFER_SAMPLES);
+    run->encode_us += encoded - start;
+    run->decode_us += esp_timer_get_time() - encoded;
+  }
+
+  oai_mem_free(pcm);
+  oai_mem_free(packet);
+  xTaskNotifyGive(run->caller);
+  vTaskSuspend(nullptr);
+}
+
+const char *placement_name(OaiMemPlacement placement) {
+  return placement == OaiMemPlacement::kPsramOnly ? "PSRAM" : "SRAM ";
+}
+
+}  // namespace
+
+void oai_mem_benchmark() {
+  constexpr OaiMemPlacement kPlacements[] = {OaiMemPlacement::kHot,
+                                             OaiMemPlacement::kPsramOnly};
+  for (OaiMemPlacement stack : kPlacements) {
+    for (OaiMemPlacement state : kPlacements) {
+      StackType_t *stack_memory = (StackType_t *)oai_mem_alloc(
+          kStackSize * sizeof(StackType_t), stack);
+      StaticTask_t *task_buffer = (StaticTask_t *)heap_caps_malloc(
+          sizeof(StaticTask_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+      if (stack_memory == nullptr || task_buffer == nullptr) {
+        ESP_LOGE(TAG, "Out of memory for the benchmark task");
+        oai_mem_free(stack_memory);
+        heap_caps_free(task_buffer);
+        return;
+      }
+
+      // Same priority and core as the audio publisher.
+      BenchRun run = {state, xTaskGetCurrentTaskHandle(), false, 0, 0};
+      TaskHandle_t task = xTaskCreateStaticPinnedToCore(
+          bench_task, "mem_bench", kStackSize, &run, 7, stack_memory,
+          task_buffer, 0);
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      vTaskDelete(task);
+      oai_mem_free(stack_memory);
+      heap_caps_free(task_buffer);
+
+      if (!run.ok) {
+        ESP_LOGE(TAG, "Benchmark run failed");
+        continue;
+      }
+      constexpr int frames = CONFIG_MEM_BENCHMARK_FRAMES;
+      ESP_LOGI(TAG,
+               "stack %s | codec state %s | encode %lld us/frame | decode "
+               "%lld us/frame",
+               placement_name(stack), placement_name(state),
+               (long long)(run.encode_us / frames),
+               (long long)(run.decode_us / frames));
+    }
+  }
+}
+#endif  // CONFIG_MEM_BENCHMARK
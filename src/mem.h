@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory placement policy.
+//
+// Hot data is touched every audio frame: the stacks of tasks that run the
+// codecs, codec state and audio buffers. It stays in internal SRAM, because
+// every PSRAM access that misses the cache goes over the SPI bus. Cold data
+// is touched once per session or less, e.g. SDP buffers, and goes to PSRAM
+// when the board has it, leaving the internal SRAM to the hot data. Either
+// falls back to the other region rather than failing.
+
+enum class OaiMemPlacement : uint8_t {
+  kHot,
+  kCold,
+  // PSRAM only, to measure what a hot allocation would cost there.
+  kPsramOnly,
+};
+
+void *oai_mem_alloc(size_t size, OaiMemPlacement placement);
+void oai_mem_free(void *ptr);
+
+#ifdef CONFIG_MEM_BENCHMARK
+// Runs the Opus encoder and decoder with the task stack and the codec state
+// in internal SRAM and in PSRAM and logs the time per frame of each
+// combination.
+void oai_mem_benchmark();
+#endif  // CONFIG_MEM_BENCHMARK
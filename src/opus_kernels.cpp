@@ -0,0 +1,283 @@
+#include "opus_kernels.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+#include <atomic>
+
+#ifdef CONFIG_OPUS_KERNELS_CHECK
+#include <stdlib.h>
+#endif
+
+namespace {
+
+constexpr const char *TAG = "opus_kernels";
+
+// Below this length the call into the vector loop costs more than it saves.
+constexpr int kMinVectorLength = 16;
+
+std::atomic<bool> s_vector{true};
+// Bumped with a plain load and store rather than an atomic add, which would
+// cost more than the short kernels. Increments racing between the cores can
+// get lost, that is fine for telling whether the hooks are taken.
+std::atomic<uint32_t> s_calls{0};
+
+inline void count_call() {
+  s_calls.store(s_calls.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+}
+
+// libopus' MAC16_16, with the wrap of its int32 accumulators made explicit.
+inline int32_t mac(int32_t sum, int16_t a, int16_t b) {
+  return (int32_t)((uint32_t)sum + (uint32_t)((int32_t)a * b));
+}
+
+int32_t dot_c(const int16_t *x, const int16_t *y, int n) {
+  int32_t sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum = mac(sum, x[i], y[i]);
+  }
+  return sum;
+}
+
+#ifdef CONFIG_IDF_TARGET_ESP32S3
+// Sum of x[i] * y[i] over blocks * 8 samples. Both pointers may have any
+// 2-byte alignment: each 16-byte load is stitched with the one before it
+// by ee.src.q.qup, which shifts by the alignment ee.ld.128.usar.ip left in
+// SAR_BYTE. The loads stay within the first (blocks + 1) * 8 samples.
+//
+// Never inlined: loopgtz takes over LBEG, LEND and LCOUNT, which the asm
+// does not save, and GCC may turn a caller's counted loop, such as the one
+// in pitch_xcorr_vector, into a hardware loop of its own. The call keeps
+// the two apart, as in ESP-DSP, whose loops live in .S files.
+__attribute__((noinline)) int32_t dot_blocks(const int16_t *x,
+                                             const int16_t *y, int blocks) {
+  int32_t sum;
+  asm volatile(
+      "ee.zero.accx\n"
+      "ee.ld.128.usar.ip q0, %[x], 16\n"
+      "ee.ld.128.usar.ip q2, %[y], 16\n"
+      "loopgtz %[blocks], 1f\n"
+      "ee.ld.128.usar.ip q1, %[x], 16\n"
+      "ee.src.q.qup q4, q0, q1\n"
+      "ee.ld.128.usar.ip q3, %[y], 16\n"
+      "ee.src.q.qup q5, q2, q3\n"
+      "ee.vmulas.s16.accx q4, q5\n"
+      "1:\n"
+      "rur.accx_0 %[sum]\n"
+      : [sum] "=r"(sum), [x] "+r"(x), [y] "+r"(y)
+      : [blocks] "r"(blocks)
+      : "memory");
+  return sum;
+}
+#else
+// The lanes of ee.vmulas.s16.accx, one at a time.
+int32_t dot_blocks(const int16_t *x, const int16_t *y, int blocks) {
+  int32_t sum = 0;
+  for (int b = 0; b < blocks; b++, x += 8, y += 8) {
+    for (int lane = 0; lane < 8; lane++) {
+      sum = mac(sum, x[lane], y[lane]);
+    }
+  }
+  return sum;
+}
+#endif  // CONFIG_IDF_TARGET_ESP32S3
+
+// The vector loop runs one block short so that its lookahead load never
+// leaves the vectors; the remaining 8 to 15 samples are summed in C.
+int32_t dot_vector(const int16_t *x, const int16_t *y, int n) {
+  int blocks = n / 8 - 1;
+  int done = blocks * 8;
+  int32_t sum = dot_blocks(x, y, blocks);
+  for (int i = done; i < n; i++) {
+    sum = mac(sum, x[i], y[i]);
+  }
+  return sum;
+}
+
+void xcorr_kernel_c(const int16_t *x, const int16_t *y, int32_t sum[4],
+                    int len) {
+  for (int i = 0; i < len; i++) {
+    for (int k = 0; k < 4; k++) {
+      sum[k] = mac(sum[k], x[i], y[i + k]);
+    }
+  }
+}
+
+void dual_inner_prod_c(const int16_t *x, const int16_t *y01,
+                       const int16_t *y02, int n, int32_t *xy1,
+                       int32_t *xy2) {
+  *xy1 = dot_c(x, y01, n);
+  *xy2 = dot_c(x, y02, n);
+}
+
+int32_t pitch_xcorr_c(const int16_t *x, const int16_t *y, int32_t *xcorr,
+                      int len, int max_pitch) {
+  int32_t maxcorr = 1;
+  for (int i = 0; i < max_pitch; i++) {
+    int32_t sum[4] = {0, 0, 0, 0};
+    if (i + 3 < max_pitch) {
+      xcorr_kernel_c(x, y + i, sum, len);
+      for (int k = 0; k < 4; k++) {
+        xcorr[i + k] = sum[k];
+        maxcorr = std::max(maxcorr, sum[k]);
+      }
+      i += 3;
+    } else {
+      xcorr[i] = dot_c(x, y + i, len);
+      maxcorr = std::max(maxcorr, xcorr[i]);
+    }
+  }
+  return maxcorr;
+}
+
+void xcorr_kernel_vector(const int16_t *x, const int16_t *y, int32_t sum[4],
+                         int len) {
+  for (int k = 0; k < 4; k++) {
+    sum[k] = (int32_t)((uint32_t)sum[k] + (uint32_t)dot_vector(x, y + k, len));
+  }
+}
+
+int32_t pitch_xcorr_vector(const int16_t *x, const int16_t *y, int32_t *xcorr,
+                           int len, int max_pitch) {
+  int32_t maxcorr = 1;
+  for (int i = 0; i < max_pitch; i++) {
+    xcorr[i] = dot_vector(x, y + i, len);
+    maxcorr = std::max(maxcorr, xcorr[i]);
+  }
+  return maxcorr;
+}
+
+inline bool use_vector(int n) {
+  return n >= kMinVectorLength && s_vector.load(std::memory_order_relaxed);
+}
+
+#ifdef CONFIG_OPUS_KERNELS_CHECK
+constexpr int kCheckLengths[] = {16, 17, 23, 24, 31, 40, 63, 64, 80, 97, 160,
+                                 240, 320, 481};
+constexpr int kCheckMaxPitch = 37;
+// Room for the longest vector, every offset and the pitch search.
+constexpr int kCheckBuffer = 481 + 8 + kCheckMaxPitch + 4;
+
+void fill(int16_t *v, int n) {
+  for (int i = 0; i < n; i++) {
+    v[i] = (int16_t)(rand() & 0xffff);
+  }
+}
+
+// Runs both kernels on x[xo..] and y[yo..] with every length, false and a
+// log line on the first difference.
+bool check_case(const int16_t *xb, const int16_t *yb, int xo, int yo) {
+  const int16_t *x = xb + xo;
+  const int16_t *y = yb + yo;
+  for (int len : kCheckLengths) {
+    int32_t want = dot_c(x, y, len);
+    int32_t got = dot_vector(x, y, len);
+    if (got != want) {
+      ESP_LOGE(TAG, "inner_prod len %d offsets %d/%d: %ld, expected %ld",
+               len, xo, yo, (long)got, (long)want);
+      return false;
+    }
+
+    int32_t want_sum[4] = {1, -1, 1 << 30, -(1 << 30)};
+    int32_t got_sum[4] = {1, -1, 1 << 30, -(1 << 30)};
+    xcorr_kernel_c(x, y, want_sum, len);
+    xcorr_kernel_vector(x, y, got_sum, len);
+    if (!std::equal(want_sum, want_sum + 4, got_sum)) {
+      ESP_LOGE(TAG, "xcorr_kernel len %d offsets %d/%d differs", len, xo, yo);
+      return false;
+    }
+
+    int32_t want_xcorr[kCheckMaxPitch];
+    int32_t got_xcorr[kCheckMaxPitch];
+    int32_t want_max = pitch_xcorr_c(x, y, want_xcorr, len, kCheckMaxPitch);
+    int32_t got_max =
+        pitch_xcorr_vector(x, y, got_xcorr, len, kCheckMaxPitch);
+    if (got_max != want_max ||
+        !std::equal(want_xcorr, want_xcorr + kCheckMaxPitch, got_xcorr)) {
+      ESP_LOGE(TAG, "pitch_xcorr len %d offsets %d/%d differs", len, xo, yo);
+      return false;
+    }
+  }
+  return true;
+}
+#endif  // CONFIG_OPUS_KERNELS_CHECK
+
+}  // namespace
+
+void oai_opus_xcorr_kernel(const int16_t *x, const int16_t *y, int32_t sum[4],
+                           int len) {
+  count_call();
+  if (use_vector(len)) {
+    xcorr_kernel_vector(x, y, sum, len);
+  } else {
+    xcorr_kernel_c(x, y, sum, len);
+  }
+}
+
+int32_t oai_opus_inner_prod(const int16_t *x, const int16_t *y, int n) {
+  count_call();
+  return use_vector(n) ? dot_vector(x, y, n) : dot_c(x, y, n);
+}
+
+void oai_opus_dual_inner_prod(const int16_t *x, const int16_t *y01,
+                              const int16_t *y02, int n, int32_t *xy1,
+                              int32_t *xy2) {
+  count_call();
+  if (use_vector(n)) {
+    *xy1 = dot_vector(x, y01, n);
+    *xy2 = dot_vector(x, y02, n);
+  } else {
+    dual_inner_prod_c(x, y01, y02, n, xy1, xy2);
+  }
+}
+
+int32_t oai_opus_pitch_xcorr(const int16_t *x, const int16_t *y,
+                             int32_t *xcorr, int len, int max_pitch) {
+  count_call();
+  if (use_vector(len)) {
+    return pitch_xcorr_vector(x, y, xcorr, len, max_pitch);
+  }
+  return pitch_xcorr_c(x, y, xcorr, len, max_pitch);
+}
+
+void oai_opus_kernels_use_vector(bool vector) {
+  s_vector.store(vector, std::memory_order_relaxed);
+}
+
+bool oai_opus_kernels_vector(void) {
+  return s_vector.load(std::memory_order_relaxed);
+}
+
+uint32_t oai_opus_kernels_calls(void) {
+  return s_calls.load(std::memory_order_relaxed);
+}
+
+#ifdef CONFIG_OPUS_KERNELS_CHECK
+bool oai_opus_kernels_check(void) {
+  static int16_t x[kCheckBuffer];
+  static int16_t y[kCheckBuffer];
+  srand(1);
+  int cases = 0;
+  // Full-scale noise first, then the extremes that overflow the sums.
+  for (int pass = 0; pass < 3; pass++) {
+    if (pass == 0) {
+      fill(x, kCheckBuffer);
+      fill(y, kCheckBuffer);
+    } else {
+      std::fill(x, x + kCheckBuffer, INT16_MIN);
+      std::fill(y, y + kCheckBuffer, pass == 1 ? INT16_MIN : INT16_MAX);
+    }
+    for (int xo = 0; xo < 8; xo++) {
+      for (int yo = 0; yo < 8; yo++) {
+        if (!check_case(x, y, xo, yo)) {
+          return false;
+        }
+        cases++;
+      }
+    }
+  }
+  ESP_LOGI(TAG, "Vector kernels match the C reference in %d cases", cases);
+  return true;
+}
+#endif  // CONFIG_OPUS_KERNELS_CHECK
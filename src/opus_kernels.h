@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Fixed-point Opus correlation kernels for the ESP32-S3 vector unit (PIE).
+//
+// libopus picks architecture specific kernels at compile time: defining
+// OVERRIDE_<KERNEL> and a macro of the kernel's name replaces the C version.
+// With CONFIG_OPUS_KERNELS_ESP32S3 this header is force-included into
+// esp-libopus (see CMakeLists.txt) and routes the correlation kernels, which
+// the pitch analysis of CELT and SILK and the CELT FIR and IIR filters are
+// built on, to the functions below. libopus must be built fixed-point; the
+// float kernels take float pointers and fail to compile against these.
+//
+// The vector unit multiplies eight pairs of 16-bit samples per instruction
+// into a 40-bit accumulator. Its low 32 bits are the int32 sum libopus
+// computes, so the results are bit-exact. Off the ESP32-S3 the same block
+// structure runs in plain C, which is what the Linux build checks.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// sum[k] += x[i] * y[i + k] for k in 0..3. Reads y[0..len + 2].
+void oai_opus_xcorr_kernel(const int16_t *x, const int16_t *y, int32_t sum[4],
+                           int len);
+int32_t oai_opus_inner_prod(const int16_t *x, const int16_t *y, int n);
+void oai_opus_dual_inner_prod(const int16_t *x, const int16_t *y01,
+                              const int16_t *y02, int n, int32_t *xy1,
+                              int32_t *xy2);
+// xcorr[k] = x . y[k..] for k below max_pitch. Returns the largest value, at
+// least 1.
+int32_t oai_opus_pitch_xcorr(const int16_t *x, const int16_t *y,
+                             int32_t *xcorr, int len, int max_pitch);
+
+// Switches between the vector kernels (default) and the C reference, for
+// the codec benchmark and as a fallback when the check fails.
+void oai_opus_kernels_use_vector(bool vector);
+bool oai_opus_kernels_vector(void);
+
+// Number of kernel calls made through the libopus hooks, approximately.
+// Stays 0 if the override never reached libopus.
+uint32_t oai_opus_kernels_calls(void);
+
+// Compares the vector kernels with the C reference on random input, with
+// every alignment. Returns false on the first mismatch.
+bool oai_opus_kernels_check(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+// Set next to the forced include. Not OPUS_BUILD or FIXED_POINT, which a
+// libopus config.h may only define after this header.
+#ifdef OAI_OPUS_KERNELS_OVERRIDE
+#define OVERRIDE_XCORR_KERNEL
+#define xcorr_kernel(x, y, sum, len, arch) \
+  ((void)(arch), oai_opus_xcorr_kernel(x, y, sum, len))
+#define OVERRIDE_CELT_INNER_PROD
+#define celt_inner_prod(x, y, N, arch) \
+  ((void)(arch), oai_opus_inner_prod(x, y, N))
+#define OVERRIDE_DUAL_INNER_PROD
+#define dual_inner_prod(x, y01, y02, N, xy1, xy2, arch) \
+  ((void)(arch), oai_opus_dual_inner_prod(x, y01, y02, N, xy1, xy2))
+#define OVERRIDE_PITCH_XCORR
+#define celt_pitch_xcorr(x, y, xcorr, len, max_pitch, arch) \
+  ((void)(arch), oai_opus_pitch_xcorr(x, y, xcorr, len, max_pitch))
+#endif  // OAI_OPUS_KERNELS_OVERRIDE
@@ -0,0 +1,137 @@
+#include "peer_wait.h"
+
+#include <esp_log.h>
+#include <sys/select.h>
+#include <unistd.h>
+#ifndef LINUX_BUILD
+#include <esp_vfs_eventfd.h>
+#else
+#include <sys/eventfd.h>
+#endif
+
+#include <algorithm>
+#include <iterator>
+
+constexpr const char *TAG = "peer_wait";
+
+namespace {
+
+// One socket per address family, with room for a session being torn down.
+int s_sockets[4] = {-1, -1, -1, -1};
+int s_event_fd = -1;
+
+void add_socket(int fd) {
+  for (int &slot : s_sockets) {
+    if (slot < 0) {
+      slot = fd;
+      return;
+    }
+  }
+  ESP_LOGW(TAG, "Too many libpeer sockets, fd %d is not watched", fd);
+}
+
+void remove_socket(int fd) {
+  for (int &slot : s_sockets) {
+    if (slot == fd) {
+      slot = -1;
+    }
+  }
+}
+
+}  // namespace
+
+// libpeer's UdpSocket starts with the socket descriptor, the rest is not
+// touched here.
+struct UdpSocket {
+  int fd;
+};
+
+extern "C" {
+int __real_udp_socket_open(UdpSocket *udp_socket, int family, int port);
+void __real_udp_socket_close(UdpSocket *udp_socket);
+
+int __wrap_udp_socket_open(UdpSocket *udp_socket, int family, int port) {
+  int ret = __real_udp_socket_open(udp_socket, family, port);
+  if (ret >= 0 && udp_socket->fd >= 0) {
+    add_socket(udp_socket->fd);
+  }
+  return ret;
+}
+
+void __wrap_udp_socket_close(UdpSocket *udp_socket) {
+  remove_socket(udp_socket->fd);
+  __real_udp_socket_close(udp_socket);
+}
+}  // extern "C"
+
+void oai_peer_wait_init() {
+#ifndef LINUX_BUILD
+  esp_vfs_eventfd_config_t config = {.max_fds = 1};
+  if (esp_err_t err = esp_vfs_eventfd_register(&config);
+      err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+    ESP_LOGE(TAG, "Failed to register eventfd: %s", esp_err_to_name(err));
+    return;
+  }
+  s_event_fd = eventfd(0, 0);
+#else
+  s_event_fd = eventfd(0, EFD_NONBLOCK);
+#endif
+  if (s_event_fd < 0) {
+    ESP_LOGE(TAG, "Failed to create the wakeup eventfd");
+  }
+}
+
+void oai_peer_wait_notify() {
+  if (s_event_fd < 0) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(s_event_fd, &one, sizeof(one)) != sizeof(one)) {
+    ESP_LOGW(TAG, "Failed to signal the peer loop");
+  }
+}
+
+OaiPeerWake oai_peer_wait(uint32_t timeout_ms, bool watch_sockets) {
+  fd_set fds;
+  FD_ZERO(&fds);
+  int max_fd = -1;
+  if (s_event_fd >= 0) {
+    FD_SET(s_event_fd, &fds);
+    max_fd = s_event_fd;
+  }
+  if (watch_sockets) {
+    for (int fd : s_sockets) {
+      if (fd >= 0) {
+        FD_SET(fd, &fds);
+        max_fd = std::max(max_fd, fd);
+      }
+    }
+  }
+
+  timeval timeout = {
+      .tv_sec = (time_t)(timeout_ms / 1000),
+      .tv_usec = (suseconds_t)(timeout_ms % 1000 * 1000),
+  };
+  int ready = select(max_fd + 1, &fds, nullptr, nullptr, &timeout);
+  if (ready <= 0) {
+    if (ready < 0) {
+      // A descriptor closed behind our back fails select(), keep the timer
+      // cadence until the session is torn down.
+      usleep(timeout_ms * 1000);
+    }
+    return OaiPeerWake::kTimeout;
+  }
+  if (s_event_fd >= 0 && FD_ISSET(s_event_fd, &fds)) {
+    uint64_t count;
+    if (read(s_event_fd, &count, sizeof(count)) != sizeof(count)) {
+      ESP_LOGW(TAG, "Failed to clear the peer loop wakeup");
+    }
+    return OaiPeerWake::kNotified;
+  }
+  return OaiPeerWake::kInbound;
+}
+
+int oai_peer_wait_sockets() {
+  return std::count_if(std::begin(s_sockets), std::end(s_sockets),
+                       [](int fd) { return fd >= 0; });
+}
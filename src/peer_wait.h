@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+// Blocks the peer loop until there is work for it.
+//
+// libpeer keeps its ICE sockets private, so their creation and teardown are
+// wrapped at link time (see CMakeLists.txt) to learn the descriptors. The
+// loop select()s on them together with an eventfd that the other tasks
+// signal, and only times out for libpeer's and the application's own timers.
+
+enum class OaiPeerWake {
+  kTimeout,
+  // oai_peer_wait_notify() was called.
+  kNotified,
+  // A libpeer socket has a packet to read.
+  kInbound,
+};
+
+void oai_peer_wait_init();
+// Wakes the peer loop. Safe to call from any task.
+void oai_peer_wait_notify();
+// Blocks for up to timeout_ms. The libpeer sockets are only watched with
+// watch_sockets set, i.e. while peer_connection_loop() reads them.
+OaiPeerWake oai_peer_wait(uint32_t timeout_ms, bool watch_sockets);
+// Number of libpeer sockets currently watched.
+int oai_peer_wait_sockets();
@@ -0,0 +1,376 @@
+#include "playback.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "codec.h"
+#include "mem.h"
+
+constexpr const char *TAG = "playback";
+
+namespace {
+
+// 512 ms at 8 kHz, a power of two.
+constexpr uint32_t kRingSamples = 4096;
+constexpr size_t kChunkSamples = SAMPLE_RATE / 100;
+constexpr uint32_t kTargetSamples =
+    SAMPLE_RATE * CONFIG_PLAYBACK_TARGET_MS / 1000;
+// Silence after which the task stops feeding I2S and waits for audio.
+constexpr int64_t kIdleUs = 200000;
+constexpr int64_t kStatsIntervalUs = 10000000;
+constexpr uint32_t kRtpClockRate = AUDIO_RTP_CLOCK_RATE;
+
+// Queue error to correction, in ppm per ms and ppm per ms*s. The measured
+// drift is fed forward, the controller only trims what is left.
+constexpr float kKp = 20.0f;
+constexpr float kKi = 2.0f;
+#ifdef CONFIG_PLAYBACK_DRIFT_COMPENSATION
+constexpr float kMaxPpm = CONFIG_PLAYBACK_MAX_CORRECTION_PPM;
+#endif
+
+// Rate of a media clock against esp_timer, in ppm. Network and scheduling
+// delays only ever add to the offset between the two, so the lowest offset of
+// each window is compared with the one at the start of the run, which cancels
+// most of the jitter. Runs end when the media clock jumps, their estimates
+// are averaged weighted by their length.
+class ClockEstimator {
+ public:
+  void add(int64_t local_us, int64_t media_us) {
+    int64_t offset = local_us - media_us;
+    if (window_start_us_ != 0 &&
+        llabs(offset - last_offset_) > kDiscontinuityUs) {
+      restart();
+    }
+    last_offset_ = offset;
+    if (window_start_us_ == 0) {
+      window_start_us_ = local_us;
+      window_min_ = offset;
+      return;
+    }
+    window_min_ = std::min(window_min_, offset);
+    if (local_us - window_start_us_ < kWindowUs) {
+      return;
+    }
+
+    if (run_start_us_ == 0) {
+      run_start_us_ = local_us;
+      run_min_ = window_min_;
+    } else if (local_us - run_start_us_ >= kMinSpanUs) {
+      run_span_us_ = local_us - run_start_us_;
+      // A faster media clock makes the offset shrink.
+      run_ppm_ = -(float)(window_min_ - run_min_) * 1e6f / run_span_us_;
+      ppm_ = (prior_ppm_ * prior_us_ + run_ppm_ * run_span_us_) /
+             (prior_us_ + run_span_us_);
+      valid_ = true;
+    }
+    window_start_us_ = local_us;
+    window_min_ = offset;
+  }
+
+  void restart() {
+    if (run_span_us_ > 0) {
+      prior_ppm_ = ppm_;
+      prior_us_ = std::min<float>(prior_us_ + run_span_us_, kMaxPriorUs);
+    }
+    window_start_us_ = 0;
+    run_start_us_ = 0;
+    run_span_us_ = 0;
+  }
+
+  bool valid() const { return valid_; }
+  float ppm() const { return ppm_; }
+
+ private:
+  static constexpr int64_t kWindowUs = 2000000;
+  static constexpr int64_t kMinSpanUs = 10000000;
+  static constexpr int64_t kDiscontinuityUs = 200000;
+  // Older runs stop outweighing the current one after five minutes.
+  static constexpr float kMaxPriorUs = 300e6f;
+
+  int64_t last_offset_ = 0;
+  int64_t window_start_us_ = 0;
+  int64_t window_min_ = 0;
+  int64_t run_start_us_ = 0;
+  int64_t run_min_ = 0;
+  int64_t run_span_us_ = 0;
+  float run_ppm_ = 0;
+  float prior_ppm_ = 0;
+  float prior_us_ = 0;
+  float ppm_ = 0;
+  bool valid_ = false;
+};
+
+// Single producer, single consumer ring of samples. Positions run freely and
+// are taken modulo the ring size, which divides 2^32.
+class Ring {
+ public:
+  bool init() {
+    data_ = (int16_t *)oai_mem_alloc(kRingSamples * sizeof(int16_t),
+                                     OaiMemPlacement::kHot);
+    return data_ != nullptr;
+  }
+
+  uint32_t size() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_acquire);
+  }
+
+  bool push(const int16_t *samples, size_t count) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    if (head + count - tail > kRingSamples) {
+      return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+      data_[(head + i) % kRingSamples] = samples[i];
+    }
+    head_.store(head + count, std::memory_order_release);
+    return true;
+  }
+
+  size_t pop(int16_t *samples, size_t max) {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    uint32_t head = head_.load(std::memory_order_acquire);
+    size_t count = std::min<size_t>(max, head - tail);
+    for (size_t i = 0; i < count; i++) {
+      samples[i] = data_[(tail + i) % kRingSamples];
+    }
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+ private:
+  int16_t *data_ = nullptr;
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+};
+
+// Linear interpolation between consecutive samples. A step of more than one
+// input sample per output sample shortens the audio, less stretches it.
+class Resampler {
+ public:
+  void reset() {
+    prev_ = 0;
+    pos_ = 0;
+  }
+
+  // Returns the number of samples written to out, at most
+  // count / step + 1.
+  size_t process(const int16_t *in, size_t count, int16_t *out, float step) {
+    size_t written = 0;
+    // Position -1 is the last sample of the previous call.
+    while (pos_ < (float)count - 1) {
+      int i = (int)(pos_ + 1) - 1;
+      float frac = pos_ - i;
+      float a = i < 0 ? prev_ : in[i];
+      float b = in[i + 1];
+      out[written++] = (int16_t)(a + (b - a) * frac);
+      pos_ += step;
+    }
+    pos_ -= count;
+    prev_ = in[count - 1];
+    return written;
+  }
+
+ private:
+  int16_t prev_ = 0;
+  float pos_ = 0;
+};
+
+OaiPlaybackSink s_sink = nullptr;
+TaskHandle_t s_task = nullptr;
+Ring s_ring;
+std::atomic<bool> s_playing{false};
+std::atomic<bool> s_waiting{false};
+std::atomic<uint32_t> s_underruns{0};
+std::atomic<uint32_t> s_overflows{0};
+
+// Estimated by the peer loop and the playback task, applied by the peer loop.
+ClockEstimator s_remote_clock;
+ClockEstimator s_local_clock;
+std::atomic<float> s_remote_ppm{0};
+std::atomic<float> s_local_ppm{0};
+std::atomic<float> s_correction_ppm{0};
+
+// Only touched by the peer loop.
+Resampler s_resampler;
+uint32_t s_last_rtp_timestamp = 0;
+int64_t s_rtp_media_units = -1;
+int64_t s_last_write_us = 0;
+float s_error_ms = 0;
+float s_error_integral = 0;
+
+float drift_ppm() {
+  // Positive when the remote produces faster than the speaker consumes.
+  return s_remote_ppm.load() - s_local_ppm.load();
+}
+
+// Returns the input samples to advance per output sample.
+float update_step(int64_t now) {
+  float dt = std::min<int64_t>(now - s_last_write_us, kIdleUs) / 1e6f;
+  s_last_write_us = now;
+  if (!s_playing) {
+    // The queue fills up to its target before the task starts, that is not
+    // an error to correct.
+    return 1.0f;
+  }
+
+  float error_ms =
+      ((float)s_ring.size() - (float)kTargetSamples) * 1000.0f / SAMPLE_RATE;
+  s_error_ms += (error_ms - s_error_ms) / 8;
+#ifdef CONFIG_PLAYBACK_DRIFT_COMPENSATION
+  s_error_integral = std::clamp(s_error_integral + s_error_ms * dt,
+                                -kMaxPpm / kKi, kMaxPpm / kKi);
+  float ppm = std::clamp(drift_ppm() + kKp * s_error_ms +
+                             kKi * s_error_integral,
+                         -kMaxPpm, kMaxPpm);
+  s_correction_ppm = ppm;
+  return 1.0f + ppm * 1e-6f;
+#else
+  (void)dt;
+  return 1.0f;
+#endif
+}
+
+void log_stats() {
+  ESP_LOGI(TAG,
+           "queue %lu ms (target %d) | drift %+.1f ppm (rtp %+.1f, i2s "
+           "%+.1f) | correction %+.1f ppm | %lu underruns, %lu overflows",
+           (unsigned long)(s_ring.size() * 1000 / SAMPLE_RATE),
+           CONFIG_PLAYBACK_TARGET_MS, drift_ppm(), s_remote_ppm.load(),
+           s_local_ppm.load(), s_correction_ppm.load(),
+           (unsigned long)s_underruns.load(),
+           (unsigned long)s_overflows.load());
+}
+
+void playback_task(void *arg) {
+  static int16_t chunk[kChunkSamples];
+  int64_t samples_played = 0;
+  int64_t last_audio_us = 0;
+  int64_t next_stats_us = 0;
+  bool gap = false;
+
+  while (true) {
+    if (!s_playing) {
+      s_waiting = true;
+      if (s_ring.size() == 0) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      }
+      s_waiting = false;
+      // Fill the queue to its target first, so that a packet late by less
+      // than that does not cut the audio.
+      int64_t start_us = esp_timer_get_time();
+      while (s_ring.size() < kTargetSamples &&
+             esp_timer_get_time() - start_us <
+                 CONFIG_PLAYBACK_TARGET_MS * 1000LL) {
+        vTaskDelay(1);
+      }
+      s_playing = true;
+      last_audio_us = esp_timer_get_time();
+      gap = false;
+    }
+
+    size_t count = s_ring.pop(chunk, kChunkSamples);
+    int64_t now = esp_timer_get_time();
+    if (count > 0) {
+      if (gap) {
+        // Audio resumed after running dry, a real underrun rather than the
+        // end of a response.
+        s_underruns++;
+      }
+      last_audio_us = now;
+    } else if (now - last_audio_us > kIdleUs) {
+      s_playing = false;
+      s_local_clock.restart();
+      continue;
+    }
+    gap = count < kChunkSamples;
+    memset(chunk + count, 0, (kChunkSamples - count) * sizeof(int16_t));
+
+    s_sink(chunk, kChunkSamples);
+    samples_played += kChunkSamples;
+    now = esp_timer_get_time();
+    s_local_clock.add(now, samples_played * 1000000 / SAMPLE_RATE);
+    if (s_local_clock.valid()) {
+      s_local_ppm = s_local_clock.ppm();
+    }
+
+#ifdef CONFIG_PLAYBACK_STATS
+    if (now >= next_stats_us) {
+      next_stats_us = now + kStatsIntervalUs;
+      log_stats();
+    }
+#else
+    (void)next_stats_us;
+#endif
+  }
+}
+
+}  // namespace
+
+void oai_playback_init(OaiPlaybackSink sink) {
+  s_sink = sink;
+  if (!s_ring.init()) {
+    ESP_LOGE(TAG, "Failed to allocate the playback queue");
+    return;
+  }
+  // Above the peer loop, the task only runs to refill the I2S DMA buffers.
+  if (xTaskCreate(playback_task, "playback", 3072, nullptr, 7, &s_task) !=
+      pdPASS) {
+    ESP_LOGE(TAG, "Failed to create the playback task");
+    s_task = nullptr;
+  }
+}
+
+void oai_playback_write(const int16_t *samples, size_t count) {
+  static int16_t resampled[BUFFER_SAMPLES * 2];
+  if (s_task == nullptr || count == 0) {
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  if (now - s_last_write_us > kIdleUs) {
+    s_resampler.reset();
+  }
+  float step = update_step(now);
+
+  const int16_t *out = samples;
+  size_t out_count = count;
+#ifdef CONFIG_PLAYBACK_DRIFT_COMPENSATION
+  if (count <= BUFFER_SAMPLES) {
+    out_count = s_resampler.process(samples, count, resampled, step);
+    out = resampled;
+  }
+#else
+  (void)step;
+  (void)resampled;
+#endif
+  if (!s_ring.push(out, out_count)) {
+    s_overflows++;
+  }
+  if (s_waiting) {
+    xTaskNotifyGive(s_task);
+  }
+}
+
+size_t oai_playback_free() { return kRingSamples - s_ring.size(); }
+
+void oai_playback_rtp(uint32_t timestamp, int64_t arrival_us) {
+  if (s_rtp_media_units < 0) {
+    s_rtp_media_units = 0;
+  } else {
+    s_rtp_media_units += (int32_t)(timestamp - s_last_rtp_timestamp);
+  }
+  s_last_rtp_timestamp = timestamp;
+  s_remote_clock.add(arrival_us,
+                     s_rtp_media_units * 1000000 / kRtpClockRate);
+  if (s_remote_clock.valid()) {
+    s_remote_ppm = s_remote_clock.ppm();
+  }
+}
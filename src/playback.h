@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Speaker playback.
+//
+// Decoded audio is queued in a ring that a playback task drains into I2S, so
+// the peer loop never blocks on the speaker. The speaker runs on the local
+// I2S clock and the remote side produces audio on its own, so the queue
+// drifts. The clock rates are estimated from the RTP timestamps and the I2S
+// consumption, both against esp_timer, and the decoded audio is resampled by
+// a few hundred ppm at most to hold the queue at CONFIG_PLAYBACK_TARGET_MS.
+
+// Writes samples to the speaker, blocking at the I2S rate.
+using OaiPlaybackSink = void (*)(int16_t *samples, size_t count);
+
+void oai_playback_init(OaiPlaybackSink sink);
+
+// Queues decoded samples, called from the peer loop.
+void oai_playback_write(const int16_t *samples, size_t count);
+
+// Free space of the queue in samples. Transports that receive audio faster
+// than real time wait for room instead of overflowing the queue.
+size_t oai_playback_free();
+
+// Timestamp of an inbound RTP packet at its 48 kHz clock, called from the
+// peer loop as packets arrive.
+void oai_playback_rtp(uint32_t timestamp, int64_t arrival_us);
@@ -0,0 +1,240 @@
+#include "power.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+
+#ifdef CONFIG_WIFI_PS_STATS
+#include <M5Unified.h>
+#endif  // CONFIG_WIFI_PS_STATS
+
+constexpr const char *TAG = "power";
+
+namespace {
+
+// A response that never completes does not keep the radio awake forever.
+constexpr int64_t kResponseTimeoutUs = 15000000;
+// Longer gaps end a talk spurt and are not counted as downlink latency.
+constexpr int64_t kTalkSpurtGapUs = 500000;
+constexpr uint32_t kGapBucketsMs[] = {25, 50, 100, 200};
+
+#ifdef CONFIG_WIFI_PS_IDLE_MAX_MODEM
+constexpr wifi_ps_type_t kIdleMode = WIFI_PS_MAX_MODEM;
+#else
+constexpr wifi_ps_type_t kIdleMode = WIFI_PS_MIN_MODEM;
+#endif  // CONFIG_WIFI_PS_IDLE_MAX_MODEM
+
+std::atomic<bool> s_initialized{false};
+std::atomic<bool> s_session_active{false};
+std::atomic<bool> s_speaking{false};
+std::atomic<bool> s_awaiting_response{false};
+std::atomic<int64_t> s_response_requested_us{0};
+std::atomic<int64_t> s_last_activity_us{0};
+
+// Written by the peer loop under s_stats_lock.
+SemaphoreHandle_t s_stats_lock = nullptr;
+StaticSemaphore_t s_stats_lock_buffer;
+OaiPowerState s_state = OaiPowerState::kIdle;
+int64_t s_state_since_us = 0;
+OaiPowerStats s_stats[2];
+int64_t s_current_sum_ma[2];
+int64_t s_last_packet_us = 0;
+
+OaiPowerState desired_state(int64_t now) {
+#if defined(CONFIG_WIFI_PS_POLICY_ALWAYS_AWAKE)
+  return OaiPowerState::kActive;
+#elif defined(CONFIG_WIFI_PS_POLICY_ALWAYS_SLEEP)
+  return OaiPowerState::kIdle;
+#else
+  if (!s_session_active) {
+    return OaiPowerState::kIdle;
+  }
+  if (s_speaking || (s_awaiting_response &&
+                     now - s_response_requested_us < kResponseTimeoutUs)) {
+    return OaiPowerState::kActive;
+  }
+  if (now - s_last_activity_us < CONFIG_WIFI_PS_IDLE_HOLD_MS * 1000LL) {
+    return OaiPowerState::kActive;
+  }
+  return OaiPowerState::kIdle;
+#endif
+}
+
+void apply_state(OaiPowerState state, int64_t now) {
+  esp_err_t err =
+      esp_wifi_set_ps(state == OaiPowerState::kActive ? WIFI_PS_NONE
+                                                      : kIdleMode);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to set Wi-Fi power save: %s", esp_err_to_name(err));
+    return;
+  }
+  ESP_LOGD(TAG, "Wi-Fi power save %s",
+           state == OaiPowerState::kActive ? "off" : "on");
+
+  xSemaphoreTake(s_stats_lock, portMAX_DELAY);
+  s_stats[(int)s_state].residency_us += now - s_state_since_us;
+  s_stats[(int)state].entries++;
+  s_state = state;
+  s_state_since_us = now;
+  xSemaphoreGive(s_stats_lock);
+}
+
+void record_packet_gap(int64_t now) {
+  int64_t last = s_last_packet_us;
+  s_last_packet_us = now;
+  if (last == 0 || now - last >= kTalkSpurtGapUs) {
+    return;
+  }
+
+  uint32_t gap_ms = (now - last) / 1000;
+  size_t bucket = 0;
+  while (bucket < std::size(kGapBucketsMs) && gap_ms >= kGapBucketsMs[bucket]) {
+    bucket++;
+  }
+  xSemaphoreTake(s_stats_lock, portMAX_DELAY);
+  OaiPowerStats &stats = s_stats[(int)s_state];
+  stats.gap_histogram[bucket]++;
+  stats.gap_max_ms = std::max(stats.gap_max_ms, gap_ms);
+  xSemaphoreGive(s_stats_lock);
+}
+
+#ifdef CONFIG_WIFI_PS_STATS
+int64_t s_next_current_sample_us = 0;
+int64_t s_next_log_us = 0;
+
+void sample_current(int64_t now) {
+  if (now < s_next_current_sample_us) {
+    return;
+  }
+  s_next_current_sample_us = now + 1000000;
+  int32_t current_ma = M5.Power.getBatteryCurrent();
+  xSemaphoreTake(s_stats_lock, portMAX_DELAY);
+  s_current_sum_ma[(int)s_state] += current_ma;
+  s_stats[(int)s_state].current_samples++;
+  xSemaphoreGive(s_stats_lock);
+}
+
+void log_stats(int64_t now) {
+  if (now < s_next_log_us) {
+    return;
+  }
+  s_next_log_us = now + CONFIG_WIFI_PS_STATS_INTERVAL_MS * 1000LL;
+  for (OaiPowerState state : {OaiPowerState::kActive, OaiPowerState::kIdle}) {
+    OaiPowerStats stats;
+    oai_power_stats(state, &stats);
+    const uint32_t *gaps = stats.gap_histogram;
+    ESP_LOGI(TAG,
+             "%s: %llu ms, %lu entries | packet gaps <25 %lu <50 %lu <100 %lu "
+             "<200 %lu >=200 %lu, max %lu ms | %ld mA",
+             state == OaiPowerState::kActive ? "awake" : "modem sleep",
+             (unsigned long long)stats.residency_us / 1000,
+             (unsigned long)stats.entries, (unsigned long)gaps[0],
+             (unsigned long)gaps[1], (unsigned long)gaps[2],
+             (unsigned long)gaps[3], (unsigned long)gaps[4],
+             (unsigned long)stats.gap_max_ms, (long)stats.current_avg_ma);
+  }
+}
+#endif  // CONFIG_WIFI_PS_STATS
+
+}  // namespace
+
+void oai_power_init() {
+  s_stats_lock = xSemaphoreCreateMutexStatic(&s_stats_lock_buffer);
+  int64_t now = esp_timer_get_time();
+  s_state = desired_state(now);
+  s_state_since_us = now;
+  s_stats[(int)s_state].entries++;
+  ESP_ERROR_CHECK(esp_wifi_set_ps(
+      s_state == OaiPowerState::kActive ? WIFI_PS_NONE : kIdleMode));
+  s_initialized = true;
+}
+
+void oai_power_session(bool active) {
+  int64_t now = esp_timer_get_time();
+  s_speaking = false;
+  s_awaiting_response = active;
+  s_response_requested_us = now;
+  s_last_activity_us = now;
+  s_session_active = active;
+}
+
+void oai_power_activity(OaiPowerActivity activity) {
+  if (!s_initialized) {
+    return;
+  }
+
+  int64_t now = esp_timer_get_time();
+  s_last_activity_us = now;
+  switch (activity) {
+    case OaiPowerActivity::kSpeechStarted:
+      s_speaking = true;
+      break;
+    case OaiPowerActivity::kSpeechStopped:
+      s_speaking = false;
+      s_awaiting_response = true;
+      s_response_requested_us = now;
+      break;
+    case OaiPowerActivity::kResponseRequested:
+      s_awaiting_response = true;
+      s_response_requested_us = now;
+      break;
+    case OaiPowerActivity::kResponseDone:
+      s_awaiting_response = false;
+      break;
+    case OaiPowerActivity::kPlayback:
+      record_packet_gap(now);
+      break;
+    case OaiPowerActivity::kDataChannel:
+      break;
+  }
+}
+
+void oai_power_poll() {
+  if (!s_initialized) {
+    return;
+  }
+
+  int64_t now = esp_timer_get_time();
+  OaiPowerState state = desired_state(now);
+  if (state != s_state) {
+    apply_state(state, now);
+  }
+#ifdef CONFIG_WIFI_PS_STATS
+  sample_current(now);
+  log_stats(now);
+#endif  // CONFIG_WIFI_PS_STATS
+}
+
+bool oai_power_idle_for(int64_t quiet_us) {
+  int64_t now = esp_timer_get_time();
+  if (s_speaking || (s_awaiting_response &&
+                     now - s_response_requested_us < kResponseTimeoutUs)) {
+    return false;
+  }
+  return now - s_last_activity_us >= quiet_us;
+}
+
+bool oai_power_stats(OaiPowerState state, OaiPowerStats *stats) {
+  if (!s_initialized) {
+    return false;
+  }
+
+  int64_t now = esp_timer_get_time();
+  xSemaphoreTake(s_stats_lock, portMAX_DELAY);
+  *stats = s_stats[(int)state];
+  if (state == s_state) {
+    stats->residency_us += now - s_state_since_us;
+  }
+  stats->current_avg_ma =
+      stats->current_samples
+          ? s_current_sum_ma[(int)state] / (int64_t)stats->current_samples
+          : 0;
+  xSemaphoreGive(s_stats_lock);
+  return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+// Wi-Fi power save policy.
+//
+// Modem sleep adds up to a beacon interval of latency to every downlink
+// packet, which is audible during a conversation but saves current while
+// nothing happens. The radio is kept awake (WIFI_PS_NONE) while the user is
+// speaking, a response is pending or audio is playing, and drops back to
+// modem sleep once the session has been quiet for
+// CONFIG_WIFI_PS_IDLE_HOLD_MS.
+
+enum class OaiPowerActivity : uint8_t {
+  // Server VAD.
+  kSpeechStarted,
+  kSpeechStopped,
+  // response.create sent, until response.done.
+  kResponseRequested,
+  kResponseDone,
+  // An inbound audio packet was handed to the speaker.
+  kPlayback,
+  // An inbound data channel message.
+  kDataChannel,
+};
+
+enum class OaiPowerState : uint8_t {
+  kActive,
+  kIdle,
+};
+
+struct OaiPowerStats {
+  uint64_t residency_us;
+  uint32_t entries;
+  // Inter-arrival gaps of inbound audio packets within a talk spurt, in
+  // buckets of <25, <50, <100, <200 and >=200 ms.
+  uint32_t gap_histogram[5];
+  uint32_t gap_max_ms;
+  // Average battery current, only sampled with CONFIG_WIFI_PS_STATS on
+  // boards with a fuel gauge. Negative while discharging.
+  int32_t current_avg_ma;
+  uint32_t current_samples;
+};
+
+#ifndef LINUX_BUILD
+// Applies the idle mode once Wi-Fi is connected.
+void oai_power_init();
+// Called when a session is created and when it is torn down. Session setup
+// counts as a pending response, so the handshake runs with the radio awake.
+void oai_power_session(bool active);
+// Safe to call from any task.
+void oai_power_activity(OaiPowerActivity activity);
+// Switches the power save mode if needed, called from the peer loop.
+void oai_power_poll();
+bool oai_power_stats(OaiPowerState state, OaiPowerStats *stats);
+// True once nobody has spoken, no response was pending and no audio played
+// for quiet_us.
+bool oai_power_idle_for(int64_t quiet_us);
+#else
+// The Linux build has no radio to manage.
+inline void oai_power_init() {}
+inline void oai_power_session(bool active) {}
+inline void oai_power_activity(OaiPowerActivity activity) {}
+inline void oai_power_poll() {}
+inline bool oai_power_stats(OaiPowerState state, OaiPowerStats *stats) {
+  return false;
+}
+inline bool oai_power_idle_for(int64_t quiet_us) { return false; }
+#endif  // LINUX_BUILD
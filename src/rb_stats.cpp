@@ -0,0 +1,179 @@
+#include "rb_stats.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <peer.h>
+
+#include <algorithm>
+#include <iterator>
+
+constexpr const char *TAG = "rb_stats";
+
+namespace {
+
+// libpeer's own defaults, the baseline the savings are reported against.
+constexpr uint32_t kDefaultBytes = CONFIG_LIBPEER_CONFIG_MTU * (64 + 64) +
+                                   CONFIG_LIBPEER_SCTP_MTU * 128;
+constexpr uint32_t kVideoBytes =
+    CONFIG_LIBPEER_CONFIG_MTU * CONFIG_LIBPEER_VIDEO_RB_DATA_MTUS;
+constexpr uint32_t kAudioBytes =
+    CONFIG_LIBPEER_CONFIG_MTU * CONFIG_LIBPEER_AUDIO_RB_DATA_MTUS;
+constexpr uint32_t kDataBytes =
+    CONFIG_LIBPEER_SCTP_MTU * CONFIG_LIBPEER_DATA_RB_DATA_MTUS;
+// Every item carries its length in front of the payload.
+constexpr uint32_t kItemHeaderBytes = sizeof(int);
+
+// Sizes of the items still queued, oldest first.
+class Ring {
+ public:
+  void push(uint32_t size) {
+    if (count_ == std::size(sizes_)) {
+      // More items than ever fit in a sane buffer, stop tracking sizes.
+      overflow_++;
+    } else {
+      sizes_[(head_ + count_) % std::size(sizes_)] = size;
+      count_++;
+    }
+    bytes_ += size;
+    stats_.peak_bytes = std::max(stats_.peak_bytes, bytes_);
+    stats_.peak_items = std::max(stats_.peak_items, items());
+  }
+
+  void pop() {
+    if (overflow_ > 0) {
+      overflow_--;
+      return;
+    }
+    if (count_ == 0) {
+      return;
+    }
+    bytes_ -= sizes_[head_];
+    head_ = (head_ + 1) % std::size(sizes_);
+    count_--;
+  }
+
+  void drop() { stats_.drops++; }
+
+  void reset(uint32_t capacity) {
+    *this = Ring();
+    stats_.capacity_bytes = capacity;
+  }
+
+  uint32_t items() const { return count_ + overflow_; }
+  const OaiRbStats &stats() const { return stats_; }
+
+ private:
+  uint32_t sizes_[128] = {};
+  uint32_t head_ = 0;
+  uint32_t count_ = 0;
+  uint32_t overflow_ = 0;
+  uint32_t bytes_ = 0;
+  OaiRbStats stats_ = {};
+};
+
+SemaphoreHandle_t s_lock = nullptr;
+StaticSemaphore_t s_lock_buffer;
+Ring s_audio;
+Ring s_data;
+
+int64_t s_next_log_us = 0;
+
+void log_stats() {
+  int64_t now = esp_timer_get_time();
+  if (now < s_next_log_us) {
+    return;
+  }
+  s_next_log_us = now + CONFIG_RB_STATS_INTERVAL_MS * 1000LL;
+  OaiRbStats audio, data;
+  oai_rb_stats_audio(&audio);
+  oai_rb_stats_data(&data);
+  ESP_LOGI(TAG,
+           "audio peak %lu/%lu bytes (%lu items, %lu drops) | data peak "
+           "%lu/%lu bytes (%lu items, %lu drops)",
+           (unsigned long)audio.peak_bytes, (unsigned long)audio.capacity_bytes,
+           (unsigned long)audio.peak_items, (unsigned long)audio.drops,
+           (unsigned long)data.peak_bytes, (unsigned long)data.capacity_bytes,
+           (unsigned long)data.peak_items, (unsigned long)data.drops);
+}
+
+}  // namespace
+
+void oai_rb_stats_init() {
+  s_lock = xSemaphoreCreateMutexStatic(&s_lock_buffer);
+  oai_rb_stats_reset();
+
+  uint32_t total = kVideoBytes + kAudioBytes + kDataBytes;
+  ESP_LOGI(TAG,
+           "libpeer buffers: video %lu, audio %lu, data %lu bytes, %ld bytes "
+           "less than the defaults",
+           (unsigned long)kVideoBytes, (unsigned long)kAudioBytes,
+           (unsigned long)kDataBytes, (long)kDefaultBytes - (long)total);
+}
+
+void oai_rb_stats_reset() {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_audio.reset(kAudioBytes);
+  s_data.reset(kDataBytes);
+  xSemaphoreGive(s_lock);
+}
+
+void oai_rb_stats_audio(OaiRbStats *stats) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  *stats = s_audio.stats();
+  xSemaphoreGive(s_lock);
+}
+
+void oai_rb_stats_data(OaiRbStats *stats) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  *stats = s_data.stats();
+  xSemaphoreGive(s_lock);
+}
+
+// Link-time wrappers of the libpeer calls that fill and drain the buffers.
+extern "C" {
+int __real_peer_connection_send_audio(PeerConnection *pc,
+                                      const uint8_t *packet, size_t bytes);
+int __real_peer_connection_datachannel_send(PeerConnection *pc,
+                                            char *message, size_t len);
+int __real_peer_connection_loop(PeerConnection *pc);
+
+int __wrap_peer_connection_send_audio(PeerConnection *pc,
+                                      const uint8_t *packet, size_t bytes) {
+  int ret = __real_peer_connection_send_audio(pc, packet, bytes);
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (ret < 0) {
+    s_audio.drop();
+  } else {
+    s_audio.push(bytes + kItemHeaderBytes);
+  }
+  xSemaphoreGive(s_lock);
+  return ret;
+}
+
+int __wrap_peer_connection_datachannel_send(PeerConnection *pc,
+                                            char *message, size_t len) {
+  int ret = __real_peer_connection_datachannel_send(pc, message, len);
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (ret < 0) {
+    s_data.drop();
+  } else {
+    s_data.push(len + kItemHeaderBytes);
+  }
+  xSemaphoreGive(s_lock);
+  return ret;
+}
+
+int __wrap_peer_connection_loop(PeerConnection *pc) {
+  int ret = __real_peer_connection_loop(pc);
+  // Nothing is queued before the session is connected, so popping from an
+  // empty buffer during setup is harmless.
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_audio.pop();
+  s_data.pop();
+  xSemaphoreGive(s_lock);
+  log_stats();
+  return ret;
+}
+}  // extern "C"
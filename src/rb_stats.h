@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Occupancy of libpeer's outbound ring buffers.
+//
+// libpeer queues audio packets and data channel messages in ring buffers
+// sized by CONFIG_LIBPEER_*_RB_DATA_MTUS and drains at most one item of each
+// per peer_connection_loop(). The buffers are opaque, so the sends and the
+// loop are wrapped at link time (see CMakeLists.txt) and the occupancy is
+// tracked alongside. The peaks are what the buffer sizes should be chosen
+// from.
+
+struct OaiRbStats {
+  uint32_t capacity_bytes;
+  uint32_t peak_bytes;
+  uint32_t peak_items;
+  // Sends rejected by libpeer, usually because the buffer was full.
+  uint32_t drops;
+};
+
+// Logs the configured buffer sizes and what they save over the libpeer
+// defaults.
+void oai_rb_stats_init();
+void oai_rb_stats_reset();
+void oai_rb_stats_audio(OaiRbStats *stats);
+void oai_rb_stats_data(OaiRbStats *stats);
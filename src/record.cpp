@@ -0,0 +1,190 @@
+#include "record.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "codec.h"
+#include "mem.h"
+
+#ifdef CONFIG_RECORD
+#ifndef LINUX_BUILD
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <stdio.h>
+#endif
+#endif  // CONFIG_RECORD
+
+constexpr const char *TAG = "record";
+
+uint32_t oai_record_checksum(const uint8_t *data, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ data[i]) * 16777619u;
+  }
+  return h;
+}
+
+#ifdef CONFIG_RECORD
+namespace {
+
+// Only touched by the peer loop, until handed to the writer.
+uint8_t *s_buffer = nullptr;
+size_t s_len = 0;
+uint32_t s_records = 0;
+uint32_t s_dropped = 0;
+int64_t s_last_us = 0;
+bool s_recording = false;
+std::atomic<bool> s_writing{false};
+
+#ifndef LINUX_BUILD
+const esp_partition_t *s_partition = nullptr;
+#endif
+
+void append(OaiRecordKind kind, const void *data, size_t len,
+            int64_t arrival_us) {
+  if (!s_recording) {
+    return;
+  }
+  if (len > UINT16_MAX ||
+      s_len + sizeof(OaiRecordEntry) + len > CONFIG_RECORD_BUFFER_SIZE) {
+    s_dropped++;
+    return;
+  }
+  OaiRecordEntry entry = {
+      (uint8_t)kind, 0, (uint16_t)len,
+      (uint32_t)std::max<int64_t>(arrival_us - s_last_us, 0)};
+  s_last_us = arrival_us;
+  memcpy(s_buffer + s_len, &entry, sizeof(entry));
+  memcpy(s_buffer + s_len + sizeof(entry), data, len);
+  s_len += sizeof(entry) + len;
+  s_records++;
+}
+
+OaiRecordHeader make_header() {
+  return {kOaiRecordMagic,
+          kOaiRecordVersion,
+          (uint8_t)AUDIO_CODEC,
+          0,
+          (uint32_t)s_len,
+          s_records,
+          oai_record_checksum(s_buffer, s_len)};
+}
+
+#ifndef LINUX_BUILD
+// Erasing takes tens of milliseconds per sector, too long for the peer loop.
+void write_task(void *arg) {
+  OaiRecordHeader header = make_header();
+  size_t erase_size = (sizeof(header) + s_len + s_partition->erase_size - 1) /
+                      s_partition->erase_size * s_partition->erase_size;
+  // The header goes last, so an interrupted write leaves no valid header.
+  esp_err_t err = esp_partition_erase_range(s_partition, 0, erase_size);
+  if (err == ESP_OK) {
+    err = esp_partition_write(s_partition, sizeof(header), s_buffer, s_len);
+  }
+  if (err == ESP_OK) {
+    err = esp_partition_write(s_partition, 0, &header, sizeof(header));
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to store the recording: %s", esp_err_to_name(err));
+  } else {
+    ESP_LOGI(TAG, "Stored %lu records, %u bytes",
+             (unsigned long)s_records, (unsigned)s_len);
+  }
+  s_writing = false;
+  vTaskDelete(nullptr);
+}
+#else
+void write_file() {
+  OaiRecordHeader header = make_header();
+  FILE *file = fopen(CONFIG_RECORD_FILE, "wb");
+  if (file == nullptr ||
+      fwrite(&header, sizeof(header), 1, file) != 1 ||
+      fwrite(s_buffer, 1, s_len, file) != s_len) {
+    ESP_LOGE(TAG, "Failed to write %s", CONFIG_RECORD_FILE);
+  } else {
+    ESP_LOGI(TAG, "Wrote %lu records, %u bytes to %s",
+             (unsigned long)s_records, (unsigned)s_len, CONFIG_RECORD_FILE);
+  }
+  if (file != nullptr) {
+    fclose(file);
+  }
+  s_writing = false;
+}
+#endif  // LINUX_BUILD
+
+}  // namespace
+
+void oai_record_init() {
+#ifndef LINUX_BUILD
+  s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                         ESP_PARTITION_SUBTYPE_ANY, "record");
+  if (s_partition == nullptr) {
+    ESP_LOGW(TAG, "No record partition, sessions are not recorded");
+    return;
+  }
+  static_assert(CONFIG_RECORD_BUFFER_SIZE >= 4096,
+                "CONFIG_RECORD_BUFFER_SIZE is too small");
+  if (sizeof(OaiRecordHeader) + CONFIG_RECORD_BUFFER_SIZE >
+      s_partition->size) {
+    ESP_LOGE(TAG, "CONFIG_RECORD_BUFFER_SIZE exceeds the record partition");
+    s_partition = nullptr;
+    return;
+  }
+#endif
+  s_buffer = (uint8_t *)oai_mem_alloc(CONFIG_RECORD_BUFFER_SIZE,
+                                      OaiMemPlacement::kCold);
+  if (s_buffer == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate the record buffer");
+  }
+}
+
+void oai_record_begin() {
+  // The previous recording is still being written, skip this session.
+  if (s_buffer == nullptr || s_writing) {
+    return;
+  }
+  s_len = 0;
+  s_records = 0;
+  s_dropped = 0;
+  s_last_us = esp_timer_get_time();
+  s_recording = true;
+}
+
+void oai_record_rtp(const uint8_t *packet, size_t len, int64_t arrival_us) {
+  append(OaiRecordKind::kRtp, packet, len, arrival_us);
+}
+
+void oai_record_event(const char *msg, size_t len, int64_t arrival_us) {
+  append(OaiRecordKind::kEvent, msg, len, arrival_us);
+}
+
+void oai_record_end() {
+  if (!s_recording) {
+    return;
+  }
+  s_recording = false;
+  if (s_records == 0) {
+    return;
+  }
+  if (s_dropped > 0) {
+    ESP_LOGW(TAG, "Buffer full, %lu records dropped",
+             (unsigned long)s_dropped);
+  }
+  s_writing = true;
+#ifndef LINUX_BUILD
+  if (xTaskCreate(write_task, "record_write", 3072, nullptr,
+                  tskIDLE_PRIORITY + 1, nullptr) != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create the record writer");
+    s_writing = false;
+  }
+#else
+  write_file();
+#endif
+}
+#endif  // CONFIG_RECORD
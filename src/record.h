@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Recording of the inbound side of a session, for replay on Linux.
+//
+// Decrypted RTP packets as they leave libsrtp and data channel messages are
+// appended with their arrival time to a RAM buffer, PSRAM if there is any.
+// The buffer is written out when the session ends, to the "record"
+// partition on the device and to CONFIG_RECORD_FILE on Linux, so recording
+// does not touch flash while the session runs.
+//
+// The file is little-endian: an OaiRecordHeader, then header.records
+// entries, each an OaiRecordEntry followed by len bytes.
+
+constexpr uint32_t kOaiRecordMagic = 0x4c50524f;  // "ORPL"
+constexpr uint16_t kOaiRecordVersion = 1;
+
+enum class OaiRecordKind : uint8_t {
+  // A whole RTP packet, header included.
+  kRtp = 1,
+  // A data channel message.
+  kEvent = 2,
+};
+
+struct OaiRecordHeader {
+  uint32_t magic;
+  uint16_t version;
+  // OaiAudioCodecType of the RTP payloads.
+  uint8_t codec;
+  uint8_t reserved;
+  // Bytes of entries after the header.
+  uint32_t bytes;
+  uint32_t records;
+  uint32_t checksum;
+};
+
+struct OaiRecordEntry {
+  uint8_t kind;
+  uint8_t reserved;
+  uint16_t len;
+  // Since the previous entry, or since the session started for the first.
+  uint32_t delta_us;
+};
+
+// FNV-1a of the entries, also used by the replayer.
+uint32_t oai_record_checksum(const uint8_t *data, size_t len);
+
+#ifdef CONFIG_RECORD
+void oai_record_init();
+// Starts a new recording, called when a session is created.
+void oai_record_begin();
+void oai_record_rtp(const uint8_t *packet, size_t len, int64_t arrival_us);
+void oai_record_event(const char *msg, size_t len, int64_t arrival_us);
+// Writes the recording out, called when the session is torn down.
+void oai_record_end();
+#endif  // CONFIG_RECORD
@@ -0,0 +1,201 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+#include "codec.h"
+#include "events.h"
+#include "main.h"
+#include "record.h"
+#include "rtc_stats.h"
+#include "tools.h"
+
+// Linux replay of a session recorded with CONFIG_RECORD. The inbound RTP
+// packets and data channel messages are fed back through the paths the
+// live session takes, rtc_stats, the decoder and the event dispatcher,
+// paced at CONFIG_REPLAY_SPEED_PERCENT of the recorded timing. The time
+// spent in each path and a hash of the decoded audio are logged, so two
+// builds can be compared on the same traffic.
+
+constexpr const char *TAG = "replay";
+
+namespace {
+
+constexpr size_t kRtpHeaderSize = 12;
+
+struct PathStats {
+  uint32_t count = 0;
+  int64_t total_us = 0;
+  int64_t max_us = 0;
+
+  void add(int64_t us) {
+    count++;
+    total_us += us;
+    max_us = std::max(max_us, us);
+  }
+  int64_t average_us() const { return count == 0 ? 0 : total_us / count; }
+};
+
+uint32_t s_sent_events = 0;
+
+// FNV-1a continued over the decoded audio.
+uint32_t hash_pcm(uint32_t hash, const opus_int16 *pcm, size_t samples) {
+  const uint8_t *p = (const uint8_t *)pcm;
+  for (size_t i = 0; i < samples * sizeof(pcm[0]); i++) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+int count_event(const char *data, size_t len) {
+  s_sent_events++;
+  return 0;
+}
+
+// Returns the offset of the payload of an RTP packet, 0 if it is malformed.
+size_t rtp_payload_offset(const uint8_t *p, size_t len) {
+  if (len < kRtpHeaderSize || (p[0] >> 6) != 2) {
+    return 0;
+  }
+  size_t offset = kRtpHeaderSize + 4 * (p[0] & 0x0f);
+  if (p[0] & 0x10) {
+    if (offset + 4 > len) {
+      return 0;
+    }
+    offset += 4 + 4 * (p[offset + 2] << 8 | p[offset + 3]);
+  }
+  return offset < len ? offset : 0;
+}
+
+bool read_recording(std::vector<uint8_t> &entries, OaiRecordHeader *header) {
+  FILE *file = fopen(CONFIG_REPLAY_FILE, "rb");
+  if (file == nullptr) {
+    ESP_LOGE(TAG, "Failed to open %s", CONFIG_REPLAY_FILE);
+    return false;
+  }
+  bool ok = fread(header, sizeof(*header), 1, file) == 1 &&
+            header->magic == kOaiRecordMagic &&
+            header->version == kOaiRecordVersion;
+  if (ok) {
+    entries.resize(header->bytes);
+    ok = fread(entries.data(), 1, entries.size(), file) == entries.size();
+  }
+  fclose(file);
+  if (!ok) {
+    ESP_LOGE(TAG, "%s is not a recording", CONFIG_REPLAY_FILE);
+    return false;
+  }
+  if (oai_record_checksum(entries.data(), entries.size()) !=
+      header->checksum) {
+    ESP_LOGE(TAG, "%s is corrupt", CONFIG_REPLAY_FILE);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool oai_replay() {
+  OaiRecordHeader header;
+  std::vector<uint8_t> entries;
+  if (!read_recording(entries, &header)) {
+    return false;
+  }
+  OaiAudioCodecType type = (OaiAudioCodecType)header.codec;
+  if (type != AUDIO_CODEC) {
+    ESP_LOGW(TAG, "Recorded with %s, jitter assumes %s",
+             oai_audio_codec_name(type), oai_audio_codec_name(AUDIO_CODEC));
+  }
+
+  oai_events_init();
+  oai_rtc_stats_init();
+  oai_tools_start();
+  oai_events_attach(count_event);
+  OaiAudioCodec codec(type);
+  if (!codec.init_decoder()) {
+    return false;
+  }
+
+  PathStats rtp;
+  PathStats events;
+  uint32_t decode_errors = 0;
+  uint32_t pcm_hash = oai_record_checksum(nullptr, 0);
+  // The longest Opus packet, 120 ms.
+  opus_int16 pcm[SAMPLE_RATE * 120 / 1000];
+  int64_t recorded_us = 0;
+  int64_t started_us = esp_timer_get_time();
+
+  size_t pos = 0;
+  for (uint32_t i = 0; i < header.records; i++) {
+    OaiRecordEntry entry;
+    if (pos + sizeof(entry) > entries.size()) {
+      break;
+    }
+    memcpy(&entry, entries.data() + pos, sizeof(entry));
+    const uint8_t *data = entries.data() + pos + sizeof(entry);
+    pos += sizeof(entry) + entry.len;
+    if (pos > entries.size()) {
+      break;
+    }
+    recorded_us += entry.delta_us;
+
+#if CONFIG_REPLAY_SPEED_PERCENT > 0
+    int64_t due_us =
+        started_us + recorded_us * 100 / CONFIG_REPLAY_SPEED_PERCENT;
+    int64_t wait_us = due_us - esp_timer_get_time();
+    if (wait_us > 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+    }
+#endif
+
+    int64_t start = esp_timer_get_time();
+    if (entry.kind == (uint8_t)OaiRecordKind::kRtp) {
+      // The recorded arrival time, so jitter does not depend on the pacing.
+      oai_rtc_stats_inbound_rtp(data, entry.len, recorded_us);
+      size_t offset = rtp_payload_offset(data, entry.len);
+      int samples = offset == 0 ? -1
+                                : codec.decode(data + offset,
+                                               entry.len - offset, pcm,
+                                               std::size(pcm));
+      if (samples < 0) {
+        decode_errors++;
+      } else {
+        pcm_hash = hash_pcm(pcm_hash, pcm, samples);
+      }
+      rtp.add(esp_timer_get_time() - start);
+    } else if (entry.kind == (uint8_t)OaiRecordKind::kEvent) {
+      // Handlers may treat msg as a C string, as the live path does.
+      std::vector<char> msg(data, data + entry.len);
+      msg.push_back('\0');
+      start = esp_timer_get_time();
+      oai_event_dispatch(msg.data(), entry.len);
+      events.add(esp_timer_get_time() - start);
+      oai_events_flush();
+    }
+  }
+  oai_events_flush();
+  int64_t wall_us = esp_timer_get_time() - started_us;
+
+  OaiRtcStats stats = oai_rtc_stats();
+  ESP_LOGI(TAG, "Replayed %lu of %lu records, %lld ms recorded in %lld ms",
+           (unsigned long)(rtp.count + events.count),
+           (unsigned long)header.records, (long long)(recorded_us / 1000),
+           (long long)(wall_us / 1000));
+  ESP_LOGI(TAG, "RTP %lu packets, decode avg %lld us max %lld us, %lu errors",
+           (unsigned long)rtp.count, (long long)rtp.average_us(),
+           (long long)rtp.max_us, (unsigned long)decode_errors);
+  ESP_LOGI(TAG, "Events %lu in, %lu out, dispatch avg %lld us max %lld us",
+           (unsigned long)events.count, (unsigned long)s_sent_events,
+           (long long)events.average_us(), (long long)events.max_us);
+  ESP_LOGI(TAG, "Jitter %lu ms, lost %ld, decoded audio hash %08lx",
+           (unsigned long)stats.jitter_ms, (long)stats.packets_lost,
+           (unsigned long)pcm_hash);
+  oai_events_attach(nullptr);
+  return decode_errors == 0 && pos == entries.size();
+}
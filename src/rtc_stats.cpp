@@ -0,0 +1,440 @@
+#include "rtc_stats.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include "codec.h"
+#ifdef CONFIG_RECORD
+#include "record.h"
+#endif
+#ifndef LINUX_BUILD
+#include "playback.h"
+#endif
+
+constexpr const char *TAG = "rtc_stats";
+
+namespace {
+
+constexpr uint32_t kRtpClockRate = AUDIO_RTP_CLOCK_RATE;
+// RFC 3550 A.1.
+constexpr uint16_t kMaxDropout = 3000;
+constexpr uint16_t kMaxMisorder = 100;
+
+constexpr uint8_t kRtcpSenderReport = 200;
+constexpr uint8_t kRtcpReceiverReport = 201;
+constexpr uint8_t kRtcpTransportFeedback = 205;
+constexpr uint8_t kFeedbackGenericNack = 1;
+constexpr size_t kReportBlockSize = 24;
+
+struct RtpHeader {
+  uint16_t seq;
+  uint32_t timestamp;
+  uint32_t ssrc;
+  size_t payload_size;
+};
+
+// A window sample plus the cumulative counters it was taken at.
+struct WindowEntry {
+  OaiRtcStatsSample sample;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint32_t expected;
+  uint32_t received;
+};
+
+struct SentReport {
+  uint32_t ntp_mid;
+  int64_t time_us;
+};
+
+struct RtcStatsState {
+  OaiRtcStats stats;
+  uint32_t local_ssrc;
+
+  // Inbound sequence tracking, RFC 3550 A.1.
+  bool rx_started;
+  uint16_t max_seq;
+  uint32_t cycles;
+  uint32_t base_seq;
+  // Expected packets before the sender restarted its sequence.
+  uint32_t expected_prior;
+
+  // Interarrival jitter in RTP units times 16, RFC 3550 A.8.
+  bool transit_valid;
+  int32_t transit;
+  uint32_t jitter_q4;
+
+  // Our last sender reports, matched against LSR for the round-trip time.
+  SentReport sent_reports[4];
+  size_t sent_reports_next;
+
+  WindowEntry window[CONFIG_RTC_STATS_WINDOW];
+  size_t window_head;
+  size_t window_count;
+  int64_t next_sample_us;
+};
+
+SemaphoreHandle_t s_lock = nullptr;
+StaticSemaphore_t s_lock_buffer;
+RtcStatsState s_state;
+
+uint16_t read16(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+uint32_t read32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+bool parse_rtp(const uint8_t *p, size_t len, RtpHeader *header) {
+  if (len < 12 || (p[0] >> 6) != 2) {
+    return false;
+  }
+  size_t size = 12 + 4 * (p[0] & 0x0f);
+  if (p[0] & 0x10) {
+    if (len < size + 4) {
+      return false;
+    }
+    size += 4 + 4 * read16(p + size + 2);
+  }
+  size_t padding = (p[0] & 0x20) && len > size ? p[len - 1] : 0;
+  if (len < size + padding) {
+    return false;
+  }
+  header->seq = read16(p + 2);
+  header->timestamp = read32(p + 4);
+  header->ssrc = read32(p + 8);
+  header->payload_size = len - size - padding;
+  return true;
+}
+
+uint32_t expected_packets(const RtcStatsState &s) {
+  if (!s.rx_started) {
+    return s.expected_prior;
+  }
+  return s.expected_prior + s.cycles + s.max_seq - s.base_seq + 1;
+}
+
+void update_seq(RtcStatsState &s, uint16_t seq) {
+  if (!s.rx_started) {
+    s.rx_started = true;
+    s.base_seq = seq;
+    s.max_seq = seq;
+    s.cycles = 0;
+    return;
+  }
+
+  uint16_t delta = seq - s.max_seq;
+  if (delta < kMaxDropout) {
+    if (seq < s.max_seq) {
+      s.cycles += 65536;
+    }
+    s.max_seq = seq;
+  } else if (delta <= (uint16_t)(65536 - kMaxMisorder)) {
+    // The sender jumped, start counting again from here.
+    s.expected_prior = expected_packets(s);
+    s.base_seq = seq;
+    s.max_seq = seq;
+    s.cycles = 0;
+  }
+  // Otherwise a duplicate or reordered packet.
+}
+
+uint32_t jitter_ms(uint32_t rtp_units) {
+  return (uint64_t)rtp_units * 1000 / kRtpClockRate;
+}
+
+uint32_t bitrate(uint64_t bytes, int64_t us) {
+  return us > 0 ? bytes * 8 * 1000000 / us : 0;
+}
+
+const WindowEntry *window_at(const RtcStatsState &s, size_t index) {
+  return &s.window[(s.window_head + index) % std::size(s.window)];
+}
+
+// Appends a sample when the interval has elapsed. Returns true when the
+// window was just completed.
+bool maybe_sample(RtcStatsState &s, int64_t now) {
+  if (now < s.next_sample_us) {
+    return false;
+  }
+  s.next_sample_us = now + CONFIG_RTC_STATS_SAMPLE_INTERVAL_MS * 1000LL;
+
+  WindowEntry entry = {};
+  entry.bytes_sent = s.stats.bytes_sent;
+  entry.bytes_received = s.stats.bytes_received;
+  entry.expected = expected_packets(s);
+  entry.received = s.stats.packets_received;
+  entry.sample.time_us = now;
+  entry.sample.jitter_ms = s.stats.jitter_ms;
+  entry.sample.rtt_ms = s.stats.rtt_ms;
+  if (s.window_count > 0) {
+    const WindowEntry *last = window_at(s, s.window_count - 1);
+    int64_t us = now - last->sample.time_us;
+    entry.sample.send_bitrate_bps =
+        bitrate(entry.bytes_sent - last->bytes_sent, us);
+    entry.sample.receive_bitrate_bps =
+        bitrate(entry.bytes_received - last->bytes_received, us);
+    int32_t expected = entry.expected - last->expected;
+    int32_t lost = expected - (int32_t)(entry.received - last->received);
+    entry.sample.fraction_lost =
+        expected > 0 && lost > 0 ? (float)lost / expected : 0.0f;
+  }
+
+  if (s.window_count < std::size(s.window)) {
+    s.window_count++;
+  } else {
+    s.window_head = (s.window_head + 1) % std::size(s.window);
+  }
+  s.window[(s.window_head + s.window_count - 1) % std::size(s.window)] =
+      entry;
+  return s.window_head == 0 && s.window_count == std::size(s.window);
+}
+
+void on_report_block(RtcStatsState &s, const uint8_t *block, int64_t now) {
+  if (s.local_ssrc != 0 && read32(block) != s.local_ssrc) {
+    return;
+  }
+  s.stats.remote_fraction_lost = block[4] / 256.0f;
+  s.stats.remote_jitter_ms = jitter_ms(read32(block + 12));
+
+  uint32_t lsr = read32(block + 16);
+  uint32_t dlsr = read32(block + 20);
+  if (lsr == 0) {
+    return;
+  }
+  for (const SentReport &report : s.sent_reports) {
+    if (report.time_us != 0 && report.ntp_mid == lsr) {
+      // DLSR is in units of 1/65536 s.
+      int64_t rtt_us =
+          now - report.time_us - (int64_t)dlsr * 1000000 / 65536;
+      s.stats.rtt_ms = rtt_us > 0 ? rtt_us / 1000 : 0;
+      return;
+    }
+  }
+}
+
+// Walks a compound RTCP packet.
+void on_rtcp(RtcStatsState &s, const uint8_t *p, size_t len, bool outbound,
+             int64_t now) {
+  while (len >= 4 && (p[0] >> 6) == 2) {
+    size_t size = (read16(p + 2) + 1) * 4;
+    if (size > len) {
+      break;
+    }
+    uint8_t count = p[0] & 0x1f;
+
+    size_t blocks = 0;
+    switch (p[1]) {
+      case kRtcpSenderReport:
+        if (size < 28) {
+          break;
+        }
+        if (outbound) {
+          // The middle 32 bits of the NTP timestamp, echoed back as LSR.
+          s.sent_reports[s.sent_reports_next] = {read32(p + 10), now};
+          s.sent_reports_next =
+              (s.sent_reports_next + 1) % std::size(s.sent_reports);
+        }
+        blocks = 28;
+        break;
+      case kRtcpReceiverReport:
+        blocks = 8;
+        break;
+      case kRtcpTransportFeedback:
+        if (count != kFeedbackGenericNack) {
+          break;
+        }
+        for (size_t fci = 12; fci + 4 <= size; fci += 4) {
+          uint32_t nacks = 1 + __builtin_popcount(read16(p + fci + 2));
+          (outbound ? s.stats.nacks_sent : s.stats.nacks_received) += nacks;
+        }
+        break;
+      default:
+        break;
+    }
+
+    if (blocks != 0 && !outbound) {
+      for (uint8_t i = 0; i < count && blocks + kReportBlockSize <= size;
+           i++, blocks += kReportBlockSize) {
+        on_report_block(s, p + blocks, now);
+      }
+    }
+    p += size;
+    len -= size;
+  }
+}
+
+void log_stats() {
+#ifdef CONFIG_RTC_STATS_LOG
+  OaiRtcStats stats = oai_rtc_stats();
+  ESP_LOGI(TAG,
+           "out %lu pkts %lu bps | in %lu pkts %lu bps, lost %ld (%.1f%%), "
+           "jitter %lu ms | remote loss %.1f%% jitter %lu ms | rtt %ld ms | "
+           "nack in %lu out %lu",
+           (unsigned long)stats.packets_sent,
+           (unsigned long)stats.send_bitrate_bps,
+           (unsigned long)stats.packets_received,
+           (unsigned long)stats.receive_bitrate_bps, (long)stats.packets_lost,
+           stats.fraction_lost * 100, (unsigned long)stats.jitter_ms,
+           stats.remote_fraction_lost * 100,
+           (unsigned long)stats.remote_jitter_ms, (long)stats.rtt_ms,
+           (unsigned long)stats.nacks_received,
+           (unsigned long)stats.nacks_sent);
+#endif  // CONFIG_RTC_STATS_LOG
+}
+
+void on_rtp_sent(const uint8_t *p, size_t len) {
+  RtpHeader header;
+  if (s_lock == nullptr || !parse_rtp(p, len, &header)) {
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_state.local_ssrc = header.ssrc;
+  s_state.stats.packets_sent++;
+  s_state.stats.bytes_sent += header.payload_size;
+  bool log = maybe_sample(s_state, now);
+  xSemaphoreGive(s_lock);
+  if (log) {
+    log_stats();
+  }
+}
+
+void on_rtp_received(const uint8_t *p, size_t len, int64_t now) {
+  RtpHeader header;
+  if (s_lock == nullptr || !parse_rtp(p, len, &header)) {
+    return;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  RtcStatsState &s = s_state;
+  s.stats.packets_received++;
+  s.stats.bytes_received += header.payload_size;
+  update_seq(s, header.seq);
+
+  uint32_t arrival = (uint32_t)(now * kRtpClockRate / 1000000);
+  int32_t transit = (int32_t)(arrival - header.timestamp);
+  if (s.transit_valid) {
+    int32_t d = transit - s.transit;
+    uint32_t abs_d = d < 0 ? -d : d;
+    s.jitter_q4 += abs_d - ((s.jitter_q4 + 8) >> 4);
+  }
+  s.transit = transit;
+  s.transit_valid = true;
+  s.stats.jitter_ms = jitter_ms(s.jitter_q4 >> 4);
+  s.stats.packets_lost =
+      (int32_t)(expected_packets(s) - s.stats.packets_received);
+
+  bool log = maybe_sample(s, now);
+  xSemaphoreGive(s_lock);
+  if (log) {
+    log_stats();
+  }
+#ifndef LINUX_BUILD
+  oai_playback_rtp(header.timestamp, now);
+#endif
+}
+
+void on_rtcp_packet(const uint8_t *p, size_t len, bool outbound) {
+  if (s_lock == nullptr) {
+    return;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  on_rtcp(s_state, p, len, outbound, esp_timer_get_time());
+  xSemaphoreGive(s_lock);
+}
+
+}  // namespace
+
+// Link-time wrappers of the libsrtp calls made by libpeer. RTP and RTCP are
+// plaintext before protect and after a successful unprotect. srtp_t and
+// srtp_err_status_t are passed through as a pointer and an int, 0 is
+// srtp_err_status_ok.
+extern "C" {
+int __real_srtp_protect(void *ctx, void *rtp_hdr, int *len);
+int __real_srtp_unprotect(void *ctx, void *srtp_hdr, int *len);
+int __real_srtp_protect_rtcp(void *ctx, void *rtcp_hdr, int *len);
+int __real_srtp_unprotect_rtcp(void *ctx, void *srtcp_hdr, int *len);
+
+int __wrap_srtp_protect(void *ctx, void *rtp_hdr, int *len) {
+  on_rtp_sent((const uint8_t *)rtp_hdr, *len);
+  return __real_srtp_protect(ctx, rtp_hdr, len);
+}
+
+int __wrap_srtp_unprotect(void *ctx, void *srtp_hdr, int *len) {
+  int err = __real_srtp_unprotect(ctx, srtp_hdr, len);
+  if (err == 0) {
+    int64_t now = esp_timer_get_time();
+#ifdef CONFIG_RECORD
+    oai_record_rtp((const uint8_t *)srtp_hdr, *len, now);
+#endif
+    on_rtp_received((const uint8_t *)srtp_hdr, *len, now);
+  }
+  return err;
+}
+
+int __wrap_srtp_protect_rtcp(void *ctx, void *rtcp_hdr, int *len) {
+  on_rtcp_packet((const uint8_t *)rtcp_hdr, *len, true);
+  return __real_srtp_protect_rtcp(ctx, rtcp_hdr, len);
+}
+
+int __wrap_srtp_unprotect_rtcp(void *ctx, void *srtcp_hdr, int *len) {
+  int err = __real_srtp_unprotect_rtcp(ctx, srtcp_hdr, len);
+  if (err == 0) {
+    on_rtcp_packet((const uint8_t *)srtcp_hdr, *len, false);
+  }
+  return err;
+}
+}  // extern "C"
+
+void oai_rtc_stats_inbound_rtp(const uint8_t *packet, size_t len,
+                               int64_t arrival_us) {
+  on_rtp_received(packet, len, arrival_us);
+}
+
+void oai_rtc_stats_init() {
+  s_lock = xSemaphoreCreateMutexStatic(&s_lock_buffer);
+  oai_rtc_stats_reset();
+}
+
+void oai_rtc_stats_reset() {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_state = {};
+  s_state.stats.rtt_ms = -1;
+  xSemaphoreGive(s_lock);
+}
+
+OaiRtcStats oai_rtc_stats() {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  const RtcStatsState &s = s_state;
+  OaiRtcStats stats = s.stats;
+  if (s.window_count > 1) {
+    const WindowEntry *first = window_at(s, 0);
+    const WindowEntry *last = window_at(s, s.window_count - 1);
+    int64_t us = last->sample.time_us - first->sample.time_us;
+    stats.send_bitrate_bps = bitrate(last->bytes_sent - first->bytes_sent, us);
+    stats.receive_bitrate_bps =
+        bitrate(last->bytes_received - first->bytes_received, us);
+    int32_t expected = last->expected - first->expected;
+    int32_t lost = expected - (int32_t)(last->received - first->received);
+    stats.fraction_lost =
+        expected > 0 && lost > 0 ? (float)lost / expected : 0.0f;
+  }
+  xSemaphoreGive(s_lock);
+  return stats;
+}
+
+size_t oai_rtc_stats_history(OaiRtcStatsSample *samples, size_t max) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  size_t count = std::min(max, s_state.window_count);
+  size_t skip = s_state.window_count - count;
+  for (size_t i = 0; i < count; i++) {
+    samples[i] = window_at(s_state, skip + i)->sample;
+  }
+  xSemaphoreGive(s_lock);
+  return count;
+}
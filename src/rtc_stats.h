@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Network quality statistics of the media session, in the spirit of
+// RTCPeerConnection.getStats().
+//
+// libpeer keeps RTP and RTCP to itself, so the SRTP calls it makes are
+// wrapped at link time (see CMakeLists.txt) and the plaintext packets are
+// inspected on their way in and out. Counters are cumulative for the
+// session, rates and loss are computed over a rolling window of samples.
+
+struct OaiRtcStats {
+  // Outbound RTP.
+  uint32_t packets_sent;
+  uint64_t bytes_sent;
+  uint32_t send_bitrate_bps;
+
+  // Inbound RTP, measured locally from sequence numbers and timestamps.
+  uint32_t packets_received;
+  uint64_t bytes_received;
+  int32_t packets_lost;
+  // Over the rolling window, 0.0 to 1.0.
+  float fraction_lost;
+  uint32_t jitter_ms;
+  uint32_t receive_bitrate_bps;
+
+  // How the remote sees our outbound stream, from RTCP receiver reports.
+  float remote_fraction_lost;
+  uint32_t remote_jitter_ms;
+  // From SR/RR timing, -1 until a report references one of our SRs.
+  int32_t rtt_ms;
+
+  // Generic NACKs (RFC 4585), counted per requested packet.
+  uint32_t nacks_received;
+  uint32_t nacks_sent;
+};
+
+// One point of the rolling window, taken every
+// CONFIG_RTC_STATS_SAMPLE_INTERVAL_MS while packets flow.
+struct OaiRtcStatsSample {
+  int64_t time_us;
+  uint32_t send_bitrate_bps;
+  uint32_t receive_bitrate_bps;
+  float fraction_lost;
+  uint32_t jitter_ms;
+  int32_t rtt_ms;
+};
+
+// Creates the statistics lock, called once before the peer loop starts.
+void oai_rtc_stats_init();
+// Clears the statistics, called when a new session is created.
+void oai_rtc_stats_reset();
+
+// Accounts a decrypted inbound RTP packet that arrived at arrival_us, as
+// the libsrtp wrapper does. For the replayer, which has no SRTP session.
+void oai_rtc_stats_inbound_rtp(const uint8_t *packet, size_t len,
+                               int64_t arrival_us);
+
+// Safe to call from any task.
+OaiRtcStats oai_rtc_stats();
+// Copies up to max samples of the rolling window, oldest first, and returns
+// the number copied.
+size_t oai_rtc_stats_history(OaiRtcStatsSample *samples, size_t max);
@@ -0,0 +1,213 @@
+#include "settings.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+
+#ifndef LINUX_BUILD
+#include <nvs.h>
+#endif
+
+#include "codec.h"
+
+constexpr const char *TAG = "settings";
+
+namespace {
+
+// Shared with the API key in wifi.cpp.
+constexpr const char *kNvsNamespace = "oai";
+constexpr const char *kApiUriKey = "oai_api_uri";
+// The capture read already blocks for a frame, this only yields to the
+// peer loop.
+constexpr int32_t kDefaultPublishMs = 15;
+
+struct IntField {
+  // JSON member and NVS key, at most 15 characters.
+  const char *name;
+  int32_t OaiSettings::*member;
+  int32_t min;
+  int32_t max;
+};
+
+constexpr IntField kIntFields[] = {
+    {"opus_bitrate", &OaiSettings::opus_bitrate, 6000, 510000},
+    {"opus_complexity", &OaiSettings::opus_complexity, 0, 10},
+    {"frame_ms", &OaiSettings::frame_ms, 10, 60},
+    {"publish_ms", &OaiSettings::publish_ms, 0, 1000},
+};
+
+SemaphoreHandle_t s_lock = nullptr;
+StaticSemaphore_t s_lock_buffer;
+// Guarded by s_lock.
+OaiSettings s_settings;
+std::atomic<uint32_t> s_generation{0};
+
+bool valid(const OaiSettings &settings) {
+  for (const IntField &field : kIntFields) {
+    int32_t value = settings.*field.member;
+    if (value < field.min || value > field.max) {
+      ESP_LOGW(TAG, "%s out of range: %ld", field.name, (long)value);
+      return false;
+    }
+  }
+  switch (settings.frame_ms) {
+    case 10:
+    case 20:
+    case 40:
+    case 60:
+      break;
+    default:
+      ESP_LOGW(TAG, "Unsupported frame length: %ld ms",
+               (long)settings.frame_ms);
+      return false;
+  }
+  size_t uri_len = strnlen(settings.api_uri, sizeof(settings.api_uri));
+  return uri_len > 0 && uri_len < sizeof(settings.api_uri);
+}
+
+#ifndef LINUX_BUILD
+void load(OaiSettings *settings) {
+  nvs_handle_t nvs;
+  if (nvs_open(kNvsNamespace, NVS_READONLY, &nvs) != ESP_OK) {
+    return;
+  }
+  for (const IntField &field : kIntFields) {
+    nvs_get_i32(nvs, field.name, &(settings->*field.member));
+  }
+  size_t len = sizeof(settings->api_uri);
+  nvs_get_str(nvs, kApiUriKey, settings->api_uri, &len);
+  nvs_close(nvs);
+}
+
+esp_err_t save(const OaiSettings &settings, const OaiSettings &previous) {
+  nvs_handle_t nvs;
+  if (esp_err_t err = nvs_open(kNvsNamespace, NVS_READWRITE, &nvs);
+      err != ESP_OK) {
+    return err;
+  }
+  esp_err_t err = ESP_OK;
+  for (const IntField &field : kIntFields) {
+    if (err == ESP_OK && settings.*field.member != previous.*field.member) {
+      err = nvs_set_i32(nvs, field.name, settings.*field.member);
+    }
+  }
+  if (err == ESP_OK && strcmp(settings.api_uri, previous.api_uri) != 0) {
+    err = nvs_set_str(nvs, kApiUriKey, settings.api_uri);
+  }
+  if (err == ESP_OK) {
+    err = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+  return err;
+}
+#else
+// The Linux build has no NVS, settings only live until exit.
+void load(OaiSettings *settings) {}
+esp_err_t save(const OaiSettings &settings, const OaiSettings &previous) {
+  return ESP_OK;
+}
+#endif  // LINUX_BUILD
+
+}  // namespace
+
+void oai_settings_init() {
+  s_lock = xSemaphoreCreateMutexStatic(&s_lock_buffer);
+
+  OaiSettings settings = {};
+  settings.opus_bitrate = OPUS_ENCODER_BITRATE;
+  settings.opus_complexity = OPUS_ENCODER_COMPLEXITY;
+  settings.frame_ms = BUFFER_SAMPLES * 1000 / SAMPLE_RATE;
+  settings.publish_ms = kDefaultPublishMs;
+  strncpy(settings.api_uri, CONFIG_OPENAI_REALTIMEAPI,
+          sizeof(settings.api_uri) - 1);
+
+  OaiSettings stored = settings;
+  load(&stored);
+  if (valid(stored)) {
+    settings = stored;
+  } else {
+    ESP_LOGW(TAG, "Ignoring invalid stored settings");
+  }
+
+  s_settings = settings;
+  s_generation = 1;
+}
+
+uint32_t oai_settings_generation() {
+  return s_generation.load(std::memory_order_acquire);
+}
+
+void oai_settings_get(OaiSettings *settings) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  *settings = s_settings;
+  xSemaphoreGive(s_lock);
+}
+
+esp_err_t oai_settings_set(const OaiSettings &settings) {
+  if (!valid(settings)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  esp_err_t err = save(settings, s_settings);
+  if (err == ESP_OK) {
+    s_settings = settings;
+    s_generation.fetch_add(1, std::memory_order_release);
+  }
+  xSemaphoreGive(s_lock);
+
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to store the settings: %s", esp_err_to_name(err));
+  } else {
+    ESP_LOGI(TAG, "Opus %ld bps, complexity %ld, %ld ms frames, publish %ld ms",
+             (long)settings.opus_bitrate, (long)settings.opus_complexity,
+             (long)settings.frame_ms, (long)settings.publish_ms);
+  }
+  return err;
+}
+
+void oai_settings_to_json(const OaiSettings &settings, JsonWriter &w) {
+  w.begin_object();
+  for (const IntField &field : kIntFields) {
+    w.member(field.name, (int64_t)(settings.*field.member));
+  }
+  w.member("api_uri", settings.api_uri);
+  w.end_object();
+}
+
+esp_err_t oai_settings_from_json(std::string_view json,
+                                 OaiSettings *settings) {
+  JsonValue root = oai_json_parse(json);
+  if (!root.is_object()) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  JsonIterator it(root);
+  std::string_view key;
+  JsonValue value;
+  while (it.next(&key, &value)) {
+    if (key == "api_uri") {
+      if (oai_json_unescape(value, settings->api_uri,
+                            sizeof(settings->api_uri)) <= 0) {
+        return ESP_ERR_INVALID_ARG;
+      }
+      continue;
+    }
+
+    const IntField *field = std::find_if(
+        std::begin(kIntFields), std::end(kIntFields),
+        [key](const IntField &f) { return key == f.name; });
+    int64_t number;
+    if (field == std::end(kIntFields) || !value.as_int(&number) ||
+        number < INT32_MIN || number > INT32_MAX) {
+      return ESP_ERR_INVALID_ARG;
+    }
+    settings->*field->member = (int32_t)number;
+  }
+  return ESP_OK;
+}
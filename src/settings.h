@@ -0,0 +1,58 @@
+#pragma once
+
+#include <esp_err.h>
+#include <stdint.h>
+
+#include <string_view>
+
+#include "json_stream.h"
+
+// Runtime settings.
+//
+// Loaded from NVS once at boot into an in-RAM snapshot. A change replaces
+// the whole snapshot and bumps a generation counter. Consumers compare the
+// generation at their own boundaries, e.g. once per audio frame, and only
+// copy the snapshot when it changed.
+
+struct OaiSettings {
+  int32_t opus_bitrate;
+  // 0 to 10.
+  int32_t opus_complexity;
+  // Capture frame length, 10, 20, 40 or 60 ms.
+  int32_t frame_ms;
+  // Sleep of the audio publisher between frames.
+  int32_t publish_ms;
+  char api_uri[256];
+};
+
+void oai_settings_init();
+// Starts at 1 once initialized.
+uint32_t oai_settings_generation();
+void oai_settings_get(OaiSettings *settings);
+// Validates settings, persists the changed values and publishes them.
+esp_err_t oai_settings_set(const OaiSettings &settings);
+
+void oai_settings_to_json(const OaiSettings &settings, JsonWriter &w);
+// Applies the members present in json on top of settings. Returns
+// ESP_ERR_INVALID_ARG for malformed JSON or unknown members.
+esp_err_t oai_settings_from_json(std::string_view json, OaiSettings *settings);
+
+// Copy of the settings owned by one consumer.
+class OaiSettingsView {
+ public:
+  // Returns true if the copy changed since the last call.
+  bool refresh() {
+    uint32_t generation = oai_settings_generation();
+    if (generation == generation_) {
+      return false;
+    }
+    generation_ = generation;
+    oai_settings_get(&settings_);
+    return true;
+  }
+  const OaiSettings &get() const { return settings_; }
+
+ private:
+  uint32_t generation_ = 0;
+  OaiSettings settings_ = {};
+};
@@ -0,0 +1,392 @@
+#include "srtp_crypto.h"
+
+#include <auth.h>
+#include <cipher.h>
+#include <esp_log.h>
+#include <mbedtls/aes.h>
+#include <mbedtls/md.h>
+#include <mbedtls/platform_util.h>
+#include <srtp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CONFIG_SRTP_BENCHMARK
+#include <esp_timer.h>
+#endif
+
+constexpr const char *TAG = "srtp_crypto";
+
+// The built-in software implementations of libsrtp.
+extern "C" const srtp_cipher_type_t srtp_aes_icm_128;
+extern "C" const srtp_auth_type_t srtp_hmac;
+
+namespace {
+
+constexpr int kSaltLen = 14;
+constexpr int kAesIcm128KeyLen = 16 + kSaltLen;
+constexpr int kSha1Len = 20;
+
+// AES-CM (RFC 3711 4.1.1) with mbedTLS. The counter is the salt XORed with
+// the IV, of which libsrtp only ever increments the low 16 bits, so CTR mode
+// over the whole block produces the same key stream.
+struct AesIcmState {
+  mbedtls_aes_context aes;
+  uint8_t salt[16];
+  uint8_t counter[16];
+  uint8_t stream_block[16];
+  size_t offset;
+};
+
+extern const srtp_cipher_type_t kAesIcm;
+
+srtp_err_status_t aes_icm_alloc(srtp_cipher_t **c, int key_len, int tag_len) {
+  if (key_len != kAesIcm128KeyLen) {
+    return srtp_err_status_bad_param;
+  }
+  srtp_cipher_t *cipher = (srtp_cipher_t *)calloc(1, sizeof(srtp_cipher_t));
+  AesIcmState *state = (AesIcmState *)calloc(1, sizeof(AesIcmState));
+  if (cipher == nullptr || state == nullptr) {
+    free(cipher);
+    free(state);
+    return srtp_err_status_alloc_fail;
+  }
+  mbedtls_aes_init(&state->aes);
+  cipher->type = &kAesIcm;
+  cipher->state = state;
+  cipher->key_len = key_len;
+  cipher->algorithm = SRTP_AES_ICM_128;
+  *c = cipher;
+  return srtp_err_status_ok;
+}
+
+srtp_err_status_t aes_icm_dealloc(srtp_cipher_t *c) {
+  AesIcmState *state = (AesIcmState *)c->state;
+  mbedtls_aes_free(&state->aes);
+  mbedtls_platform_zeroize(state, sizeof(*state));
+  free(state);
+  free(c);
+  return srtp_err_status_ok;
+}
+
+srtp_err_status_t aes_icm_init(void *cv, const uint8_t *key) {
+  AesIcmState *state = (AesIcmState *)cv;
+  memcpy(state->salt, key + 16, kSaltLen);
+  state->salt[14] = state->salt[15] = 0;
+  if (mbedtls_aes_setkey_enc(&state->aes, key, 128) != 0) {
+    return srtp_err_status_init_fail;
+  }
+  return srtp_err_status_ok;
+}
+
+srtp_err_status_t aes_icm_set_iv(void *cv, uint8_t *iv,
+                                 srtp_cipher_direction_t direction) {
+  AesIcmState *state = (AesIcmState *)cv;
+  for (int i = 0; i < 16; i++) {
+    state->counter[i] = state->salt[i] ^ iv[i];
+  }
+  state->offset = 0;
+  return srtp_err_status_ok;
+}
+
+// Encryption and decryption are the same XOR with the key stream.
+srtp_err_status_t aes_icm_encrypt(void *cv, uint8_t *buffer,
+                                  unsigned int *octets) {
+  AesIcmState *state = (AesIcmState *)cv;
+  if (mbedtls_aes_crypt_ctr(&state->aes, *octets, &state->offset,
+                            state->counter, state->stream_block, buffer,
+                            buffer) != 0) {
+    return srtp_err_status_cipher_fail;
+  }
+  return srtp_err_status_ok;
+}
+
+// RFC 3711 B.2.
+const uint8_t kAesIcmTestKey[kAesIcm128KeyLen] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7,
+    0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c, 0xf0, 0xf1, 0xf2, 0xf3,
+    0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd,
+};
+uint8_t kAesIcmTestIv[16] = {};
+const uint8_t kAesIcmTestPlaintext[32] = {};
+const uint8_t kAesIcmTestCiphertext[32] = {
+    0xe0, 0x3e, 0xad, 0x09, 0x35, 0xc9, 0x5e, 0x80, 0xe1, 0x66, 0xb1,
+    0x6d, 0xd9, 0x2b, 0x4e, 0xb4, 0xd2, 0x35, 0x13, 0x16, 0x2b, 0x02,
+    0xd0, 0xf7, 0x2a, 0x43, 0xa2, 0xfe, 0x4a, 0x5f, 0x97, 0xab,
+};
+const srtp_cipher_test_case_t kAesIcmTest = {
+    kAesIcm128KeyLen,
+    kAesIcmTestKey,
+    kAesIcmTestIv,
+    sizeof(kAesIcmTestPlaintext),
+    kAesIcmTestPlaintext,
+    sizeof(kAesIcmTestCiphertext),
+    kAesIcmTestCiphertext,
+    0,        // aad_length_octets
+    nullptr,  // aad
+    0,        // tag_length_octets
+    nullptr,  // next_test_case
+};
+
+// libsrtp runs the test case when the type is installed.
+const srtp_cipher_type_t kAesIcm = {
+    aes_icm_alloc,
+    aes_icm_dealloc,
+    aes_icm_init,
+    nullptr,  // set_aad
+    aes_icm_encrypt,
+    aes_icm_encrypt,
+    aes_icm_set_iv,
+    nullptr,  // get_tag
+    "AES-128 counter mode (mbedTLS)",
+    &kAesIcmTest,
+    SRTP_AES_ICM_128,
+};
+
+// HMAC-SHA1 with mbedTLS.
+extern const srtp_auth_type_t kHmac;
+
+srtp_err_status_t hmac_alloc(srtp_auth_t **a, int key_len, int out_len) {
+  if (key_len > kSha1Len || out_len > kSha1Len) {
+    return srtp_err_status_bad_param;
+  }
+  srtp_auth_t *auth = (srtp_auth_t *)calloc(1, sizeof(srtp_auth_t));
+  mbedtls_md_context_t *md =
+      (mbedtls_md_context_t *)calloc(1, sizeof(mbedtls_md_context_t));
+  if (auth == nullptr || md == nullptr) {
+    free(auth);
+    free(md);
+    return srtp_err_status_alloc_fail;
+  }
+  mbedtls_md_init(md);
+  if (mbedtls_md_setup(md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), 1) !=
+      0) {
+    mbedtls_md_free(md);
+    free(auth);
+    free(md);
+    return srtp_err_status_alloc_fail;
+  }
+  auth->type = &kHmac;
+  auth->state = md;
+  auth->out_len = out_len;
+  auth->key_len = key_len;
+  auth->prefix_len = 0;
+  *a = auth;
+  return srtp_err_status_ok;
+}
+
+srtp_err_status_t hmac_dealloc(srtp_auth_t *a) {
+  mbedtls_md_context_t *md = (mbedtls_md_context_t *)a->state;
+  mbedtls_md_free(md);
+  free(md);
+  free(a);
+  return srtp_err_status_ok;
+}
+
+srtp_err_status_t hmac_init(void *statev, const uint8_t *key, int key_len) {
+  if (mbedtls_md_hmac_starts((mbedtls_md_context_t *)statev, key, key_len) !=
+      0) {
+    return srtp_err_status_auth_fail;
+  }
+  return srtp_err_status_ok;
+}
+
+srtp_err_status_t hmac_start(void *statev) {
+  if (mbedtls_md_hmac_reset((mbedtls_md_context_t *)statev) != 0) {
+    return srtp_err_status_auth_fail;
+  }
+  return srtp_err_status_ok;
+}
+
+srtp_err_status_t hmac_update(void *statev, const uint8_t *message,
+                              int msg_octets) {
+  if (mbedtls_md_hmac_update((mbedtls_md_context_t *)statev, message,
+                             msg_octets) != 0) {
+    return srtp_err_status_auth_fail;
+  }
+  return srtp_err_status_ok;
+}
+
+srtp_err_status_t hmac_compute(void *statev, const uint8_t *message,
+                               int msg_octets, int tag_len, uint8_t *result) {
+  mbedtls_md_context_t *md = (mbedtls_md_context_t *)statev;
+  uint8_t hash[kSha1Len];
+  if (tag_len > kSha1Len ||
+      mbedtls_md_hmac_update(md, message, msg_octets) != 0 ||
+      mbedtls_md_hmac_finish(md, hash) != 0) {
+    return srtp_err_status_auth_fail;
+  }
+  memcpy(result, hash, tag_len);
+  return srtp_err_status_ok;
+}
+
+// RFC 2202 test case 1.
+const uint8_t kHmacTestKey[kSha1Len] = {
+    0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+    0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+};
+const uint8_t kHmacTestData[8] = {'H', 'i', ' ', 'T', 'h', 'e', 'r', 'e'};
+const uint8_t kHmacTestTag[kSha1Len] = {
+    0xb6, 0x17, 0x31, 0x86, 0x55, 0x05, 0x72, 0x64, 0xe2, 0x8b,
+    0xc0, 0xb6, 0xfb, 0x37, 0x8c, 0x8e, 0xf1, 0x46, 0xbe, 0x00,
+};
+const srtp_auth_test_case_t kHmacTest = {
+    sizeof(kHmacTestKey), kHmacTestKey, sizeof(kHmacTestData),
+    kHmacTestData,        kSha1Len,     kHmacTestTag,
+    nullptr,  // next_test_case
+};
+
+const srtp_auth_type_t kHmac = {
+    hmac_alloc,
+    hmac_dealloc,
+    hmac_init,
+    hmac_compute,
+    hmac_update,
+    hmac_start,
+    "HMAC-SHA1 (mbedTLS)",
+    &kHmacTest,
+    SRTP_HMAC_SHA1,
+};
+
+struct Backend {
+  const char *name;
+  const srtp_cipher_type_t *cipher;
+  const srtp_auth_type_t *auth;
+};
+
+constexpr Backend kLibsrtp = {"libsrtp", &srtp_aes_icm_128, &srtp_hmac};
+constexpr Backend kMbedtls = {"mbedtls", &kAesIcm, &kHmac};
+
+// Replaces the implementations for the sessions created from now on.
+bool install(const Backend &backend) {
+  if (srtp_err_status_t err =
+          srtp_replace_cipher_type(backend.cipher, SRTP_AES_ICM_128);
+      err != srtp_err_status_ok) {
+    ESP_LOGE(TAG, "Failed to install the %s cipher: %d", backend.name, err);
+    return false;
+  }
+  if (srtp_err_status_t err =
+          srtp_replace_auth_type(backend.auth, SRTP_HMAC_SHA1);
+      err != srtp_err_status_ok) {
+    ESP_LOGE(TAG, "Failed to install the %s HMAC: %d", backend.name, err);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+#ifdef CONFIG_SRTP_CRYPTO_MBEDTLS
+extern "C" {
+srtp_err_status_t __real_srtp_init();
+
+srtp_err_status_t __wrap_srtp_init() {
+  srtp_err_status_t err = __real_srtp_init();
+  if (err == srtp_err_status_ok && install(kMbedtls)) {
+    ESP_LOGI(TAG, "Using the mbedTLS SRTP backend");
+  }
+  return err;
+}
+}  // extern "C"
+#endif  // CONFIG_SRTP_CRYPTO_MBEDTLS
+
+#ifdef CONFIG_SRTP_BENCHMARK
+namespace {
+
+// An RTP header and a 40 ms Opus frame at 30 kbps.
+constexpr int kHeaderLen = 12;
+constexpr int kPayloadLen = 150;
+constexpr int kBatch = 32;
+#ifdef CONFIG_SRTP_CRYPTO_MBEDTLS
+constexpr const Backend &kConfigured = kMbedtls;
+#else
+constexpr const Backend &kConfigured = kLibsrtp;
+#endif
+
+void benchmark(const Backend &backend) {
+  if (!install(backend)) {
+    return;
+  }
+
+  uint8_t key[kAesIcm128KeyLen];
+  for (int i = 0; i < kAesIcm128KeyLen; i++) {
+    key[i] = i;
+  }
+  srtp_policy_t policy;
+  memset(&policy, 0, sizeof(policy));
+  srtp_crypto_policy_set_rtp_default(&policy.rtp);
+  srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+  policy.key = key;
+  policy.window_size = 128;
+  policy.ssrc.type = ssrc_any_outbound;
+  srtp_t sender = nullptr;
+  srtp_t receiver = nullptr;
+  if (srtp_create(&sender, &policy) != srtp_err_status_ok) {
+    ESP_LOGE(TAG, "Failed to create the sender session");
+    return;
+  }
+  policy.ssrc.type = ssrc_any_inbound;
+  if (srtp_create(&receiver, &policy) != srtp_err_status_ok) {
+    ESP_LOGE(TAG, "Failed to create the receiver session");
+    srtp_dealloc(sender);
+    return;
+  }
+
+  // Protected in batches, so the timer resolution does not matter.
+  static uint8_t packets[kBatch][kHeaderLen + kPayloadLen +
+                                 SRTP_MAX_TRAILER_LEN];
+  int lengths[kBatch];
+  int64_t protect_us = 0;
+  int64_t unprotect_us = 0;
+  int failures = 0;
+  uint16_t seq = 0;
+  for (int done = 0; done < CONFIG_SRTP_BENCHMARK_PACKETS; done += kBatch) {
+    for (int i = 0; i < kBatch; i++, seq++) {
+      uint8_t *p = packets[i];
+      p[0] = 0x80;
+      p[1] = 111;
+      p[2] = seq >> 8;
+      p[3] = seq & 0xff;
+      memset(p + 4, 0, 4);
+      memset(p + 8, 0x5a, 4);
+      memset(p + kHeaderLen, seq, kPayloadLen);
+      lengths[i] = kHeaderLen + kPayloadLen;
+    }
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < kBatch; i++) {
+      failures += srtp_protect(sender, packets[i], &lengths[i]) !=
+                  srtp_err_status_ok;
+    }
+    int64_t protected_us = esp_timer_get_time();
+    for (int i = 0; i < kBatch; i++) {
+      failures += srtp_unprotect(receiver, packets[i], &lengths[i]) !=
+                  srtp_err_status_ok;
+    }
+    protect_us += protected_us - start;
+    unprotect_us += esp_timer_get_time() - protected_us;
+  }
+  srtp_dealloc(sender);
+  srtp_dealloc(receiver);
+
+  int packets_done = (CONFIG_SRTP_BENCHMARK_PACKETS + kBatch - 1) / kBatch *
+                     kBatch;
+  ESP_LOGI(TAG,
+           "%-7s: protect %lld ns, unprotect %lld ns per %d byte packet, "
+           "%d failures",
+           backend.name, (long long)(protect_us * 1000 / packets_done),
+           (long long)(unprotect_us * 1000 / packets_done),
+           kHeaderLen + kPayloadLen, failures);
+}
+
+}  // namespace
+
+void oai_srtp_benchmark() {
+  if (srtp_init() != srtp_err_status_ok) {
+    ESP_LOGE(TAG, "Failed to initialize libsrtp");
+    return;
+  }
+  benchmark(kLibsrtp);
+  benchmark(kMbedtls);
+  install(kConfigured);
+}
+#endif  // CONFIG_SRTP_BENCHMARK
@@ -0,0 +1,19 @@
+#pragma once
+
+// Crypto backend of libsrtp.
+//
+// Every audio packet is encrypted with AES-CM and authenticated with
+// HMAC-SHA1 on the way out, and verified and decrypted on the way in. The
+// built-in libsrtp implementations run in software. With
+// CONFIG_SRTP_CRYPTO_MBEDTLS both are replaced with mbedTLS, which uses the
+// AES and SHA peripherals on the ESP32 (CONFIG_MBEDTLS_HARDWARE_AES/SHA) and
+// AES-NI on x86-64. libpeer initializes libsrtp itself, so srtp_init is
+// wrapped at link time (see CMakeLists.txt) to install the backend right
+// after.
+
+#ifdef CONFIG_SRTP_BENCHMARK
+// Protects and unprotects CONFIG_SRTP_BENCHMARK_PACKETS audio-sized packets
+// with every backend and logs the time per packet, then leaves the
+// configured backend installed.
+void oai_srtp_benchmark();
+#endif  // CONFIG_SRTP_BENCHMARK
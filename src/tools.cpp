@@ -0,0 +1,348 @@
+#include "tools.h"
+
+#include <assert.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <string.h>
+
+#ifndef LINUX_BUILD
+#include <esp_heap_caps.h>
+#endif
+
+#include <algorithm>
+#include <iterator>
+
+#include "events.h"
+#include "main.h"
+
+constexpr const char *TAG = "tools";
+
+namespace {
+
+enum class JobState : uint8_t {
+  kFree,
+  kQueued,
+  kRunning,
+  kDone,
+  // Timed out while running, freed by the worker when the handler returns.
+  kAbandoned,
+};
+
+struct ToolJob {
+  JobState state;
+  int8_t tool;  // Index into s_tools, -1 if the tool is unknown.
+  esp_err_t result;
+  int64_t queued_us;
+  int64_t started_us;
+  int64_t finished_us;
+  int64_t deadline_us;
+  char call_id[CONFIG_TOOLS_CALL_ID_SIZE];
+  char arguments[CONFIG_TOOLS_ARGUMENTS_SIZE];
+  char output[CONFIG_TOOLS_OUTPUT_SIZE];
+};
+
+const OaiTool *s_tools[CONFIG_TOOLS_MAX];
+OaiToolStats s_tool_stats[CONFIG_TOOLS_MAX];
+size_t s_tool_count = 0;
+
+ToolJob s_jobs[CONFIG_TOOLS_MAX_PENDING];
+SemaphoreHandle_t s_jobs_lock = nullptr;
+// Job indices. High priority calls are queued at the front. A job that
+// timed out while queued leaves a stale index behind, so the queue holds
+// twice the number of jobs.
+QueueHandle_t s_job_queue = nullptr;
+// Outputs were posted but response.create was not sent yet.
+bool s_response_pending = false;
+
+void tool_worker_task(void *arg) {
+  while (1) {
+    uint8_t index;
+    if (xQueueReceive(s_job_queue, &index, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    ToolJob &job = s_jobs[index];
+
+    xSemaphoreTake(s_jobs_lock, portMAX_DELAY);
+    if (job.state != JobState::kQueued) {
+      xSemaphoreGive(s_jobs_lock);
+      continue;
+    }
+    job.state = JobState::kRunning;
+    job.started_us = esp_timer_get_time();
+    const OaiTool *tool = s_tools[job.tool];
+    xSemaphoreGive(s_jobs_lock);
+
+    JsonValue arguments = oai_json_parse(job.arguments);
+    JsonWriter output(job.output, sizeof(job.output));
+    esp_err_t err = tool->handler(arguments, output);
+    if (err == ESP_OK && !output.ok()) {
+      err = ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(s_jobs_lock, portMAX_DELAY);
+    job.result = err;
+    job.finished_us = esp_timer_get_time();
+    job.state = job.state == JobState::kAbandoned ? JobState::kFree
+                                                  : JobState::kDone;
+    xSemaphoreGive(s_jobs_lock);
+    oai_peer_loop_wakeup();
+  }
+}
+
+void post_error(const char *call_id, const char *error) {
+  char buf[96];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object().member("error", error).end_object();
+  oai_send_function_call_output(call_id, w.view());
+  s_response_pending = true;
+}
+
+// Called with s_jobs_lock held.
+void post_result(ToolJob &job) {
+  if (job.tool < 0) {
+    post_error(job.call_id, "unknown function");
+    return;
+  }
+
+  const OaiTool *tool = s_tools[job.tool];
+  OaiToolStats &stats = s_tool_stats[job.tool];
+  uint32_t queue_us = job.started_us - job.queued_us;
+  uint32_t exec_us = job.finished_us - job.started_us;
+  stats.queue_us_total += queue_us;
+  stats.queue_us_max = std::max(stats.queue_us_max, queue_us);
+  stats.exec_us_total += exec_us;
+  stats.exec_us_max = std::max(stats.exec_us_max, exec_us);
+  ESP_LOGI(TAG, "%s: queued %lu us, ran %lu us, %s", tool->name,
+           (unsigned long)queue_us, (unsigned long)exec_us,
+           esp_err_to_name(job.result));
+
+  if (job.result != ESP_OK) {
+    stats.failures++;
+    post_error(job.call_id, esp_err_to_name(job.result));
+    return;
+  }
+  stats.completed++;
+  oai_send_function_call_output(job.call_id, job.output);
+  s_response_pending = true;
+}
+
+#ifdef CONFIG_TOOLS_DEVICE_STATUS
+esp_err_t device_status_handler(const JsonValue &arguments,
+                                JsonWriter &output) {
+  output.begin_object().member("uptime_s", esp_timer_get_time() / 1000000);
+#ifndef LINUX_BUILD
+  output.member("free_heap", (int64_t)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+#endif
+  output.end_object();
+  return ESP_OK;
+}
+
+constexpr OaiTool kDeviceStatusTool = {
+    .name = "get_device_status",
+    .description = "Returns the uptime and free memory of the device.",
+    .parameters = R"({"type":"object","properties":{}})",
+    .handler = device_status_handler,
+    .priority = OaiToolPriority::kHigh,
+    .timeout_ms = 1000,
+};
+#endif  // CONFIG_TOOLS_DEVICE_STATUS
+
+}  // namespace
+
+esp_err_t oai_tools_register(const OaiTool *tool) {
+  if (tool == nullptr || tool->name == nullptr || tool->handler == nullptr) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (s_tool_count >= std::size(s_tools)) {
+    return ESP_ERR_NO_MEM;
+  }
+  s_tools[s_tool_count++] = tool;
+  return ESP_OK;
+}
+
+void oai_tools_start() {
+  s_jobs_lock = xSemaphoreCreateMutex();
+  s_job_queue = xQueueCreate(2 * std::size(s_jobs), sizeof(uint8_t));
+  assert(s_jobs_lock != nullptr && s_job_queue != nullptr);
+
+#ifdef CONFIG_TOOLS_DEVICE_STATUS
+  ESP_ERROR_CHECK(oai_tools_register(&kDeviceStatusTool));
+#endif
+
+  for (int i = 0; i < CONFIG_TOOLS_WORKERS; i++) {
+    if (xTaskCreate(tool_worker_task, "tool_worker",
+                    CONFIG_TOOLS_WORKER_STACK_SIZE, nullptr,
+                    CONFIG_TOOLS_WORKER_PRIORITY, nullptr) != pdPASS) {
+      ESP_LOGE(TAG, "Failed to create tool worker %d", i);
+    }
+  }
+}
+
+void oai_tools_send_session_update() {
+  if (s_tool_count == 0) {
+    return;
+  }
+
+  char buf[CONFIG_EVENTS_OUTBOUND_SLOT_SIZE];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object()
+      .member("type", "session.update")
+      .key("session")
+      .begin_object()
+      .key("tools")
+      .begin_array();
+  for (size_t i = 0; i < s_tool_count; i++) {
+    w.begin_object()
+        .member("type", "function")
+        .member("name", s_tools[i]->name)
+        .member("description", s_tools[i]->description)
+        .key("parameters")
+        .raw(s_tools[i]->parameters)
+        .end_object();
+  }
+  w.end_array().member("tool_choice", "auto").end_object().end_object();
+
+  if (!w.ok()) {
+    ESP_LOGE(TAG, "Tool definitions exceed the outbound event size");
+    return;
+  }
+  oai_event_enqueue(OaiOutboundKind::kSessionUpdate, w.view());
+}
+
+void oai_tools_submit(const JsonValue &event) {
+  std::string_view name = event["name"].str();
+  std::string_view call_id = event["call_id"].str();
+  if (call_id.empty() || call_id.size() >= CONFIG_TOOLS_CALL_ID_SIZE) {
+    ESP_LOGE(TAG, "Invalid call_id for %.*s", (int)name.size(), name.data());
+    return;
+  }
+
+  int8_t tool = -1;
+  for (size_t i = 0; i < s_tool_count; i++) {
+    if (name == s_tools[i]->name) {
+      tool = i;
+      break;
+    }
+  }
+
+  xSemaphoreTake(s_jobs_lock, portMAX_DELAY);
+  auto job = std::find_if(std::begin(s_jobs), std::end(s_jobs),
+                          [](const ToolJob &job) {
+                            return job.state == JobState::kFree;
+                          });
+  if (job == std::end(s_jobs)) {
+    xSemaphoreGive(s_jobs_lock);
+    ESP_LOGW(TAG, "Too many pending calls, rejecting %.*s", (int)name.size(),
+             name.data());
+    char id[CONFIG_TOOLS_CALL_ID_SIZE];
+    memcpy(id, call_id.data(), call_id.size());
+    id[call_id.size()] = '\0';
+    post_error(id, "busy");
+    return;
+  }
+
+  memcpy(job->call_id, call_id.data(), call_id.size());
+  job->call_id[call_id.size()] = '\0';
+  job->tool = tool;
+  job->queued_us = esp_timer_get_time();
+  job->state = JobState::kDone;
+  if (tool >= 0) {
+    s_tool_stats[tool].calls++;
+  }
+  if (tool < 0) {
+    job->result = ESP_ERR_NOT_FOUND;
+  } else if (oai_json_unescape(event["arguments"], job->arguments,
+                               sizeof(job->arguments)) < 0) {
+    job->result = ESP_ERR_INVALID_SIZE;
+    job->started_us = job->finished_us = job->queued_us;
+  } else {
+    const OaiTool *t = s_tools[tool];
+    uint32_t timeout_ms =
+        t->timeout_ms ? t->timeout_ms : CONFIG_TOOLS_DEFAULT_TIMEOUT_MS;
+    job->deadline_us = job->queued_us + timeout_ms * 1000LL;
+    job->state = JobState::kQueued;
+
+    uint8_t index = job - std::begin(s_jobs);
+    BaseType_t queued =
+        t->priority == OaiToolPriority::kHigh
+            ? xQueueSendToFront(s_job_queue, &index, 0)
+            : xQueueSendToBack(s_job_queue, &index, 0);
+    if (queued != pdTRUE) {
+      job->state = JobState::kDone;
+      job->result = ESP_ERR_NO_MEM;
+      job->started_us = job->finished_us = job->queued_us;
+    }
+  }
+  xSemaphoreGive(s_jobs_lock);
+}
+
+void oai_tools_poll() {
+  if (s_jobs_lock == nullptr) {
+    return;
+  }
+
+  int64_t now = esp_timer_get_time();
+  bool busy = false;
+  xSemaphoreTake(s_jobs_lock, portMAX_DELAY);
+  for (ToolJob &job : s_jobs) {
+    switch (job.state) {
+      case JobState::kDone:
+        post_result(job);
+        job.state = JobState::kFree;
+        break;
+      case JobState::kQueued:
+      case JobState::kRunning:
+        if (now < job.deadline_us) {
+          busy = true;
+          break;
+        }
+        ESP_LOGW(TAG, "%s timed out while %s", s_tools[job.tool]->name,
+                 job.state == JobState::kQueued ? "queued" : "running");
+        s_tool_stats[job.tool].timeouts++;
+        post_error(job.call_id, "timeout");
+        job.state = job.state == JobState::kQueued ? JobState::kFree
+                                                   : JobState::kAbandoned;
+        break;
+      default:
+        break;
+    }
+  }
+  xSemaphoreGive(s_jobs_lock);
+
+  // One response.create once every call of the turn has an output.
+  if (s_response_pending && !busy) {
+    s_response_pending = false;
+    oai_send_response_create("");
+  }
+}
+
+void oai_tools_reset() {
+  if (s_jobs_lock == nullptr) {
+    return;
+  }
+
+  xSemaphoreTake(s_jobs_lock, portMAX_DELAY);
+  for (ToolJob &job : s_jobs) {
+    if (job.state == JobState::kRunning) {
+      job.state = JobState::kAbandoned;
+    } else if (job.state != JobState::kAbandoned) {
+      job.state = JobState::kFree;
+    }
+  }
+  s_response_pending = false;
+  xSemaphoreGive(s_jobs_lock);
+}
+
+bool oai_tools_get_stats(size_t index, const OaiTool **tool,
+                         OaiToolStats *stats) {
+  if (index >= s_tool_count) {
+    return false;
+  }
+  *tool = s_tools[index];
+  *stats = s_tool_stats[index];
+  return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <esp_err.h>
+#include <stdint.h>
+
+#include "json_stream.h"
+
+// Function calling for the realtime API.
+//
+// Tools are registered before oai_webrtc() starts. Calls requested by the
+// model are executed by a small worker pool so a slow handler never blocks
+// the peer loop, and the result is posted back as function_call_output
+// followed by response.create.
+
+// Writes the result of a call into output, which is sent to the model as
+// the function_call_output. Returning an error sends {"error": "..."}.
+using OaiToolHandler = esp_err_t (*)(const JsonValue &arguments,
+                                     JsonWriter &output);
+
+enum class OaiToolPriority : uint8_t {
+  kHigh,
+  kLow,
+};
+
+struct OaiTool {
+  const char *name;
+  const char *description;
+  // JSON schema of the arguments, sent as is in session.update.
+  const char *parameters;
+  OaiToolHandler handler;
+  OaiToolPriority priority;
+  uint32_t timeout_ms;
+};
+
+struct OaiToolStats {
+  uint32_t calls;
+  uint32_t completed;
+  uint32_t failures;
+  uint32_t timeouts;
+  uint64_t queue_us_total;
+  uint32_t queue_us_max;
+  uint64_t exec_us_total;
+  uint32_t exec_us_max;
+};
+
+// Registers a tool. The descriptor must stay valid forever.
+esp_err_t oai_tools_register(const OaiTool *tool);
+// Starts the worker pool, called once before the peer loop starts.
+void oai_tools_start();
+
+// Queues session.update with the registered tools.
+void oai_tools_send_session_update();
+// Handles response.function_call_arguments.done on the peer loop.
+void oai_tools_submit(const JsonValue &event);
+// Posts finished calls and timeouts, called from the peer loop.
+void oai_tools_poll();
+// Forgets calls of the previous session.
+void oai_tools_reset();
+
+// Returns false if index is out of range.
+bool oai_tools_get_stats(size_t index, const OaiTool **tool,
+                         OaiToolStats *stats);
@@ -0,0 +1,130 @@
+#include "transport_stats.h"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+
+constexpr const char *TAG = "transport_stats";
+
+namespace {
+
+constexpr int64_t kLogIntervalUs = 10000000;
+
+struct Busy {
+  uint32_t frames;
+  int64_t total_us;
+  int64_t max_us;
+
+  void add(int64_t us) {
+    frames++;
+    total_us += us;
+    max_us = std::max(max_us, us);
+  }
+  int64_t avg_us() const { return frames ? total_us / frames : 0; }
+};
+
+const char *s_transport = "";
+SemaphoreHandle_t s_lock = nullptr;
+StaticSemaphore_t s_lock_buffer;
+int64_t s_session_started_us = 0;
+size_t s_free_before_session = 0;
+int64_t s_next_log_us = 0;
+
+// Per log interval, under s_lock.
+Busy s_uplink;
+Busy s_downlink;
+int64_t s_speech_stopped_us = 0;
+uint32_t s_responses = 0;
+int64_t s_latency_total_ms = 0;
+int64_t s_latency_max_ms = 0;
+
+size_t internal_free() { return heap_caps_get_free_size(MALLOC_CAP_INTERNAL); }
+
+}  // namespace
+
+void oai_transport_stats_init(const char *transport) {
+  s_transport = transport;
+  s_lock = xSemaphoreCreateMutexStatic(&s_lock_buffer);
+}
+
+void oai_transport_stats_session_start() {
+  s_session_started_us = esp_timer_get_time();
+  s_free_before_session = internal_free();
+}
+
+void oai_transport_stats_connected() {
+  ESP_LOGI(TAG, "%s: connected in %lld ms, session takes %ld bytes of "
+           "internal RAM, %u bytes free",
+           s_transport,
+           (long long)(esp_timer_get_time() - s_session_started_us) / 1000,
+           (long)s_free_before_session - (long)internal_free(),
+           (unsigned)internal_free());
+}
+
+void oai_transport_stats_uplink(int64_t busy_us) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_uplink.add(busy_us);
+  xSemaphoreGive(s_lock);
+}
+
+void oai_transport_stats_downlink(int64_t busy_us) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_downlink.add(busy_us);
+  xSemaphoreGive(s_lock);
+}
+
+void oai_transport_stats_speech_stopped() {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_speech_stopped_us = esp_timer_get_time();
+  xSemaphoreGive(s_lock);
+}
+
+void oai_transport_stats_audio_out() {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (s_speech_stopped_us != 0) {
+    int64_t ms = (esp_timer_get_time() - s_speech_stopped_us) / 1000;
+    s_speech_stopped_us = 0;
+    s_responses++;
+    s_latency_total_ms += ms;
+    s_latency_max_ms = std::max(s_latency_max_ms, ms);
+  }
+  xSemaphoreGive(s_lock);
+}
+
+void oai_transport_stats_poll() {
+  int64_t now = esp_timer_get_time();
+  if (now < s_next_log_us) {
+    return;
+  }
+  s_next_log_us = now + kLogIntervalUs;
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  Busy uplink = s_uplink;
+  Busy downlink = s_downlink;
+  uint32_t responses = s_responses;
+  int64_t latency_avg_ms = responses ? s_latency_total_ms / responses : 0;
+  int64_t latency_max_ms = s_latency_max_ms;
+  s_uplink = {};
+  s_downlink = {};
+  s_responses = 0;
+  s_latency_total_ms = 0;
+  s_latency_max_ms = 0;
+  xSemaphoreGive(s_lock);
+
+  ESP_LOGI(TAG,
+           "%s: internal free %u (min %u) | loop stack left %u bytes | uplink "
+           "%lld us/frame (max %lld) | downlink %lld us/frame (max %lld) | "
+           "response latency %lld ms (max %lld, %lu responses)",
+           s_transport, (unsigned)internal_free(),
+           (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+           (unsigned)uxTaskGetStackHighWaterMark(nullptr),
+           (long long)uplink.avg_us(), (long long)uplink.max_us,
+           (long long)downlink.avg_us(), (long long)downlink.max_us,
+           (long long)latency_avg_ms, (long long)latency_max_ms,
+           (unsigned long)responses);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+// Resource and latency figures of the realtime transport, logged the same
+// way for WebRTC and WebSocket so the two can be compared on one board.
+//
+// Internal RAM is sampled when a session starts and once it is connected.
+// Uplink and downlink time is the CPU time per frame spent between the
+// microphone and the transport, and between the transport and the speaker
+// queue. Response latency runs from input_audio_buffer.speech_stopped to the
+// first audio of the answer.
+
+// Creates the statistics lock, called once before the first session.
+void oai_transport_stats_init(const char *transport);
+void oai_transport_stats_session_start();
+void oai_transport_stats_connected();
+
+void oai_transport_stats_uplink(int64_t busy_us);
+void oai_transport_stats_downlink(int64_t busy_us);
+void oai_transport_stats_speech_stopped();
+void oai_transport_stats_audio_out();
+
+// Logs the statistics every 10 seconds, called from the session loop.
+void oai_transport_stats_poll();
@@ -0,0 +1,94 @@
+#include "trigger.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "bsp.h"
+#include "codec.h"
+
+constexpr const char *TAG = "trigger";
+
+namespace {
+
+// Polls further apart than this were interrupted by a session, the
+// detector starts over.
+constexpr int64_t kResumeGapUs = 100000;
+
+#ifdef CONFIG_SESSION_TRIGGER_VAD
+// Speech has to be this many times the noise floor in energy, 6 dB.
+constexpr int64_t kFloorRatio = 4;
+// Floor update weight 1/16 per quiet frame. Loud frames move it by 1/256,
+// so a steady noise above the threshold stops triggering after a while.
+constexpr int kFloorShift = 4;
+constexpr int kLoudFloorShift = 8;
+constexpr int64_t kMinEnergy =
+    (int64_t)CONFIG_SESSION_VAD_THRESHOLD * CONFIG_SESSION_VAD_THRESHOLD;
+
+int64_t s_floor = kMinEnergy;
+int64_t s_speech_us = 0;
+
+bool vad(const int16_t *pcm, size_t samples) {
+  if (samples == 0) {
+    return false;
+  }
+  int64_t energy = 0;
+  for (size_t i = 0; i < samples; i++) {
+    energy += (int32_t)pcm[i] * pcm[i];
+  }
+  energy /= (int64_t)samples;
+
+  if (energy < kMinEnergy || energy < s_floor * kFloorRatio) {
+    s_floor += (energy - s_floor) >> kFloorShift;
+    s_speech_us = 0;
+    return false;
+  }
+  s_floor += (energy - s_floor) >> kLoudFloorShift;
+  s_speech_us += samples * 1000000LL / SAMPLE_RATE;
+  return s_speech_us >= CONFIG_SESSION_VAD_HOLD_MS * 1000LL;
+}
+#endif  // CONFIG_SESSION_TRIGGER_VAD
+
+#ifdef CONFIG_SESSION_TRIGGER_BUTTON
+bool s_button_down = false;
+#endif
+
+int64_t s_last_poll_us = 0;
+
+}  // namespace
+
+void oai_trigger_init() {
+#ifdef CONFIG_SESSION_TRIGGER_BUTTON
+  bsp_session_button_init();
+#endif
+}
+
+const char *oai_trigger_poll(const int16_t *pcm, size_t samples) {
+  int64_t now = esp_timer_get_time();
+  bool resumed = now - s_last_poll_us > kResumeGapUs;
+  s_last_poll_us = now;
+  const char *source = nullptr;
+
+#ifdef CONFIG_SESSION_TRIGGER_VAD
+  if (resumed) {
+    s_speech_us = 0;
+  }
+  if (pcm != nullptr && vad(pcm, samples)) {
+    s_speech_us = 0;
+    source = "vad";
+  }
+#endif
+#ifdef CONFIG_SESSION_TRIGGER_BUTTON
+  // Fires on the press, a button held through a session does not fire
+  // again when it ends.
+  bool down = bsp_session_button_pressed();
+  if (down && !s_button_down && !resumed) {
+    source = "button";
+  }
+  s_button_down = down;
+#endif
+
+  if (source != nullptr) {
+    ESP_LOGI(TAG, "Triggered by %s", source);
+  }
+  return source;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Local triggers that bring up a session with CONFIG_SESSION_LAZY.
+//
+// The microphone is checked with an energy detector against a noise floor
+// that tracks the room, and a button is read through the bsp layer. Both
+// are polled by the audio publisher while no session is connected.
+
+void oai_trigger_init();
+
+// Feeds one microphone frame, or nothing with pcm == nullptr when only the
+// button is enabled. Returns the name of the trigger that fired, or nullptr.
+const char *oai_trigger_poll(const int16_t *pcm, size_t samples);
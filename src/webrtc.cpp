@@ -1,47 +1,400 @@
 #ifndef LINUX_BUILD
 #include <driver/i2s.h>
+#include <esp_random.h>
 #include <opus.h>
+#else
+#include <stdlib.h>
 #endif
 
+#include <assert.h>
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+
+#include "codec.h"
+#include "events.h"
 #include "main.h"
+#include "mem.h"
+#include "peer_wait.h"
+#include "power.h"
+#include "rtc_stats.h"
+#include "settings.h"
+#include "tools.h"
+#ifndef LINUX_BUILD
+#include "wifi_connect.h"
+#endif
+#ifdef CONFIG_RB_STATS
+#include "rb_stats.h"
+#endif
+#ifdef CONFIG_ALLOC_TRACK
+#include "alloc_track.h"
+#endif
+#ifdef CONFIG_CAPTIONS
+#include "captions.h"
+#endif
+#ifdef CONFIG_GREETING_CACHE
+#include "greeting.h"
+#endif
+#ifdef CONFIG_TRANSPORT_STATS
+#include "transport_stats.h"
+#endif
+#ifdef CONFIG_RECORD
+#include "record.h"
+#endif
+#ifdef CONFIG_SESSION_LAZY
+#include "trigger.h"
+#endif
 
-#define TICK_INTERVAL 15
-#define GREETING                                                    \
-  "{\"type\": \"response.create\", \"response\": {\"modalities\": " \
-  "[\"audio\", \"text\"], \"instructions\": \"Say 'How can I help?.'\"}}"
+#define GREETING "Say 'How can I help?.'"
 
-PeerConnection *peer_connection = NULL;
+static PeerConnection *s_peer_connection = NULL;
+
+// Session manager state. The callbacks below run on the thread that calls
+// peer_connection_loop(), the audio publisher only reads the flags.
+static std::atomic<bool> s_session_connected{false};
+static std::atomic<bool> s_session_failed{false};
+static int64_t s_session_started_us = 0;
+static int64_t s_session_connected_us = 0;
+static bool s_first_audio_logged = false;
+static int64_t s_session_lost_us = 0;
+static uint32_t s_session_attempt = 0;
+
+#ifdef CONFIG_SESSION_LAZY
+// The peer connection and its offer are created ahead of time, the offer is
+// posted once a local trigger fires. s_session_triggered is only set by the
+// audio publisher and only cleared by the session manager.
+static std::atomic<bool> s_session_triggered{false};
+static const char *s_trigger_source = "";
+static int64_t s_trigger_us = 0;
+static char *s_offer_buffer = nullptr;
+static bool s_offer_ready = false;
+// Closed on purpose, after the idle timeout or a Wi-Fi drop before the
+// trigger. Not counted as a failure.
+static bool s_session_parked = false;
+#endif  // CONFIG_SESSION_LAZY
+
+// The peer loop sleeps until libpeer's sockets have a packet, another task
+// wakes it or a timer is due, instead of sleeping a fixed tick.
+static std::atomic<int64_t> s_peer_loop_wakeup_us{0};
+// Retry interval for events the transport refused.
+constexpr uint32_t kPeerLoopRetryMs = 10;
+
+#ifdef CONFIG_PEER_LOOP_STATS
+static struct {
+  int64_t window_start_us;
+  uint32_t iterations;
+  uint32_t notified_wakeups;
+  uint32_t inbound_wakeups;
+  uint32_t timer_wakeups;
+  int64_t busy_us;
+  int64_t wake_latency_sum_us;
+  int64_t wake_latency_max_us;
+  int64_t gap_max_us;
+} s_peer_loop_stats;
+#endif  // CONFIG_PEER_LOOP_STATS
+
+void oai_peer_loop_wakeup() {
+  int64_t expected = 0;
+  s_peer_loop_wakeup_us.compare_exchange_strong(expected,
+                                                esp_timer_get_time());
+  oai_peer_wait_notify();
+}
+
+// The longest the loop may sleep without a packet or a wakeup. libpeer sends
+// its connectivity checks once per iteration during setup. Once connected,
+// only libpeer's keepalive and the application timers are left.
+static uint32_t oai_peer_loop_timeout_ms() {
+  if (!s_session_connected) {
+    return CONFIG_PEER_LOOP_SETUP_POLL_MS;
+  }
+  uint32_t timeout_ms = CONFIG_PEER_LOOP_TIMER_MS;
+#if CONFIG_LIBPEER_KEEPALIVE_CONNCHECK > 0
+  timeout_ms =
+      std::min<uint32_t>(timeout_ms, CONFIG_LIBPEER_KEEPALIVE_CONNCHECK);
+#endif
+  if (oai_events_pending()) {
+    timeout_ms = std::min(timeout_ms, kPeerLoopRetryMs);
+  }
+#ifdef CONFIG_GREETING_CACHE
+  if (int64_t due_us = oai_greeting_due_us(); due_us != 0) {
+    int64_t wait_ms = (due_us - esp_timer_get_time() + 999) / 1000;
+    timeout_ms = std::clamp<int64_t>(wait_ms, 0, timeout_ms);
+  }
+#endif
+  return timeout_ms;
+}
+
+static void oai_peer_loop_wait() {
+  int64_t now = esp_timer_get_time();
+  // libpeer reads its sockets on every iteration once ICE has connected.
+  OaiPeerWake wake =
+      oai_peer_wait(oai_peer_loop_timeout_ms(), s_session_connected);
+  int64_t queued_us = s_peer_loop_wakeup_us.exchange(0);
+
+#ifdef CONFIG_PEER_LOOP_STATS
+  int64_t woke_us = esp_timer_get_time();
+  switch (wake) {
+    case OaiPeerWake::kNotified:
+      s_peer_loop_stats.notified_wakeups++;
+      if (queued_us != 0) {
+        s_peer_loop_stats.wake_latency_sum_us += woke_us - queued_us;
+        s_peer_loop_stats.wake_latency_max_us = std::max(
+            s_peer_loop_stats.wake_latency_max_us, woke_us - queued_us);
+      }
+      break;
+    case OaiPeerWake::kInbound:
+      s_peer_loop_stats.inbound_wakeups++;
+      break;
+    case OaiPeerWake::kTimeout:
+      s_peer_loop_stats.timer_wakeups++;
+      break;
+  }
+  if (s_session_connected) {
+    s_peer_loop_stats.gap_max_us =
+        std::max(s_peer_loop_stats.gap_max_us, woke_us - now);
+  }
+#else
+  (void)now;
+  (void)wake;
+  (void)queued_us;
+#endif  // CONFIG_PEER_LOOP_STATS
+}
+
+// Logs how long the user waited to hear something, once per session.
+static void oai_first_audio(const char *source) {
+  if (s_first_audio_logged) {
+    return;
+  }
+  s_first_audio_logged = true;
+  int64_t now = esp_timer_get_time();
+  ESP_LOGI(LOG_TAG,
+           "First audio (%s) %lld ms after session start, %lld ms after "
+           "connect",
+           source, (long long)(now - s_session_started_us) / 1000,
+           (long long)(now - s_session_connected_us) / 1000);
+}
+
+#ifdef CONFIG_GREETING_CACHE
+static void oai_greeting_iterate() {
+  if (oai_greeting_poll() > 0) {
+    oai_first_audio("cached greeting");
+    oai_power_activity(OaiPowerActivity::kPlayback);
+  }
+}
+#endif
+
+static void oai_peer_loop_iterate() {
+#ifdef CONFIG_PEER_LOOP_STATS
+  int64_t start_us = esp_timer_get_time();
+  peer_connection_loop(s_peer_connection);
+#ifdef CONFIG_GREETING_CACHE
+  oai_greeting_iterate();
+#endif
+  oai_tools_poll();
+  oai_power_poll();
+  oai_events_flush();
+#ifdef CONFIG_ALLOC_TRACK
+  oai_alloc_track_poll();
+#endif
+  int64_t end_us = esp_timer_get_time();
+  s_peer_loop_stats.iterations++;
+  s_peer_loop_stats.busy_us += end_us - start_us;
+
+  int64_t window_us = end_us - s_peer_loop_stats.window_start_us;
+  if (window_us >= CONFIG_PEER_LOOP_STATS_INTERVAL_MS * 1000LL) {
+    uint32_t notified = s_peer_loop_stats.notified_wakeups;
+    int64_t busy = s_peer_loop_stats.busy_us;
+    ESP_LOGI(LOG_TAG,
+             "peer loop: %lld iter/s (inbound %lld, notified %lld, timer "
+             "%lld) | busy %lld.%02lld%% | wake latency avg %lld us max %lld "
+             "us | max gap %lld us | %d sockets",
+             (long long)(s_peer_loop_stats.iterations * 1000000LL / window_us),
+             (long long)(s_peer_loop_stats.inbound_wakeups * 1000000LL /
+                         window_us),
+             (long long)(notified * 1000000LL / window_us),
+             (long long)(s_peer_loop_stats.timer_wakeups * 1000000LL /
+                         window_us),
+             (long long)(busy * 100 / window_us),
+             (long long)(busy * 10000 / window_us % 100),
+             (long long)(notified ? s_peer_loop_stats.wake_latency_sum_us /
+                                        notified
+                                  : 0),
+             (long long)s_peer_loop_stats.wake_latency_max_us,
+             (long long)s_peer_loop_stats.gap_max_us,
+             oai_peer_wait_sockets());
+    s_peer_loop_stats = {};
+    s_peer_loop_stats.window_start_us = end_us;
+  }
+#else
+  peer_connection_loop(s_peer_connection);
+#ifdef CONFIG_GREETING_CACHE
+  oai_greeting_iterate();
+#endif
+  oai_tools_poll();
+  oai_power_poll();
+  oai_events_flush();
+#ifdef CONFIG_ALLOC_TRACK
+  oai_alloc_track_poll();
+#endif
+#endif  // CONFIG_PEER_LOOP_STATS
+}
 
 #ifndef LINUX_BUILD
 StaticTask_t task_buffer;
+static TaskHandle_t s_audio_publisher = nullptr;
+// Held by the publisher while it uses s_peer_connection, so that a teardown
+// never frees the connection in the middle of a frame.
+static SemaphoreHandle_t s_audio_publisher_lock = nullptr;
+
+#ifdef CONFIG_SESSION_LAZY
+static void oai_session_trigger(const char *source) {
+  if (s_session_triggered) {
+    return;
+  }
+  s_trigger_source = source;
+  s_trigger_us = esp_timer_get_time();
+  s_session_triggered = true;
+  oai_peer_loop_wakeup();
+}
+
+// Runs instead of the publisher while no session is connected.
+static void oai_session_listen() {
+  const int16_t *pcm = nullptr;
+  size_t samples = 0;
+#ifdef CONFIG_SESSION_TRIGGER_VAD
+  // Paced by the I2S read.
+  pcm = oai_audio_capture(&samples);
+#else
+  vTaskDelay(pdMS_TO_TICKS(20));
+#endif
+  if (const char *source = oai_trigger_poll(pcm, samples)) {
+    oai_session_trigger(source);
+  }
+}
+#endif  // CONFIG_SESSION_LAZY
+
 void oai_send_audio_task(void *user_data) {
   oai_init_audio_encoder();
+  OaiSettingsView settings;
+#ifdef CONFIG_ALLOC_TRACK
+  oai_alloc_track_register("audio_publisher");
+#endif
 
   while (1) {
-    oai_send_audio(peer_connection);
-    vTaskDelay(pdMS_TO_TICKS(TICK_INTERVAL));
+    if (!s_session_connected) {
+#ifdef CONFIG_SESSION_LAZY
+      oai_session_listen();
+#else
+      // Parked until the next session reaches PEER_CONNECTION_CONNECTED.
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+      continue;
+    }
+    xSemaphoreTake(s_audio_publisher_lock, portMAX_DELAY);
+    if (s_session_connected) {
+      oai_send_audio(s_peer_connection);
+    }
+    xSemaphoreGive(s_audio_publisher_lock);
+    oai_peer_loop_wakeup();
+    settings.refresh();
+    vTaskDelay(pdMS_TO_TICKS(settings.get().publish_ms));
   }
 }
+
+static void oai_start_audio_publisher() {
+  if (s_audio_publisher != nullptr) {
+    xTaskNotifyGive(s_audio_publisher);
+    return;
+  }
+
+#ifdef AUDIO_CODEC_G711
+  constexpr size_t stack_size = 8192;
+#else
+  constexpr size_t stack_size = 20000;
+#endif
+  // The encoder runs on this stack every frame, so it is hot.
+  StackType_t *stack_memory = (StackType_t *)oai_mem_alloc(
+      stack_size * sizeof(StackType_t), OaiMemPlacement::kHot);
+  if (stack_memory == nullptr) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate stack memory for audio publisher.");
+    esp_restart();
+  }
+  s_audio_publisher = xTaskCreateStaticPinnedToCore(
+      oai_send_audio_task, "audio_publisher", stack_size, NULL, 7,
+      stack_memory, &task_buffer, 0);
+}
+#endif
+
+static uint32_t oai_session_backoff_ms(uint32_t attempt) {
+  // The first retry after a drop is immediate, the following ones back off
+  // exponentially with equal jitter, a random wait in [delay/2, delay].
+  if (attempt == 0) {
+    return 0;
+  }
+  uint32_t delay = CONFIG_SESSION_RECONNECT_BACKOFF_MAX_MS;
+  if (attempt < 16) {
+    delay = std::min<uint32_t>(
+        CONFIG_SESSION_RECONNECT_BACKOFF_BASE_MS << (attempt - 1),
+        CONFIG_SESSION_RECONNECT_BACKOFF_MAX_MS);
+  }
+#ifndef LINUX_BUILD
+  uint32_t jitter = esp_random();
+#else
+  uint32_t jitter = (uint32_t)rand();
 #endif
+  return delay / 2 + jitter % (delay / 2 + 1);
+}
 
 static void oai_ondatachannel_onmessage_task(char *msg, size_t len,
                                              void *userdata, uint16_t sid) {
+#ifdef CONFIG_RECORD
+  oai_record_event(msg, len, esp_timer_get_time());
+#endif
 #ifdef LOG_DATACHANNEL_MESSAGES
   ESP_LOGI(LOG_TAG, "DataChannel Message: %s", msg);
 #endif
+  oai_power_activity(OaiPowerActivity::kDataChannel);
+  oai_event_dispatch(msg, len);
+}
+
+static int oai_datachannel_send(const char *data, size_t len) {
+  return peer_connection_datachannel_send(s_peer_connection, (char *)data,
+                                          len);
 }
 
 static void oai_ondatachannel_onopen_task(void *userdata) {
-  if (peer_connection_create_datachannel(peer_connection, DATA_CHANNEL_RELIABLE,
-                                         0, 0, (char *)"oai-events",
-                                         (char *)"") != -1) {
+  if (peer_connection_create_datachannel(
+          s_peer_connection, DATA_CHANNEL_RELIABLE, 0, 0, (char *)"oai-events",
+          (char *)"") != -1) {
     ESP_LOGI(LOG_TAG, "DataChannel created");
-    peer_connection_datachannel_send(peer_connection, (char *)GREETING,
-                                     strlen(GREETING));
+    oai_events_attach(oai_datachannel_send);
+    oai_tools_send_session_update();
+#ifdef CONFIG_CAPTIONS
+    oai_captions_session_open();
+#endif
+#ifdef CONFIG_GREETING_CACHE
+    if (char transcript[GREETING_TRANSCRIPT_SIZE];
+        oai_greeting_cached(GREETING) &&
+        oai_greeting_transcript(GREETING, transcript)) {
+      // Already playing from flash. With the greeting in the conversation
+      // the model does not greet again, and its instructions stay as they
+      // are.
+      oai_send_assistant_message(transcript);
+    } else {
+      oai_greeting_capture_begin(GREETING);
+      oai_send_response_create(GREETING);
+    }
+#else
+    oai_send_response_create(GREETING);
+#endif
+#ifdef CONFIG_ALLOC_TRACK
+    // The last step of the session setup.
+    oai_alloc_track_steady(true);
+#endif
   } else {
     ESP_LOGE(LOG_TAG, "Failed to create DataChannel");
   }
@@ -53,43 +406,96 @@ static void oai_onconnectionstatechange_task(PeerConnectionState state,
            peer_connection_state_to_string(state));
 
   if (state == PEER_CONNECTION_DISCONNECTED ||
-      state == PEER_CONNECTION_CLOSED) {
-#if !defined(LINUX_BUILD) && defined(CONFIG_DISABLE_CONFIGURATOR_AFTER_PROVISIONED)
-    esp_restart();
-#endif
+      state == PEER_CONNECTION_CLOSED || state == PEER_CONNECTION_FAILED) {
+    s_session_failed = true;
   } else if (state == PEER_CONNECTION_CONNECTED) {
-#ifndef LINUX_BUILD
-    constexpr size_t stack_size = 20000;
-    // Allocate the stack memory from the PSRAM if available. Otherwise, allocate from the internal memory.
-    StackType_t *stack_memory = (StackType_t *)heap_caps_malloc_prefer(
-        stack_size * sizeof(StackType_t), 2, 
-        MALLOC_CAP_SPIRAM   | MALLOC_CAP_8BIT, 
-        MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
-    if (stack_memory == nullptr) {
-      ESP_LOGE(LOG_TAG, "Failed to allocate stack memory for audio publisher.");
-      esp_restart();
+    int64_t now = esp_timer_get_time();
+    if (s_session_lost_us != 0) {
+      ESP_LOGI(LOG_TAG,
+               "Session recovered in %lld ms (setup %lld ms, %lu attempts)",
+               (long long)(now - s_session_lost_us) / 1000,
+               (long long)(now - s_session_started_us) / 1000,
+               (unsigned long)s_session_attempt + 1);
+    } else {
+      ESP_LOGI(LOG_TAG, "Session connected in %lld ms",
+               (long long)(now - s_session_started_us) / 1000);
     }
-    xTaskCreateStaticPinnedToCore(oai_send_audio_task, "audio_publisher", stack_size,
-                                  NULL, 7, stack_memory, &task_buffer, 0);
+#ifdef CONFIG_SESSION_LAZY
+    ESP_LOGI(LOG_TAG, "Trigger (%s) to connected %lld ms", s_trigger_source,
+             (long long)(now - s_trigger_us) / 1000);
+#endif
+    s_session_lost_us = 0;
+    s_session_attempt = 0;
+    s_session_connected_us = now;
+    s_session_connected = true;
+#ifdef CONFIG_TRANSPORT_STATS
+    oai_transport_stats_connected();
+#endif
+#ifdef CONFIG_GREETING_CACHE
+    if (oai_greeting_cached(GREETING)) {
+      oai_greeting_play();
+    }
+#endif
+#ifndef LINUX_BUILD
+    oai_start_audio_publisher();
 #endif
   }
 }
 
+// The SDP answer, written once per session.
+static char *s_answer_buffer = nullptr;
+
+static void oai_session_signal(const char *description) {
+  if (s_answer_buffer == nullptr) {
+    s_answer_buffer = (char *)oai_mem_alloc(MAX_HTTP_OUTPUT_BUFFER + 1,
+                                            OaiMemPlacement::kCold);
+    if (s_answer_buffer == nullptr) {
+      ESP_LOGE(LOG_TAG, "Failed to allocate the SDP answer buffer");
+      s_session_failed = true;
+      return;
+    }
+  }
+  memset(s_answer_buffer, 0, MAX_HTTP_OUTPUT_BUFFER + 1);
+  if (oai_http_request((char *)description, s_answer_buffer) != ESP_OK) {
+    s_session_failed = true;
+    return;
+  }
+  peer_connection_set_remote_description(s_peer_connection, s_answer_buffer);
+}
+
 static void oai_on_icecandidate_task(char *description, void *user_data) {
-  char local_buffer[MAX_HTTP_OUTPUT_BUFFER + 1] = {0};
-  oai_http_request(description, local_buffer);
-  peer_connection_set_remote_description(peer_connection, local_buffer);
+#ifdef CONFIG_SESSION_LAZY
+  if (!s_session_triggered) {
+    size_t len = strlen(description);
+    if (len > MAX_HTTP_OUTPUT_BUFFER) {
+      ESP_LOGE(LOG_TAG, "Offer too long to pre-warm");
+      s_session_failed = true;
+      return;
+    }
+    memcpy(s_offer_buffer, description, len + 1);
+    s_offer_ready = true;
+    ESP_LOGI(LOG_TAG, "Session pre-warmed in %lld ms",
+             (long long)(esp_timer_get_time() - s_session_started_us) / 1000);
+    return;
+  }
+#endif
+  oai_session_signal(description);
 }
 
-void oai_webrtc() {
+static bool oai_session_connect() {
   PeerConfiguration peer_connection_config = {
       .ice_servers = {},
-      .audio_codec = CODEC_OPUS,
+      .audio_codec = oai_audio_codec_media(AUDIO_CODEC),
       .video_codec = CODEC_NONE,
       .datachannel = DATA_CHANNEL_STRING,
       .onaudiotrack = [](uint8_t *data, size_t size, void *userdata) -> void {
+        oai_first_audio("live");
+#ifdef CONFIG_GREETING_CACHE
+        oai_greeting_capture_packet(data, size);
+#endif
 #ifndef LINUX_BUILD
         oai_audio_decode(data, size);
+        oai_power_activity(OaiPowerActivity::kPlayback);
 #endif
       },
       .onvideotrack = NULL,
@@ -97,25 +503,202 @@ void oai_webrtc() {
       .user_data = NULL,
   };
 
-  peer_connection = peer_connection_create(&peer_connection_config);
-  if (peer_connection == NULL) {
-    ESP_LOGE(LOG_TAG, "Failed to create peer connection");
-#ifndef LINUX_BUILD
-    esp_restart();
+  s_session_failed = false;
+  s_session_started_us = esp_timer_get_time();
+  s_first_audio_logged = false;
+  oai_rtc_stats_reset();
+#ifdef CONFIG_RECORD
+  oai_record_begin();
+#endif
+  oai_power_session(true);
+#ifdef CONFIG_TRANSPORT_STATS
+  oai_transport_stats_session_start();
 #endif
+#ifdef CONFIG_RB_STATS
+  oai_rb_stats_reset();
+  size_t internal_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+#endif
+  s_peer_connection = peer_connection_create(&peer_connection_config);
+  if (s_peer_connection == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to create peer connection");
+    return false;
   }
+#ifdef CONFIG_RB_STATS
+  internal_free -= heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+  ESP_LOGI(LOG_TAG, "Peer connection took %d bytes of internal SRAM",
+           (int)internal_free);
+#endif
 
-  peer_connection_oniceconnectionstatechange(peer_connection,
+  peer_connection_oniceconnectionstatechange(s_peer_connection,
                                              oai_onconnectionstatechange_task);
-  peer_connection_onicecandidate(peer_connection, oai_on_icecandidate_task);
-  peer_connection_ondatachannel(peer_connection,
+  peer_connection_onicecandidate(s_peer_connection, oai_on_icecandidate_task);
+  peer_connection_ondatachannel(s_peer_connection,
                                 oai_ondatachannel_onmessage_task,
                                 oai_ondatachannel_onopen_task, NULL);
 
-  peer_connection_create_offer(peer_connection);
+  peer_connection_create_offer(s_peer_connection);
+  return true;
+}
+
+// Destroys only the PeerConnection. Wi-Fi, I2S, the Opus state and the audio
+// publisher task stay alive for the next session.
+static void oai_session_teardown() {
+#ifdef CONFIG_SESSION_LAZY
+  // A failed session keeps its trigger and reconnects right away.
+  if (s_session_parked) {
+    s_session_triggered = false;
+  }
+  s_offer_ready = false;
+#endif
+  s_session_connected = false;
+#ifdef CONFIG_ALLOC_TRACK
+  oai_alloc_track_steady(false);
+#endif
+  oai_events_attach(nullptr);
+  oai_tools_reset();
+  oai_power_session(false);
+#ifdef CONFIG_GREETING_CACHE
+  oai_greeting_stop();
+#endif
+#ifdef CONFIG_RECORD
+  oai_record_end();
+#endif
+  if (s_session_lost_us == 0) {
+    s_session_lost_us = esp_timer_get_time();
+  }
+#ifdef CONFIG_SESSION_LAZY
+  if (s_session_parked) {
+    s_session_lost_us = 0;
+  }
+#endif
+  if (s_peer_connection == NULL) {
+    return;
+  }
+#ifndef LINUX_BUILD
+  xSemaphoreTake(s_audio_publisher_lock, portMAX_DELAY);
+#endif
+  peer_connection_close(s_peer_connection);
+  peer_connection_destroy(s_peer_connection);
+  s_peer_connection = NULL;
+#ifndef LINUX_BUILD
+  xSemaphoreGive(s_audio_publisher_lock);
+#endif
+}
+
+#ifdef CONFIG_SESSION_LAZY
+// Holds the pre-warmed peer connection until a trigger fires, then posts its
+// offer. Returns false if the session has to be built again first.
+static bool oai_session_wait_trigger() {
+  while (!s_session_triggered) {
+    if (s_session_failed) {
+      return false;
+    }
+    if (!oai_wifi_wait_connected(0)) {
+      // The host candidates of the offer went away with the address.
+      s_session_parked = true;
+      return false;
+    }
+    if (!s_offer_ready) {
+      peer_connection_loop(s_peer_connection);
+    }
+    oai_power_poll();
+    oai_peer_wait(s_offer_ready ? 1000 : CONFIG_PEER_LOOP_SETUP_POLL_MS,
+                  false);
+  }
+  s_peer_loop_wakeup_us = 0;
+  // The idle timeout and the connect timeout run from the trigger.
+  oai_power_session(true);
+  s_session_started_us = s_trigger_us;
+  if (s_offer_ready) {
+    oai_session_signal(s_offer_buffer);
+  }
+  return !s_session_failed;
+}
+#endif  // CONFIG_SESSION_LAZY
+
+void oai_webrtc() {
+#ifndef LINUX_BUILD
+  s_audio_publisher_lock = xSemaphoreCreateMutex();
+  assert(s_audio_publisher_lock != nullptr);
+#endif
+  oai_peer_wait_init();
+  oai_events_init();
+  oai_rtc_stats_init();
+#ifdef CONFIG_RB_STATS
+  oai_rb_stats_init();
+#endif
+  oai_tools_start();
+#ifdef CONFIG_ALLOC_TRACK
+  oai_alloc_track_register("peer_loop");
+#endif
+#ifdef CONFIG_TRANSPORT_STATS
+  oai_transport_stats_init("webrtc");
+#endif
+  ESP_LOGI(LOG_TAG, "Audio codec %s", oai_audio_codec_name(AUDIO_CODEC));
+#ifdef CONFIG_SESSION_LAZY
+  s_offer_buffer = (char *)oai_mem_alloc(MAX_HTTP_OUTPUT_BUFFER + 1,
+                                         OaiMemPlacement::kCold);
+  assert(s_offer_buffer != nullptr);
+  oai_trigger_init();
+  // Listens for the trigger from the start.
+  oai_start_audio_publisher();
+#endif
 
   while (1) {
-    peer_connection_loop(peer_connection);
-    vTaskDelay(pdMS_TO_TICKS(TICK_INTERVAL));
+#ifndef LINUX_BUILD
+    // Wi-Fi reconnects on its own, do not burn session attempts meanwhile.
+    oai_wifi_wait_connected(portMAX_DELAY);
+#endif
+    bool started = oai_session_connect();
+#ifdef CONFIG_SESSION_LAZY
+    started = started && oai_session_wait_trigger();
+#endif
+    if (started) {
+      while (!s_session_failed) {
+        oai_peer_loop_iterate();
+#ifdef CONFIG_TRANSPORT_STATS
+        oai_transport_stats_poll();
+#endif
+        if (!s_session_connected &&
+            esp_timer_get_time() - s_session_started_us >
+                CONFIG_SESSION_CONNECT_TIMEOUT_MS * 1000LL) {
+          ESP_LOGW(LOG_TAG, "Session setup timed out");
+          s_session_failed = true;
+        }
+#ifdef CONFIG_SESSION_LAZY
+        if (s_session_connected &&
+            oai_power_idle_for(CONFIG_SESSION_IDLE_TIMEOUT_S * 1000000LL)) {
+          ESP_LOGI(LOG_TAG, "Session idle for %d s, closing it",
+                   CONFIG_SESSION_IDLE_TIMEOUT_S);
+          s_session_parked = true;
+          s_session_failed = true;
+        }
+#endif
+        oai_peer_loop_wait();
+      }
+    }
+    oai_session_teardown();
+#ifdef CONFIG_SESSION_LAZY
+    if (s_session_parked) {
+      // Pre-warm the next session and wait for its trigger.
+      s_session_parked = false;
+      s_session_attempt = 0;
+      continue;
+    }
+#endif
+
+#if !defined(LINUX_BUILD) && CONFIG_SESSION_MAX_RECONNECT_ATTEMPTS > 0
+    if (s_session_attempt >= CONFIG_SESSION_MAX_RECONNECT_ATTEMPTS) {
+      ESP_LOGE(LOG_TAG, "Giving up after %lu reconnect attempts",
+               (unsigned long)s_session_attempt);
+      esp_restart();
+    }
+#endif
+    uint32_t delay_ms = oai_session_backoff_ms(s_session_attempt++);
+    ESP_LOGI(LOG_TAG, "Reconnecting session in %lu ms (attempt %lu)",
+             (unsigned long)delay_ms, (unsigned long)s_session_attempt);
+    if (delay_ms > 0) {
+      vTaskDelay(pdMS_TO_TICKS(delay_ms));
+    }
   }
 }
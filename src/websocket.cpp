@@ -0,0 +1,516 @@
+#include "websocket.h"
+
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <esp_websocket_client.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <mbedtls/base64.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "codec.h"
+#include "events.h"
+#include "g711.h"
+#include "main.h"
+#include "mem.h"
+#include "playback.h"
+#include "power.h"
+#include "settings.h"
+#include "tools.h"
+#include "wifi_connect.h"
+#ifdef CONFIG_CAPTIONS
+#include "captions.h"
+#endif
+#ifdef CONFIG_TRANSPORT_STATS
+#include "transport_stats.h"
+#endif
+
+#define GREETING "Say 'How can I help?.'"
+
+constexpr const char *TAG = "websocket";
+
+namespace {
+
+#ifdef CONFIG_WEBSOCKET_AUDIO_PCM16
+constexpr const char *kAudioFormat = "pcm16";
+// The API only takes PCM16 at 24 kHz.
+constexpr size_t kRateFactor = 3;
+constexpr size_t kBytesPerSample = sizeof(int16_t) * kRateFactor;
+#else
+constexpr const char *kAudioFormat = "g711_ulaw";
+constexpr size_t kBytesPerSample = 1;
+#endif
+
+constexpr char kAppendPrefix[] =
+    "{\"type\":\"input_audio_buffer.append\",\"audio\":\"";
+constexpr char kAppendSuffix[] = "\"}";
+constexpr size_t kMaxFrameBytes = MAX_BUFFER_SAMPLES * kBytesPerSample;
+constexpr size_t kMaxAppendSize = sizeof(kAppendPrefix) +
+                                  (kMaxFrameBytes + 2) / 3 * 4 +
+                                  sizeof(kAppendSuffix);
+// Base64 of a delta is decoded in pieces of this many characters.
+constexpr size_t kDeltaChunkChars = 512;
+constexpr size_t kDeltaChunkBytes = kDeltaChunkChars / 4 * 3;
+
+constexpr uint32_t kSendTimeoutMs = 100;
+constexpr uint32_t kLoopPollMs = 20;
+constexpr size_t kPublisherStackSize = 4096;
+
+esp_websocket_client_handle_t s_client = nullptr;
+std::atomic<bool> s_session_open{false};
+std::atomic<bool> s_session_ready{false};
+std::atomic<bool> s_session_failed{false};
+int64_t s_session_started_us = 0;
+uint32_t s_session_attempt = 0;
+SemaphoreHandle_t s_wakeup = nullptr;
+
+TaskHandle_t s_publisher = nullptr;
+// Held by the publisher while it sends, so that a teardown never destroys
+// the client in the middle of a frame.
+SemaphoreHandle_t s_publisher_lock = nullptr;
+StaticSemaphore_t s_publisher_lock_buffer;
+
+// Reassembly of one text message, written by the WebSocket task.
+char *s_rx = nullptr;
+size_t s_rx_len = 0;
+bool s_rx_skip = false;
+
+// Decoded response audio waiting for room in the playback queue. Deltas
+// arrive faster than real time. The WebSocket task only appends here and the
+// session loop moves the audio on as the speaker drains, so the events behind
+// a delta, a barge-in among them, are never held up by playback.
+constexpr size_t kAudioQueueSamples =
+    SAMPLE_RATE * CONFIG_WEBSOCKET_AUDIO_QUEUE_MS / 1000;
+int16_t *s_audio_queue = nullptr;
+size_t s_audio_read = 0;
+size_t s_audio_len = 0;
+size_t s_audio_dropped = 0;
+SemaphoreHandle_t s_audio_lock = nullptr;
+StaticSemaphore_t s_audio_lock_buffer;
+
+// Appends what fits, the rest of a response longer than the queue is lost.
+void audio_queue_push(const int16_t *pcm, size_t samples) {
+  xSemaphoreTake(s_audio_lock, portMAX_DELAY);
+  size_t count = std::min(samples, kAudioQueueSamples - s_audio_len);
+  size_t write = (s_audio_read + s_audio_len) % kAudioQueueSamples;
+  size_t first = std::min(count, kAudioQueueSamples - write);
+  memcpy(s_audio_queue + write, pcm, first * sizeof(int16_t));
+  memcpy(s_audio_queue, pcm + first, (count - first) * sizeof(int16_t));
+  s_audio_len += count;
+  if (count < samples && s_audio_dropped == 0) {
+    ESP_LOGW(TAG, "Audio queue full, dropping response audio");
+  }
+  s_audio_dropped += samples - count;
+  xSemaphoreGive(s_audio_lock);
+}
+
+// Called from the session loop.
+void audio_queue_drain() {
+  xSemaphoreTake(s_audio_lock, portMAX_DELAY);
+  size_t count = std::min(s_audio_len, oai_playback_free());
+  while (count > 0) {
+    size_t first = std::min(count, kAudioQueueSamples - s_audio_read);
+    oai_audio_play_pcm(s_audio_queue + s_audio_read, first);
+    s_audio_read = (s_audio_read + first) % kAudioQueueSamples;
+    s_audio_len -= first;
+    count -= first;
+    oai_power_activity(OaiPowerActivity::kPlayback);
+  }
+  if (s_audio_len == 0 && s_audio_dropped > 0) {
+    ESP_LOGW(TAG, "Dropped %u ms of response audio",
+             (unsigned)(s_audio_dropped * 1000 / SAMPLE_RATE));
+    s_audio_dropped = 0;
+  }
+  xSemaphoreGive(s_audio_lock);
+}
+
+#ifdef CONFIG_WEBSOCKET_AUDIO_PCM16
+// Linear interpolation from 8 kHz to 24 kHz, one input sample behind.
+void upsample(const int16_t *in, size_t count, int16_t *out) {
+  static int16_t prev = 0;
+  for (size_t i = 0; i < count; i++) {
+    int32_t delta = in[i] - prev;
+    for (size_t k = 0; k < kRateFactor; k++) {
+      *out++ = prev + delta * (int32_t)k / (int32_t)kRateFactor;
+    }
+    prev = in[i];
+  }
+}
+
+// Averages every three samples from 24 kHz to 8 kHz. Deltas need not hold a
+// multiple of three samples, the partial sum carries over.
+size_t downsample(const int16_t *in, size_t count, int16_t *out) {
+  static int32_t sum = 0;
+  static size_t phase = 0;
+  size_t written = 0;
+  for (size_t i = 0; i < count; i++) {
+    sum += in[i];
+    if (++phase == kRateFactor) {
+      out[written++] = sum / (int32_t)kRateFactor;
+      sum = 0;
+      phase = 0;
+    }
+  }
+  return written;
+}
+#endif  // CONFIG_WEBSOCKET_AUDIO_PCM16
+
+// Serializes one frame as input_audio_buffer.append, returns its length.
+size_t build_append(const int16_t *pcm, size_t samples, char *message,
+                    size_t size) {
+  static uint8_t frame[kMaxFrameBytes];
+  samples = std::min<size_t>(samples, MAX_BUFFER_SAMPLES);
+#ifdef CONFIG_WEBSOCKET_AUDIO_PCM16
+  // Little-endian, as the API expects.
+  upsample(pcm, samples, (int16_t *)frame);
+#else
+  oai_g711_ulaw_encode(pcm, samples, frame);
+#endif
+
+  constexpr size_t kPrefixLen = sizeof(kAppendPrefix) - 1;
+  memcpy(message, kAppendPrefix, kPrefixLen);
+  size_t encoded = 0;
+  if (mbedtls_base64_encode((unsigned char *)message + kPrefixLen,
+                            size - kPrefixLen - sizeof(kAppendSuffix),
+                            &encoded, frame,
+                            samples * kBytesPerSample) != 0) {
+    return 0;
+  }
+  memcpy(message + kPrefixLen + encoded, kAppendSuffix,
+         sizeof(kAppendSuffix));
+  return kPrefixLen + encoded + sizeof(kAppendSuffix) - 1;
+}
+
+void publisher_task(void *arg) {
+  static char message[kMaxAppendSize];
+  oai_init_audio_encoder();
+
+  while (true) {
+    if (!s_session_ready) {
+      // Parked until the next session is connected.
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+    // The I2S read paces the loop.
+    size_t samples = 0;
+    const int16_t *pcm = oai_audio_capture(&samples);
+#ifdef CONFIG_TRANSPORT_STATS
+    int64_t start_us = esp_timer_get_time();
+#endif
+    size_t len = build_append(pcm, samples, message, sizeof(message));
+    xSemaphoreTake(s_publisher_lock, portMAX_DELAY);
+    if (s_session_ready && len > 0) {
+      esp_websocket_client_send_text(s_client, message, len,
+                                     pdMS_TO_TICKS(kSendTimeoutMs));
+    }
+    xSemaphoreGive(s_publisher_lock);
+#ifdef CONFIG_TRANSPORT_STATS
+    oai_transport_stats_uplink(esp_timer_get_time() - start_us);
+#endif
+  }
+}
+
+void start_publisher() {
+  if (s_publisher != nullptr) {
+    xTaskNotifyGive(s_publisher);
+    return;
+  }
+  if (xTaskCreatePinnedToCore(publisher_task, "audio_publisher",
+                              kPublisherStackSize, nullptr, 7, &s_publisher,
+                              0) != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create the audio publisher");
+    esp_restart();
+  }
+}
+
+int send_event(const char *data, size_t len) {
+  if (!s_session_ready) {
+    return -1;
+  }
+  return esp_websocket_client_send_text(s_client, data, len,
+                                        pdMS_TO_TICKS(kSendTimeoutMs));
+}
+
+void send_audio_formats() {
+  char buf[256];
+  JsonWriter w(buf, sizeof(buf));
+  w.begin_object()
+      .member("type", "session.update")
+      .key("session")
+      .begin_object()
+      .member("input_audio_format", kAudioFormat)
+      .member("output_audio_format", kAudioFormat)
+      .end_object()
+      .end_object();
+  oai_event_enqueue(OaiOutboundKind::kSessionUpdate, w.view());
+}
+
+void on_data(const esp_websocket_event_data_t *event) {
+  // Text frames and their continuations only, the client answers pings.
+  if (event->op_code != 0x1 && event->op_code != 0x0) {
+    return;
+  }
+  if (event->payload_offset == 0) {
+    s_rx_len = 0;
+    s_rx_skip = event->payload_len > CONFIG_WEBSOCKET_RX_BUFFER_SIZE;
+    if (s_rx_skip) {
+      ESP_LOGW(TAG, "Dropped a %d byte message", event->payload_len);
+    }
+  }
+  if (s_rx_skip || event->data_len <= 0) {
+    return;
+  }
+  memcpy(s_rx + event->payload_offset, event->data_ptr, event->data_len);
+  s_rx_len = event->payload_offset + event->data_len;
+  if (s_rx_len < (size_t)event->payload_len) {
+    return;
+  }
+  oai_power_activity(OaiPowerActivity::kDataChannel);
+  oai_event_dispatch(s_rx, s_rx_len);
+}
+
+void on_event(void *arg, esp_event_base_t base, int32_t id, void *data) {
+  switch (id) {
+    case WEBSOCKET_EVENT_CONNECTED:
+      s_session_open = true;
+      break;
+    case WEBSOCKET_EVENT_DATA:
+      on_data((const esp_websocket_event_data_t *)data);
+      return;
+    case WEBSOCKET_EVENT_DISCONNECTED:
+    case WEBSOCKET_EVENT_CLOSED:
+    case WEBSOCKET_EVENT_ERROR:
+      s_session_failed = true;
+      break;
+    default:
+      return;
+  }
+  xSemaphoreGive(s_wakeup);
+}
+
+// https://host/path becomes wss://host/path.
+bool websocket_uri(char *uri, size_t size) {
+  OaiSettings settings;
+  oai_settings_get(&settings);
+  const char *rest = settings.api_uri;
+  const char *scheme = "wss://";
+  if (strncmp(rest, "https://", 8) == 0) {
+    rest += 8;
+  } else if (strncmp(rest, "http://", 7) == 0) {
+    rest += 7;
+    scheme = "ws://";
+  }
+  return snprintf(uri, size, "%s%s", scheme, rest) < (int)size;
+}
+
+bool session_connect() {
+  char uri[sizeof(OaiSettings::api_uri) + 8];
+  if (!websocket_uri(uri, sizeof(uri))) {
+    ESP_LOGE(TAG, "API URI too long");
+    return false;
+  }
+  char authorization[MAX_AUTHORIZATION_SIZE];
+  oai_http_authorization(authorization, sizeof(authorization));
+  char headers[MAX_AUTHORIZATION_SIZE + 64];
+  snprintf(headers, sizeof(headers),
+           "Authorization: %s\r\nOpenAI-Beta: realtime=v1\r\n", authorization);
+
+  esp_websocket_client_config_t config = {};
+  config.uri = uri;
+  config.headers = headers;
+  config.task_stack = 6144;
+  config.disable_auto_reconnect = true;
+  config.network_timeout_ms = CONFIG_SESSION_CONNECT_TIMEOUT_MS;
+
+  s_session_open = false;
+  s_session_ready = false;
+  s_session_failed = false;
+  s_session_started_us = esp_timer_get_time();
+  oai_power_session(true);
+#ifdef CONFIG_TRANSPORT_STATS
+  oai_transport_stats_session_start();
+#endif
+  ESP_LOGI(TAG, "Connecting to %s", uri);
+  s_client = esp_websocket_client_init(&config);
+  if (s_client == nullptr) {
+    ESP_LOGE(TAG, "Failed to create the WebSocket client");
+    return false;
+  }
+  esp_websocket_register_events(s_client, WEBSOCKET_EVENT_ANY, on_event,
+                                nullptr);
+  if (esp_websocket_client_start(s_client) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to start the WebSocket client");
+    return false;
+  }
+  return true;
+}
+
+void on_session_open() {
+  ESP_LOGI(TAG, "Session connected in %lld ms",
+           (long long)(esp_timer_get_time() - s_session_started_us) / 1000);
+#ifdef CONFIG_TRANSPORT_STATS
+  oai_transport_stats_connected();
+#endif
+  s_session_attempt = 0;
+  s_session_ready = true;
+  oai_events_attach(send_event);
+  send_audio_formats();
+  oai_tools_send_session_update();
+#ifdef CONFIG_CAPTIONS
+  oai_captions_session_open();
+#endif
+  oai_send_response_create(GREETING);
+  start_publisher();
+}
+
+void session_teardown() {
+  s_session_ready = false;
+  oai_events_attach(nullptr);
+  oai_tools_reset();
+  oai_power_session(false);
+  if (s_client == nullptr) {
+    return;
+  }
+  xSemaphoreTake(s_publisher_lock, portMAX_DELAY);
+  esp_websocket_client_stop(s_client);
+  esp_websocket_client_destroy(s_client);
+  s_client = nullptr;
+  xSemaphoreGive(s_publisher_lock);
+}
+
+// Same policy as the WebRTC session: immediate first retry, then exponential
+// backoff with equal jitter in [delay/2, delay].
+uint32_t session_backoff_ms(uint32_t attempt) {
+  if (attempt == 0) {
+    return 0;
+  }
+  uint32_t delay = CONFIG_SESSION_RECONNECT_BACKOFF_MAX_MS;
+  if (attempt < 16) {
+    delay = std::min<uint32_t>(
+        CONFIG_SESSION_RECONNECT_BACKOFF_BASE_MS << (attempt - 1),
+        CONFIG_SESSION_RECONNECT_BACKOFF_MAX_MS);
+  }
+  return delay / 2 + esp_random() % (delay / 2 + 1);
+}
+
+}  // namespace
+
+void oai_peer_loop_wakeup() {
+  if (s_wakeup != nullptr) {
+    xSemaphoreGive(s_wakeup);
+  }
+}
+
+void oai_websocket_audio_delta(const JsonValue &delta) {
+  static uint8_t raw[kDeltaChunkBytes];
+  static int16_t pcm[kDeltaChunkBytes];
+  if (delta.has_escapes()) {
+    ESP_LOGW(TAG, "Escaped audio delta");
+    return;
+  }
+  std::string_view base64 = delta.str();
+  for (size_t offset = 0; offset < base64.size();
+       offset += kDeltaChunkChars) {
+    size_t chars = std::min(kDeltaChunkChars, base64.size() - offset);
+    int64_t start_us = esp_timer_get_time();
+    size_t bytes = 0;
+    if (mbedtls_base64_decode(raw, sizeof(raw), &bytes,
+                              (const unsigned char *)base64.data() + offset,
+                              chars) != 0) {
+      ESP_LOGW(TAG, "Invalid audio delta");
+      return;
+    }
+#ifdef CONFIG_WEBSOCKET_AUDIO_PCM16
+    size_t samples =
+        downsample((const int16_t *)raw, bytes / sizeof(int16_t), pcm);
+#else
+    oai_g711_ulaw_decode(raw, bytes, pcm);
+    size_t samples = bytes;
+#endif
+#ifdef CONFIG_TRANSPORT_STATS
+    oai_transport_stats_downlink(esp_timer_get_time() - start_us);
+#else
+    (void)start_us;
+#endif
+
+    audio_queue_push(pcm, samples);
+  }
+  oai_peer_loop_wakeup();
+}
+
+void oai_websocket_audio_flush() {
+  if (s_audio_lock == nullptr) {
+    return;
+  }
+  xSemaphoreTake(s_audio_lock, portMAX_DELAY);
+  s_audio_len = 0;
+  s_audio_dropped = 0;
+  xSemaphoreGive(s_audio_lock);
+}
+
+void oai_websocket() {
+  s_wakeup = xSemaphoreCreateBinary();
+  s_publisher_lock = xSemaphoreCreateMutexStatic(&s_publisher_lock_buffer);
+  s_audio_lock = xSemaphoreCreateMutexStatic(&s_audio_lock_buffer);
+  s_rx = (char *)oai_mem_alloc(CONFIG_WEBSOCKET_RX_BUFFER_SIZE,
+                               OaiMemPlacement::kCold);
+  s_audio_queue = (int16_t *)oai_mem_alloc(
+      kAudioQueueSamples * sizeof(int16_t), OaiMemPlacement::kCold);
+  if (s_wakeup == nullptr || s_rx == nullptr || s_audio_queue == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate the WebSocket session");
+    esp_restart();
+  }
+  oai_events_init();
+  oai_tools_start();
+#ifdef CONFIG_TRANSPORT_STATS
+  oai_transport_stats_init("websocket");
+#endif
+
+  while (true) {
+    // Wi-Fi reconnects on its own, do not burn session attempts meanwhile.
+    oai_wifi_wait_connected(portMAX_DELAY);
+    if (session_connect()) {
+      while (!s_session_failed) {
+        if (s_session_open && !s_session_ready) {
+          on_session_open();
+        }
+        audio_queue_drain();
+        oai_tools_poll();
+        oai_power_poll();
+        oai_events_flush();
+#ifdef CONFIG_TRANSPORT_STATS
+        oai_transport_stats_poll();
+#endif
+        if (!s_session_ready &&
+            esp_timer_get_time() - s_session_started_us >
+                CONFIG_SESSION_CONNECT_TIMEOUT_MS * 1000LL) {
+          ESP_LOGW(TAG, "Session setup timed out");
+          s_session_failed = true;
+        }
+        xSemaphoreTake(s_wakeup, pdMS_TO_TICKS(kLoopPollMs));
+      }
+    }
+    session_teardown();
+    oai_websocket_audio_flush();
+
+#if CONFIG_SESSION_MAX_RECONNECT_ATTEMPTS > 0
+    if (s_session_attempt >= CONFIG_SESSION_MAX_RECONNECT_ATTEMPTS) {
+      ESP_LOGE(TAG, "Giving up after %lu reconnect attempts",
+               (unsigned long)s_session_attempt);
+      esp_restart();
+    }
+#endif
+    uint32_t delay_ms = session_backoff_ms(s_session_attempt++);
+    ESP_LOGI(TAG, "Reconnecting session in %lu ms (attempt %lu)",
+             (unsigned long)delay_ms, (unsigned long)s_session_attempt);
+    if (delay_ms > 0) {
+      vTaskDelay(pdMS_TO_TICKS(delay_ms));
+    }
+  }
+}
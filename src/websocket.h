@@ -0,0 +1,14 @@
+#pragma once
+
+#include "json_stream.h"
+
+// Realtime API over a TLS WebSocket, the low-memory alternative to WebRTC.
+// Audio travels as base64 G.711 or PCM16 inside the JSON events, so there is
+// no DTLS, SRTP, SCTP or ICE state and no Opus codec on the device.
+
+// Queues the audio of a response.audio.delta event for playback. Never
+// blocks, audio past CONFIG_WEBSOCKET_AUDIO_QUEUE_MS is dropped.
+void oai_websocket_audio_delta(const JsonValue &delta);
+
+// Discards the queued response audio, on a barge-in.
+void oai_websocket_audio_flush();
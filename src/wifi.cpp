@@ -20,6 +20,9 @@
 
 #include "main.h"
 #include "bsp.h"
+#include "power.h"
+#include "settings.h"
+#include "wifi_connect.h"
 
 #ifdef CONFIG_USE_WIFI_PROVISIONING_SOFTAP
 // From IDF examples/provisioning/wifi_prov_mgr/main/app_main.c
@@ -64,7 +67,6 @@ static const char sec2_verifier[] = {
 
 constexpr const char* OAI_NVS_NS = "oai";
 constexpr const char* OAI_API_KEY_NVS_KEY = "oai_api_key";
-constexpr const char* OAI_API_URI_NVS_KEY = "oai_api_uri";
 
 extern const uint8_t index_html_start[] asm("_binary_index_html_start");
 extern const uint8_t index_html_end[]   asm("_binary_index_html_end");
@@ -100,12 +102,11 @@ esp_err_t oai_has_api_key(bool& has_api_key)
 }
 
 /**
- * Get the API key from the NVS
+ * Load the API key from the NVS into the RAM once
  */
-esp_err_t oai_get_api_key(std::vector<char>& api_key)
+static esp_err_t oai_load_api_key()
 {
   if( s_api_key.size() > 0 ) {
-    api_key = s_api_key;
     return ESP_OK;
   }
 
@@ -122,13 +123,39 @@ esp_err_t oai_get_api_key(std::vector<char>& api_key)
 
   s_api_key.resize(required_size);
   if( esp_err_t err = nvs_get_str(nvs_handle, OAI_API_KEY_NVS_KEY, s_api_key.data(), &required_size); err != ESP_OK ) {
+      s_api_key.clear();
       nvs_close(nvs_handle);
       return err;
   }
 
+  nvs_close(nvs_handle);
+  return ESP_OK;
+}
+
+/**
+ * Get the API key from the NVS
+ */
+esp_err_t oai_get_api_key(std::vector<char>& api_key)
+{
+  if( esp_err_t err = oai_load_api_key(); err != ESP_OK ) {
+    return err;
+  }
   api_key = s_api_key;
+  return ESP_OK;
+}
 
-  nvs_close(nvs_handle);
+/**
+ * Copy the API key into a caller-owned buffer, for the signaling path
+ */
+esp_err_t oai_get_api_key(char* api_key, size_t size)
+{
+  if( esp_err_t err = oai_load_api_key(); err != ESP_OK ) {
+    return err;
+  }
+  if( s_api_key.size() > size ) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(api_key, s_api_key.data(), s_api_key.size());
   return ESP_OK;
 }
 
@@ -171,65 +198,30 @@ esp_err_t oai_set_api_key(const char* api_key)
 }
 
 /**
- * Get the API URI from the NVS or the default value
+ * Get the API URI from the settings
  */
 esp_err_t oai_get_api_uri(std::string& api_uri)
 {
-  nvs_handle_t nvs_handle;
-  if( esp_err_t err = nvs_open(OAI_NVS_NS, NVS_READONLY, &nvs_handle); err != ESP_OK ) {
-      return err;
-  }
-
-  size_t required_size = 0;
-  esp_err_t err = nvs_get_str(nvs_handle, OAI_API_URI_NVS_KEY, nullptr, &required_size);
-  if( err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND ) {
-      nvs_close(nvs_handle);
-      return err;
-  }
-
-  if( err == ESP_ERR_NVS_NOT_FOUND ) {
-    api_uri = OPENAI_REALTIMEAPI;
-    return ESP_OK;
-  }
-
-  std::vector<char> api_uri_buf(required_size);
-  if( esp_err_t err = nvs_get_str(nvs_handle, OAI_API_URI_NVS_KEY, api_uri_buf.data(), &required_size); err != ESP_OK ) {
-      nvs_close(nvs_handle);
-      return err;
-  }
-
-  api_uri = api_uri_buf.data();
-
-  nvs_close(nvs_handle);
+  OaiSettings settings;
+  oai_settings_get(&settings);
+  api_uri = settings.api_uri;
   return ESP_OK;
 }
 
 /**
- * Set the API URI in the NVS
+ * Set the API URI in the settings
  */
 esp_err_t oai_set_api_uri(const char* api_uri)
 {
   assert(api_uri != nullptr);
 
-  nvs_handle_t nvs_handle;
-  if( esp_err_t err = nvs_open(OAI_NVS_NS, NVS_READWRITE, &nvs_handle); err != ESP_OK ) {
-      return err;
+  OaiSettings settings;
+  oai_settings_get(&settings);
+  if( strlen(api_uri) >= sizeof(settings.api_uri) ) {
+    return ESP_ERR_INVALID_SIZE;
   }
-
-  esp_err_t ret = nvs_set_str(nvs_handle, OAI_API_URI_NVS_KEY, api_uri);
-  if( ret != ESP_OK ) {
-      nvs_close(nvs_handle);
-      return ret;
-  }
-
-  ret = nvs_commit(nvs_handle);
-  if( ret != ESP_OK ) {
-      nvs_close(nvs_handle);
-      return ret;
-  }
-
-  nvs_close(nvs_handle);
-  return ESP_OK;
+  strcpy(settings.api_uri, api_uri);
+  return oai_settings_set(settings);
 }
 
 static esp_err_t config_http_get_handler(httpd_req_t* req)
@@ -262,6 +254,15 @@ static esp_err_t config_http_get_handler(httpd_req_t* req)
     httpd_resp_set_status(req, "200 OK");
     httpd_resp_set_type(req, "text/plain");
     httpd_resp_send(req, api_uri.c_str(), api_uri.size());
+  } else if( strncmp(req->uri, "/config", 8) == 0 ) {
+    OaiSettings settings;
+    oai_settings_get(&settings);
+    char json[512];
+    JsonWriter w(json, sizeof(json));
+    oai_settings_to_json(settings, w);
+    httpd_resp_set_status(req, "200 OK");
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, json, w.size());
   } else {
     httpd_resp_set_status(req, "404 Not Found");
     httpd_resp_set_type(req, "text/plain");
@@ -307,6 +308,19 @@ static esp_err_t config_http_post_handler(httpd_req_t* req)
       ESP_LOGE(LOG_TAG, "Failed to store the API URI in the NVS - %s(%d)", esp_err_to_name(err), err);
       return err;
     }
+  } else if( strncmp(req->uri, "/config", 8) == 0 ) {
+    OaiSettings settings;
+    oai_settings_get(&settings);
+    esp_err_t err = oai_settings_from_json(buf.data(), &settings);
+    if( err == ESP_OK ) {
+      err = oai_settings_set(settings);
+    }
+    if( err != ESP_OK ) {
+      httpd_resp_set_status(req, err == ESP_ERR_INVALID_ARG ? "400 Bad Request" : "500 Internal Server Error");
+      httpd_resp_set_type(req, "text/plain");
+      httpd_resp_send(req, esp_err_to_name(err), HTTPD_RESP_USE_STRLEN);
+      return ESP_OK;
+    }
   } else {
     ESP_LOGW(LOG_TAG, "Unknown POST request: %s", buf.data());
     return ESP_FAIL;
@@ -326,6 +340,8 @@ static esp_err_t  oai_config_httpd_start()
     return ESP_OK;
   }
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  // One GET handler for "/" and one handler per entry of get_uris and post_uris.
+  config.max_uri_handlers = 10;
   if( auto err = httpd_start(&s_config_server, &config); err != ESP_OK ) {
     return err;
   }
@@ -338,7 +354,7 @@ static esp_err_t  oai_config_httpd_start()
   };
   
   httpd_register_uri_handler(s_config_server, &config_http_get_uri);
-  const char* get_uris[] = {"/index.html", "/api_key", "/api_uri"};
+  const char* get_uris[] = {"/index.html", "/api_key", "/api_uri", "/config"};
   for( const auto& uri : get_uris ) {
     httpd_uri_t uri_handler = {
       .uri       = uri,
@@ -348,7 +364,7 @@ static esp_err_t  oai_config_httpd_start()
     };
     httpd_register_uri_handler(s_config_server, &uri_handler);
   }
-  const char* post_uris[] = {"/api_key", "/api_uri", "/reboot"};
+  const char* post_uris[] = {"/api_key", "/api_uri", "/config", "/reboot"};
   for( const auto& uri : post_uris ) {
     httpd_uri_t uri_handler = {
       .uri       = uri,
@@ -382,33 +398,14 @@ static esp_err_t oai_config_httpd_stop()
   s_config_server = nullptr;
   return ESP_OK;
 }
-#else // CONFIG_USE_WIFI_PROVISIONING_SOFTAP
-/**
- * Get the API URI from the default value
- */
-esp_err_t oai_get_api_uri(std::string& api_uri)
-{
-  api_uri = CONFIG_OPENAI_REALTIMEAPI;
-  return ESP_OK;
-}
 #endif // CONFIG_USE_WIFI_PROVISIONING_SOFTAP
 
-static bool g_wifi_connected = false;
-
+// Connecting and reconnecting is left to wifi_connect.cpp.
 static void oai_event_handler(void *arg, esp_event_base_t event_base,
                               int32_t event_id, void *event_data) {
-  static int s_retry_num = 0;
-  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-    if (s_retry_num < 5) {
-      esp_wifi_connect();
-      s_retry_num++;
-      ESP_LOGI(LOG_TAG, "retry to connect to the AP");
-    }
-    ESP_LOGI(LOG_TAG, "connect to the AP fail");
-  } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+  if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
     ESP_LOGI(LOG_TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-    g_wifi_connected = true;
   }
 
 #ifdef CONFIG_USE_WIFI_PROVISIONING_SOFTAP
@@ -472,8 +469,6 @@ static void wifi_prov_print_qr(const char *name, const char *username, const cha
 #endif
 
 void oai_wifi(void) {
-  ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
-                                             &oai_event_handler, NULL));
   ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
                                              &oai_event_handler, NULL));
 #ifdef CONFIG_USE_WIFI_PROVISIONING_SOFTAP
@@ -491,6 +486,7 @@ void oai_wifi(void) {
 
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+  oai_wifi_manager_init(sta_netif);
 
 #ifndef CONFIG_USE_WIFI_PROVISIONING_SOFTAP
   // Start WiFi in station mode
@@ -504,10 +500,13 @@ void oai_wifi(void) {
           sizeof(wifi_config.sta.ssid));
   strncpy((char *)wifi_config.sta.password, (char *)CONFIG_WIFI_PASSWORD,
           sizeof(wifi_config.sta.password));
+  // Beacon intervals between wake-ups in maximum modem sleep.
+  wifi_config.sta.listen_interval = CONFIG_WIFI_PS_LISTEN_INTERVAL;
 
   ESP_ERROR_CHECK(esp_wifi_set_config(
       static_cast<wifi_interface_t>(ESP_IF_WIFI_STA), &wifi_config));
-  ESP_ERROR_CHECK(esp_wifi_connect());
+  oai_wifi_manager_start();
+  oai_wifi_wait_connected(portMAX_DELAY);
 #else // CONFIG_USE_WIFI_PROVISIONING_SOFTAP
   wifi_prov_mgr_config_t config = {
       .scheme = wifi_prov_scheme_softap,
@@ -541,14 +540,17 @@ void oai_wifi(void) {
   } else {
     ESP_LOGI(LOG_TAG, "Already provisioned, starting WiFi");
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    wifi_config_t wifi_config;
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config));
+    wifi_config.sta.listen_interval = CONFIG_WIFI_PS_LISTEN_INTERVAL;
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
     ESP_ERROR_CHECK(esp_wifi_start());
-    ESP_ERROR_CHECK(esp_wifi_connect());
   }
 
-  // block until we get an IP address
-  while (!g_wifi_connected) {
-    vTaskDelay(pdMS_TO_TICKS(200));
-  }
+  // The provisioning manager may have connected already, from here on
+  // reconnects are ours. Block until we get an IP address.
+  oai_wifi_manager_start();
+  oai_wifi_wait_connected(portMAX_DELAY);
 
   bool has_api_key = false;
   if( auto err = oai_has_api_key(has_api_key); err != ESP_OK || !has_api_key || reset_provisioning ) {
@@ -571,4 +573,6 @@ void oai_wifi(void) {
   }
 
 #endif // CONFIG_USE_WIFI_PROVISIONING_SMARTCONFIG
+
+  oai_power_init();
 }
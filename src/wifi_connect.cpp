@@ -0,0 +1,339 @@
+#include "wifi_connect.h"
+
+#include <assert.h>
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <freertos/event_groups.h>
+#include <nvs.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+
+constexpr const char *TAG = "wifi_connect";
+
+ESP_EVENT_DEFINE_BASE(OAI_WIFI_EVENT);
+
+namespace {
+
+constexpr EventBits_t kConnectedBit = BIT0;
+constexpr int32_t kRetryEvent = 0;
+
+constexpr const char *kNvsNamespace = "oai_wifi";
+constexpr const char *kNvsCacheKey = "cache";
+constexpr uint32_t kCacheVersion = 1;
+
+enum class Phase : uint8_t {
+  kIdle,
+  kScan,
+  kConnect,
+  kDhcp,
+};
+
+// Persisted after every successful connect.
+struct WifiCache {
+  uint32_t version;
+  uint8_t bssid[6];
+  uint8_t channel;
+  esp_netif_ip_info_t ip_info;
+};
+
+// Everything below is only touched from the default event loop task, except
+// for the event group and s_last_timing.
+EventGroupHandle_t s_event_group = nullptr;
+esp_timer_handle_t s_retry_timer = nullptr;
+bool s_active = false;
+Phase s_phase = Phase::kIdle;
+bool s_cache_valid = false;
+WifiCache s_cache;
+// Failed attempts since the last successful connect.
+uint32_t s_failures = 0;
+int64_t s_attempt_us = 0;
+int64_t s_phase_us = 0;
+OaiWifiConnectTiming s_timing;
+// Too large for the event loop task stack.
+wifi_ap_record_t s_scan_records[8];
+
+portMUX_TYPE s_timing_lock = portMUX_INITIALIZER_UNLOCKED;
+OaiWifiConnectTiming s_last_timing;
+
+uint32_t elapsed_ms(int64_t since_us) {
+  return (esp_timer_get_time() - since_us) / 1000;
+}
+
+void load_cache() {
+  nvs_handle_t nvs;
+  if (nvs_open(kNvsNamespace, NVS_READONLY, &nvs) != ESP_OK) {
+    return;
+  }
+  size_t size = sizeof(s_cache);
+  s_cache_valid = nvs_get_blob(nvs, kNvsCacheKey, &s_cache, &size) == ESP_OK &&
+                  size == sizeof(s_cache) && s_cache.version == kCacheVersion;
+  nvs_close(nvs);
+}
+
+void save_cache(const WifiCache &cache) {
+  if (s_cache_valid && memcmp(&cache, &s_cache, sizeof(cache)) == 0) {
+    return;
+  }
+  s_cache = cache;
+  s_cache_valid = true;
+
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(kNvsNamespace, NVS_READWRITE, &nvs);
+  if (err == ESP_OK) {
+    err = nvs_set_blob(nvs, kNvsCacheKey, &cache, sizeof(cache));
+    if (err == ESP_OK) {
+      err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to save the connection cache: %s",
+             esp_err_to_name(err));
+  }
+}
+
+void schedule_retry();
+
+void connect_to(const uint8_t *bssid, uint8_t channel) {
+  wifi_config_t config;
+  ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &config));
+  config.sta.bssid_set = true;
+  memcpy(config.sta.bssid, bssid, sizeof(config.sta.bssid));
+  config.sta.channel = channel;
+  config.sta.scan_method = WIFI_FAST_SCAN;
+  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &config));
+
+  s_phase = Phase::kConnect;
+  s_phase_us = esp_timer_get_time();
+  if (esp_err_t err = esp_wifi_connect(); err != ESP_OK) {
+    ESP_LOGW(TAG, "esp_wifi_connect failed: %s", esp_err_to_name(err));
+    schedule_retry();
+  }
+}
+
+void start_scan() {
+  wifi_config_t config;
+  ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &config));
+  wifi_scan_config_t scan = {};
+  scan.ssid = config.sta.ssid;
+  scan.show_hidden = true;
+
+  s_phase = Phase::kScan;
+  s_phase_us = esp_timer_get_time();
+  if (esp_err_t err = esp_wifi_scan_start(&scan, false); err != ESP_OK) {
+    ESP_LOGW(TAG, "Scan failed to start: %s", esp_err_to_name(err));
+    schedule_retry();
+  }
+}
+
+void connect_start() {
+  s_timing = {};
+  s_timing.attempts = s_failures + 1;
+  s_attempt_us = esp_timer_get_time();
+#ifdef CONFIG_WIFI_FAST_CONNECT
+  if (s_cache_valid) {
+    s_timing.warm = true;
+    connect_to(s_cache.bssid, s_cache.channel);
+    return;
+  }
+#endif  // CONFIG_WIFI_FAST_CONNECT
+  start_scan();
+}
+
+void schedule_retry() {
+  s_phase = Phase::kIdle;
+  uint32_t attempt = s_failures++;
+  if (attempt == 0) {
+    connect_start();
+    return;
+  }
+
+  uint32_t delay = CONFIG_WIFI_RECONNECT_BACKOFF_MAX_MS;
+  if (attempt < 16) {
+    delay = std::min<uint32_t>(
+        CONFIG_WIFI_RECONNECT_BACKOFF_BASE_MS << (attempt - 1), delay);
+  }
+  delay = delay / 2 + esp_random() % (delay / 2 + 1);
+  ESP_LOGI(TAG, "Reconnecting in %lu ms (attempt %lu)", (unsigned long)delay,
+           (unsigned long)attempt + 1);
+  esp_err_t err = esp_timer_start_once(s_retry_timer, delay * 1000ULL);
+  if (err == ESP_ERR_INVALID_STATE) {
+    // A retry is already pending, keep its deadline.
+    return;
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to arm the reconnect timer: %s",
+             esp_err_to_name(err));
+  }
+}
+
+void on_scan_done() {
+  s_timing.scan_ms = elapsed_ms(s_phase_us);
+  uint16_t count = std::size(s_scan_records);
+  if (esp_wifi_scan_get_ap_records(&count, s_scan_records) != ESP_OK ||
+      count == 0) {
+    ESP_LOGW(TAG, "Access point not found");
+    schedule_retry();
+    return;
+  }
+
+  const wifi_ap_record_t *best = std::max_element(
+      s_scan_records, s_scan_records + count,
+      [](const wifi_ap_record_t &a, const wifi_ap_record_t &b) {
+        return a.rssi < b.rssi;
+      });
+  ESP_LOGI(TAG, "Found %u access points in %lu ms, using channel %u (%d dBm)",
+           count, (unsigned long)s_timing.scan_ms, best->primary, best->rssi);
+  connect_to(best->bssid, best->primary);
+}
+
+void on_got_ip(const ip_event_got_ip_t *event) {
+  if (s_phase == Phase::kDhcp) {
+    s_timing.dhcp_ms = elapsed_ms(s_phase_us);
+  }
+  s_timing.total_ms = elapsed_ms(s_attempt_us);
+  s_phase = Phase::kIdle;
+  s_failures = 0;
+
+  bool lease_reused = s_cache_valid &&
+                      s_cache.ip_info.ip.addr == event->ip_info.ip.addr;
+  ESP_LOGI(TAG,
+           "Connected in %lu ms (%s, scan %lu ms, auth+assoc %lu ms, dhcp "
+           "%lu ms, %lu attempts)%s",
+           (unsigned long)s_timing.total_ms, s_timing.warm ? "warm" : "cold",
+           (unsigned long)s_timing.scan_ms, (unsigned long)s_timing.connect_ms,
+           (unsigned long)s_timing.dhcp_ms, (unsigned long)s_timing.attempts,
+           lease_reused ? ", lease reused" : "");
+  portENTER_CRITICAL(&s_timing_lock);
+  s_last_timing = s_timing;
+  portEXIT_CRITICAL(&s_timing_lock);
+
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+    WifiCache cache = {};
+    cache.version = kCacheVersion;
+    memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+    cache.channel = ap.primary;
+    cache.ip_info = event->ip_info;
+    save_cache(cache);
+  }
+  xEventGroupSetBits(s_event_group, kConnectedBit);
+}
+
+void on_disconnected(const wifi_event_sta_disconnected_t *event) {
+  xEventGroupClearBits(s_event_group, kConnectedBit);
+  if (!s_active) {
+    return;
+  }
+
+  ESP_LOGW(TAG, "Disconnected, reason %u", event->reason);
+  if (s_phase == Phase::kConnect && s_timing.warm) {
+    // The cached access point is gone or moved, scan on the next attempt.
+    s_cache_valid = false;
+  }
+  schedule_retry();
+}
+
+void event_handler(void *arg, esp_event_base_t base, int32_t id,
+                   void *data) {
+  if (base == WIFI_EVENT) {
+    switch (id) {
+      case WIFI_EVENT_SCAN_DONE:
+        if (s_phase == Phase::kScan) {
+          on_scan_done();
+        }
+        break;
+      case WIFI_EVENT_STA_CONNECTED:
+        if (s_phase == Phase::kConnect) {
+          s_timing.connect_ms = elapsed_ms(s_phase_us);
+          s_phase = Phase::kDhcp;
+          s_phase_us = esp_timer_get_time();
+        }
+        break;
+      case WIFI_EVENT_STA_DISCONNECTED:
+        on_disconnected((wifi_event_sta_disconnected_t *)data);
+        break;
+      default:
+        break;
+    }
+  } else if (base == IP_EVENT && id == IP_EVENT_STA_GOT_IP) {
+    on_got_ip((ip_event_got_ip_t *)data);
+  } else if (base == OAI_WIFI_EVENT && id == kRetryEvent) {
+    connect_start();
+  }
+}
+
+}  // namespace
+
+void oai_wifi_manager_init(esp_netif_t *sta_netif) {
+  s_event_group = xEventGroupCreate();
+  assert(s_event_group != nullptr);
+
+  // Retries are posted to the event loop so that all state changes happen
+  // on one task.
+  esp_timer_create_args_t timer_args = {
+      .callback =
+          [](void *arg) {
+            esp_event_post(OAI_WIFI_EVENT, kRetryEvent, nullptr, 0, 0);
+          },
+      .arg = nullptr,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "wifi_retry",
+      .skip_unhandled_events = false,
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_retry_timer));
+
+  ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+                                             &event_handler, nullptr));
+  ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
+                                             &event_handler, nullptr));
+  ESP_ERROR_CHECK(esp_event_handler_register(OAI_WIFI_EVENT, kRetryEvent,
+                                             &event_handler, nullptr));
+
+  load_cache();
+  if (s_cache_valid) {
+    ESP_LOGI(TAG, "Cached access point on channel %u", s_cache.channel);
+  }
+
+#ifdef CONFIG_WIFI_IP_STATIC
+  ESP_ERROR_CHECK(esp_netif_dhcpc_stop(sta_netif));
+  esp_netif_ip_info_t ip_info = {};
+  ip_info.ip.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_IP);
+  ip_info.netmask.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_NETMASK);
+  ip_info.gw.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_GATEWAY);
+  ESP_ERROR_CHECK(esp_netif_set_ip_info(sta_netif, &ip_info));
+  esp_netif_dns_info_t dns = {};
+  dns.ip.type = ESP_IPADDR_TYPE_V4;
+  dns.ip.u_addr.ip4.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_DNS);
+  ESP_ERROR_CHECK(esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns));
+#endif  // CONFIG_WIFI_IP_STATIC
+}
+
+void oai_wifi_manager_start() {
+  // s_active is read by the event loop task, the event is processed after
+  // it has been set.
+  s_active = true;
+  if (xEventGroupGetBits(s_event_group) & kConnectedBit) {
+    return;
+  }
+  ESP_ERROR_CHECK(esp_event_post(OAI_WIFI_EVENT, kRetryEvent, nullptr, 0,
+                                 portMAX_DELAY));
+}
+
+bool oai_wifi_wait_connected(TickType_t timeout) {
+  return xEventGroupWaitBits(s_event_group, kConnectedBit, pdFALSE, pdTRUE,
+                             timeout) &
+         kConnectedBit;
+}
+
+OaiWifiConnectTiming oai_wifi_connect_timing() {
+  portENTER_CRITICAL(&s_timing_lock);
+  OaiWifiConnectTiming timing = s_last_timing;
+  portEXIT_CRITICAL(&s_timing_lock);
+  return timing;
+}
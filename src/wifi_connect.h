@@ -0,0 +1,35 @@
+#pragma once
+
+#include <esp_netif.h>
+#include <freertos/FreeRTOS.h>
+#include <stdint.h>
+
+// Wi-Fi station connection manager.
+//
+// The BSSID, channel and IP lease of the last successful connection are
+// kept in NVS. A warm connect goes straight to the cached access point,
+// a cold one scans for the configured SSID first and picks the strongest
+// access point. Lost connections are retried forever with backoff.
+
+struct OaiWifiConnectTiming {
+  // The BSSID and channel came from the cache, no scan was needed.
+  bool warm;
+  // Attempts it took, including the successful one.
+  uint32_t attempts;
+  uint32_t scan_ms;
+  // Authentication and association, the driver reports them as one step.
+  uint32_t connect_ms;
+  uint32_t dhcp_ms;
+  uint32_t total_ms;
+};
+
+// Loads the cache and registers the event handlers. Called once after
+// esp_wifi_init(), before Wi-Fi is started.
+void oai_wifi_manager_init(esp_netif_t *sta_netif);
+// Starts connecting and takes over reconnects. Does nothing but take over
+// if the station is already connected, e.g. by the provisioning manager.
+void oai_wifi_manager_start();
+// Returns false if not connected within timeout.
+bool oai_wifi_wait_connected(TickType_t timeout);
+// Phase timing of the last successful connect.
+OaiWifiConnectTiming oai_wifi_connect_timing();